@@ -0,0 +1,356 @@
+/**
+ * @file        buffer_scanner.h
+ * @short       MQA identification of flac streams held in memory or read through a callback
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <FLAC++/decoder.h>
+
+#include "flac_stream.h"
+
+
+/**
+ * Reusable scanner of in-memory flac streams.
+ * One libFLAC decoder serves every scan: it is reset between streams instead of being rebuilt, the metadata is
+ * read by the scanner itself (libFLAC only gets STREAMINFO, so it allocates nothing for seek tables or comments)
+ * and samples are searched as they are decoded rather than kept. Once the scanner has seen its largest format a
+ * scan allocates nothing, but for an MQAENCODER tag longer than any seen before and, for streams read through a
+ * callback, a VORBIS_COMMENT block larger than any seen before.
+ * Not thread safe, use one scanner per thread.
+ */
+class BufferScanner {
+ public:
+  /**
+   * Read callback: fill buffer with up to bytes bytes of the stream, return how many (0 at its end, kReadError
+   * on failure)
+   */
+  using ReadFn = size_t (*)(void *context, uint8_t *buffer, size_t bytes);
+
+  static constexpr size_t kReadError = SIZE_MAX;
+
+  BufferScanner() = default;
+
+  BufferScanner(const BufferScanner &) = delete;
+  BufferScanner &operator=(const BufferScanner &) = delete;
+
+  /**
+   * @short Identify a flac stream held in memory
+   * @return whether it is MQA
+   */
+  bool scan(const uint8_t *data, size_t size) {
+      static const uint8_t empty = 0;
+      this->decoder_.data = data ? data : &empty;
+      this->decoder_.size = data ? size : 0;
+      this->decoder_.read = nullptr;
+      return this->run();
+  }
+
+  /**
+   * @short Identify a flac stream read through a callback, from its first byte (no seeking)
+   */
+  bool scan(ReadFn read, void *context) {
+      this->decoder_.data = nullptr;
+      this->decoder_.read = read;
+      this->decoder_.context = context;
+      return this->run();
+  }
+
+  /**
+   * @short Identify a flac stream read through a callable taking (uint8_t *buffer, size_t bytes), see ReadFn
+   */
+  template <class Read>
+  bool scan(Read &read) {
+      return this->scan([](void *context, uint8_t *buffer, size_t bytes) -> size_t {
+          return (*static_cast<Read *>(context))(buffer, bytes);
+      }, &read);
+  }
+
+  /**
+   * @short First error met while decoding the last stream, empty if there was none
+   */
+  [[nodiscard]] const std::string &error() const noexcept { return this->decoder_.error; }
+
+  /**
+   * @short Whether the last stream got to a result, MQA or not (it may have had decoder errors on the way)
+   */
+  [[nodiscard]] bool identified() const noexcept { return this->decoder_.stream.identified(); }
+
+  [[nodiscard]] bool isMQA() const noexcept { return this->found_.isMQA; }
+  [[nodiscard]] bool isMQAStudio() const noexcept { return this->found_.isMQAStudio; }
+  [[nodiscard]] uint32_t originalSampleRate() const noexcept { return this->found_.originalSampleRate; }
+  [[nodiscard]] const std::string &getMQA_encoder() const noexcept { return this->decoder_.stream.mqa_encoder; }
+  [[nodiscard]] uint32_t sampleRate() const noexcept { return this->decoder_.stream.sample_rate; }
+  [[nodiscard]] uint32_t bitsPerSample() const noexcept { return this->decoder_.stream.bps; }
+
+  /**
+   * @short Number of bytes of the last stream read by the decoder
+   */
+  [[nodiscard]] uint64_t bytesRead() const noexcept { return this->decoder_.bytes_read; }
+
+ private:
+  class Decoder : public FLAC::Decoder::Stream {
+   public:
+    // source: a buffer, or a callback when data is null
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    ReadFn read = nullptr;
+    void *context = nullptr;
+
+    uint64_t bytes_read = 0;
+    FlacStream stream;
+    std::string error;
+    bool initialized = false;
+
+    ~Decoder() override {
+        (void) this->finish();
+    }
+
+    /**
+     * @short Rewind the decoder to a new stream, keeping its buffers
+     */
+    bool restart() {
+        this->bytes_read = 0;
+        this->head_used_ = 0;
+        this->stream.reset();
+        this->error.clear();
+
+        if (this->initialized && this->reset())
+            return true;
+        if (this->initialized)
+            (void) this->finish();
+        const auto status = this->init();
+        this->initialized = status == FLAC__STREAM_DECODER_INIT_STATUS_OK;
+        if (!this->initialized)
+            this->error = FLAC__StreamDecoderInitStatusString[status];
+        return this->initialized;
+    }
+
+    /**
+     * @short Read the metadata of the stream ahead of libFLAC, up to its first frame
+     * libFLAC parses every SEEKTABLE into a new allocation, and hands a VORBIS_COMMENT over as a copy of its
+     * comments, so it only gets STREAMINFO: the blocks are walked here, the MQAENCODER tag taken straight from
+     * the raw VORBIS_COMMENT, and the decoder reads a stream made of STREAMINFO alone followed by the frames.
+     * @return false if the stream isn't a flac stream
+     */
+    bool readMetadata() {
+        uint8_t header[10];
+        if (!this->take(header, 4))
+            return this->fail("not a flac stream");
+        // an ID3v2 tag ahead of the stream is skipped, as libFLAC does
+        if (std::memcmp(header, "ID3", 3) == 0) {
+            if (!this->take(header + 4, 6))
+                return this->fail("not a flac stream");
+            const uint64_t length = uint64_t(header[6] & 0x7f) << 21 | uint32_t(header[7] & 0x7f) << 14
+                                    | uint32_t(header[8] & 0x7f) << 7 | (header[9] & 0x7f);
+            if (!this->skip(length + (header[5] & 0x10 ? 10 : 0)) || !this->take(header, 4))
+                return this->fail("not a flac stream");
+        }
+        if (std::memcmp(header, "fLaC", 4) != 0)
+            return this->fail("not a flac stream");
+
+        bool last = false;
+        for (bool first = true; !last; first = false) {
+            if (!this->take(header, 4))
+                return this->fail(kTruncated);
+            last = header[0] & 0x80;
+            const auto type = header[0] & 0x7f;
+            const size_t length = size_t(header[1]) << 16 | size_t(header[2]) << 8 | header[3];
+
+            if (first != (type == FLAC__METADATA_TYPE_STREAMINFO) || (first && length != kStreamInfoLength))
+                return this->fail("no STREAMINFO at the start of the stream");
+            if (first) {
+                std::memcpy(this->head_.data(), "fLaC", 4);
+                this->head_[4] = 0x80 | FLAC__METADATA_TYPE_STREAMINFO;     // the last block libFLAC sees
+                std::memcpy(this->head_.data() + 5, header + 1, 3);
+                if (!this->take(this->head_.data() + 8, kStreamInfoLength))
+                    return this->fail(kTruncated);
+            } else if (type == FLAC__METADATA_TYPE_VORBIS_COMMENT) {
+                const uint8_t *block = this->data ? this->peek(length) : this->load(length);
+                if (!block)
+                    return this->fail(kTruncated);
+                this->comments(block, length);
+            } else if (!this->skip(length)) {
+                return this->fail(kTruncated);
+            }
+        }
+        return true;
+    }
+
+   protected:
+    ::FLAC__StreamDecoderReadStatus read_callback(FLAC__byte buffer[], size_t *bytes) override {
+        if (*bytes == 0)
+            return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+        // the head made of STREAMINFO, then the frames where readMetadata() left the source
+        if (this->head_used_ < this->head_.size()) {
+            *bytes = std::min(*bytes, this->head_.size() - this->head_used_);
+            std::memcpy(buffer, this->head_.data() + this->head_used_, *bytes);
+            this->head_used_ += *bytes;
+            return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+        }
+        const auto got = this->source(buffer, *bytes);
+        if (got == kReadError)
+            return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+        *bytes = got;
+        return *bytes == 0 ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM : FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+    }
+
+    ::FLAC__StreamDecoderWriteStatus write_callback(const ::FLAC__Frame *frame,
+                                                    const FLAC__int32 *const buffer[]) override {
+        (void) this->stream.frame(frame, buffer);
+        return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+
+    void metadata_callback(const ::FLAC__StreamMetadata *metadata) override {
+        this->stream.metadata(metadata);
+    }
+
+    void error_callback(::FLAC__StreamDecoderErrorStatus status) override {
+        if (this->error.empty()) this->error = FLAC__StreamDecoderErrorStatusString[status];
+    }
+
+   private:
+    static constexpr size_t kStreamInfoLength = 34;
+    static constexpr const char *kTruncated = "truncated metadata";
+
+    std::array<uint8_t, 8 + kStreamInfoLength> head_{};     // "fLaC", STREAMINFO header and body
+    size_t head_used_ = 0;
+    std::vector<uint8_t> comment_;                          // VORBIS_COMMENT read through a callback
+    std::array<uint8_t, 4096> skipped_{};                   // blocks skipped through a callback
+
+
+    bool fail(const char *error) {
+        if (this->error.empty()) this->error = error;
+        return false;
+    }
+
+    /**
+     * @short Read up to bytes bytes of the source, fewer only at its end
+     * @return how many, kReadError on failure
+     */
+    size_t source(uint8_t *buffer, size_t bytes) {
+        size_t got;
+        if (this->data) {
+            got = std::min<size_t>(bytes, this->size - this->bytes_read);
+            std::memcpy(buffer, this->data + this->bytes_read, got);
+        } else {
+            got = this->read(this->context, buffer, bytes);
+            if (got == kReadError) {
+                if (this->error.empty()) this->error = "read error";
+                return kReadError;
+            }
+            got = std::min(got, bytes);
+        }
+        this->bytes_read += got;
+        return got;
+    }
+
+    /**
+     * @short Read exactly bytes bytes of the source (a callback may hand them over in pieces)
+     */
+    bool take(uint8_t *buffer, size_t bytes) {
+        while (bytes > 0) {
+            const auto got = this->source(buffer, bytes);
+            if (got == kReadError || got == 0)
+                return false;
+            buffer += got;
+            bytes -= got;
+        }
+        return true;
+    }
+
+    bool skip(uint64_t bytes) {
+        if (this->data) {
+            if (bytes > this->size - this->bytes_read)
+                return false;
+            this->bytes_read += bytes;
+            return true;
+        }
+        for (; bytes > 0; ) {
+            const auto part = static_cast<size_t>(std::min<uint64_t>(bytes, this->skipped_.size()));
+            if (!this->take(this->skipped_.data(), part))
+                return false;
+            bytes -= part;
+        }
+        return true;
+    }
+
+    // the next length bytes of a buffer, read in place
+    const uint8_t *peek(size_t length) {
+        if (length > this->size - this->bytes_read)
+            return nullptr;
+        const auto *block = this->data + this->bytes_read;
+        this->bytes_read += length;
+        return block;
+    }
+
+    // the next length bytes read through the callback, into a buffer that only grows
+    const uint8_t *load(size_t length) {
+        if (this->comment_.size() < length)
+            this->comment_.resize(length);
+        return this->take(this->comment_.data(), length) ? this->comment_.data() : nullptr;
+    }
+
+    /**
+     * @short Hand the comments of a raw VORBIS_COMMENT block to the stream (lengths little endian, a damaged
+     * block is read up to its damage)
+     */
+    void comments(const uint8_t *block, size_t length) {
+        const auto le32 = [block](size_t at) {
+            return uint32_t(block[at]) | uint32_t(block[at + 1]) << 8 | uint32_t(block[at + 2]) << 16
+                   | uint32_t(block[at + 3]) << 24;
+        };
+        if (length < 4 || le32(0) > length - 4)
+            return;
+        size_t at = 4 + le32(0);                    // past the vendor string
+        if (length - at < 4)
+            return;
+        auto count = le32(at);
+        at += 4;
+        for (; count > 0 && length - at >= 4; count--) {
+            const auto entry = le32(at);
+            at += 4;
+            if (entry > length - at)
+                return;
+            this->stream.comment(reinterpret_cast<const char *>(block + at), entry);
+            at += entry;
+        }
+    }
+  };
+
+  Decoder decoder_;
+  MQAStream found_;
+
+
+  bool run() {
+      this->found_ = MQAStream{};
+      if (!this->decoder_.restart() || !this->decoder_.readMetadata())
+          return false;
+
+      auto &stream = this->decoder_.stream;
+      bool ok = this->decoder_.process_until_end_of_metadata();
+      if (ok && !stream.supported()) {
+          if (this->decoder_.error.empty()) this->decoder_.error = FlacStream::kUnsupported;
+          return false;
+      }
+
+      // decoding stops once the result is known, up to the first 3 seconds (shorter streams end early)
+      while (ok && stream.detection() == MQADetector::Result::Pending
+             && this->decoder_.get_state() != FLAC__STREAM_DECODER_END_OF_STREAM)
+          ok = this->decoder_.process_single();
+      if (ok)
+          stream.finish();
+      if (!ok && this->decoder_.error.empty())
+          this->decoder_.error = this->decoder_.get_state().resolved_as_cstring(this->decoder_);
+
+      this->found_ = stream.found();
+      return this->found_.isMQA;
+  }
+};
@@ -0,0 +1,173 @@
+/**
+ * @file        checkpoint.h
+ * @short       Journal of completed files to resume interrupted scans
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#ifdef _WIN32
+ #include <io.h>
+#else
+ #include <unistd.h>
+#endif
+
+#include "result_cache.h"
+
+
+/**
+ * Checkpoint journal.
+ * Every finished file is appended to the journal with its result; the journal is fsync'ed every few hundred
+ * files or seconds, so a killed scan loses at most that much work. A resumed run doesn't scan the files found
+ * in the journal again, it reports their journaled results. The journal is removed once a scan completes.
+ */
+class CheckpointJournal {
+ public:
+  /**
+   * Completed file as recorded in the journal
+   */
+  struct Entry {
+      FileResult result;
+      bool added_tags = false;
+  };
+
+  /**
+   * @param file path of the journal
+   * @param resume load the journal of an interrupted run instead of starting a new one
+   */
+  CheckpointJournal(std::string file, bool resume) : file_(std::move(file)) {
+      bool valid = false, torn = false;
+      if (resume)
+          valid = this->load(torn);
+
+      // a journal of another version (or none) is started over
+      this->log_ = std::fopen(this->file_.c_str(), valid ? "ab" : "wb");
+      if (!this->log_)
+          return;
+      if (!valid)
+          std::fprintf(this->log_, "%s\n", kHeader);
+      else if (torn)
+          std::fputc('\n', this->log_);
+      this->last_sync_ = std::chrono::steady_clock::now();
+  }
+
+  ~CheckpointJournal() {
+      if (this->log_)
+          std::fclose(this->log_);
+  }
+
+  [[nodiscard]] bool isOpen() const noexcept { return this->log_ != nullptr; }
+
+  /**
+   * @short Result of a file completed by the interrupted run
+   * @return nullptr if the file still has to be scanned
+   */
+  const Entry *completed(const std::string &path) const {
+      const auto it = this->completed_.find(path);
+      return it == this->completed_.end() ? nullptr : &it->second;
+  }
+
+  [[nodiscard]] size_t resumed() const noexcept { return this->completed_.size(); }
+
+  /**
+   * @short Record a completed file
+   */
+  void record(const std::string &path, const FileResult &result, bool added_tags) {
+      if (!this->log_)
+          return;
+
+      std::ostringstream record;
+      record << result.isMQA() << '\t' << result.isMQAStudio << '\t' << result.originalSampleRate << '\t'
+             << added_tags << '\t' << result.tagged << '\t';
+      escapeField(record, result.mqaEncoder);
+      record << '\t';
+      escapeField(record, path);
+      record << '\n';
+
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      std::fputs(record.str().c_str(), this->log_);
+
+      const auto now = std::chrono::steady_clock::now();
+      if (++this->unsynced_ >= kSyncRecords || now - this->last_sync_ >= kSyncInterval) {
+          this->sync();
+          this->last_sync_ = now;
+      }
+  }
+
+  /**
+   * @short The scan completed, the journal isn't needed anymore
+   */
+  void finish() {
+      if (!this->log_)
+          return;
+      std::fclose(this->log_);
+      this->log_ = nullptr;
+      std::remove(this->file_.c_str());
+  }
+
+ private:
+  static constexpr const char *kHeader = "MQAID-CHECKPOINT 2";
+  static constexpr size_t kSyncRecords = 256;
+  static constexpr std::chrono::seconds kSyncInterval{2};
+
+  std::string file_;
+  std::FILE *log_ = nullptr;
+  std::unordered_map<std::string, Entry> completed_;
+  size_t unsynced_ = 0;
+  std::chrono::steady_clock::time_point last_sync_;
+  std::mutex mutex_;
+
+
+  void sync() {
+      std::fflush(this->log_);
+#ifdef _WIN32
+      _commit(_fileno(this->log_));
+#else
+      fsync(fileno(this->log_));
+#endif
+      this->unsynced_ = 0;
+  }
+
+  /**
+   * @param torn set if the journal ends with a torn record
+   * @return false if there is no journal of this version
+   */
+  bool load(bool &torn) {
+      std::ifstream in(this->file_, std::ios::binary);
+      std::string line;
+      if (!in || !std::getline(in, line) || line != kHeader)
+          return false;
+
+      while (std::getline(in, line)) {
+          // the record being written when the scan was killed is left out
+          if (in.eof()) {
+              torn = !line.empty();
+              break;
+          }
+
+          Entry entry;
+          char *end = nullptr;
+          entry.result.status = std::strtol(line.c_str(), &end, 10) != 0 ? ScanStatus::MQA : ScanStatus::NotMQA;
+          entry.result.isMQAStudio = std::strtol(end, &end, 10) != 0;
+          entry.result.originalSampleRate = static_cast<uint32_t>(std::strtoul(end, &end, 10));
+          entry.added_tags = std::strtol(end, &end, 10) != 0;
+          entry.result.tagged = std::strtol(end, &end, 10) != 0;
+          const char *encoder = end + 1;
+          const char *path = *end == '\t' ? std::strchr(encoder, '\t') : nullptr;
+          if (!path)
+              continue;
+          entry.result.mqaEncoder = unescapeField(std::string(encoder, path));
+          this->completed_[unescapeField(path + 1)] = entry;
+      }
+      return true;
+  }
+};
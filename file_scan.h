@@ -0,0 +1,97 @@
+/**
+ * @file        file_scan.h
+ * @short       Identification of one file, shared by the command line tool and libmqaid
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "mqa_identifier.h"
+#include "pcm_file.h"
+#include "result_cache.h"
+#include "tag_writer.h"
+
+
+/**
+ * Outcome of the identification of a file
+ */
+struct FileScan {
+    ScanStatus status = ScanStatus::Error;
+    bool isMQAStudio = false;
+    uint32_t originalSampleRate = 0;
+    std::string encoder;            // MQAENCODER tag, empty if none
+    std::string error;              // first error met, empty if none (whatever the status)
+    uint64_t bytes_read = 0;
+    uint64_t decoded_samples = 0;
+    bool tags_written = false;      // MQA tags were added to the file
+
+    [[nodiscard]] bool isMQA() const noexcept { return this->status == ScanStatus::MQA; }
+};
+
+
+/**
+ * @short Search an uncompressed file
+ */
+inline FileScan identify(PcmFile &pcm) {
+    FileScan scan;
+    const bool mqa = pcm.detect();
+    scan.status = !pcm.identified() ? ScanStatus::Error : mqa ? ScanStatus::MQA : ScanStatus::NotMQA;
+    scan.error = pcm.error();
+    scan.isMQAStudio = pcm.isMQAStudio();
+    scan.originalSampleRate = pcm.originalSampleRate();
+    scan.bytes_read = pcm.bytesRead();
+    scan.decoded_samples = pcm.decodedSamples();
+    return scan;
+}
+
+
+/**
+ * @short Decode a flac file; the identifier stays open for writeMQATags()
+ */
+inline FileScan identify(MQA_identifier &id) {
+    FileScan scan;
+    const bool mqa = id.detect();
+    // decoder errors on the way don't undo a result, they are reported along with it
+    scan.status = !id.identified() ? ScanStatus::Error : mqa ? ScanStatus::MQA : ScanStatus::NotMQA;
+    scan.error = id.error();
+    scan.isMQAStudio = id.isMQAStudio();
+    scan.originalSampleRate = id.originalSampleRate();
+    scan.encoder = id.getMQA_encoder();
+    scan.bytes_read = id.bytesRead();
+    scan.decoded_samples = id.decodedSamples();
+    return scan;
+}
+
+
+/**
+ * @short Whether a tag update changed the file
+ */
+inline bool tagsAdded(const TagWriteResult &write) noexcept {
+    return write.status == TagWriteStatus::InPlace || write.status == TagWriteStatus::Rewritten;
+}
+
+
+/**
+ * @short Identify a flac or uncompressed file, and add the MQA tags to MQA flac files if asked to
+ * @param add_tags add the MQA tags to the MQA flac files found
+ * @param rewrite_tags rewrite the tags if they already exist
+ * @param padding_reserve padding left when the file has to be rewritten to fit the tags
+ */
+inline FileScan identifyFile(const std::string &file, bool add_tags, bool rewrite_tags, uint32_t padding_reserve) {
+    // uncompressed files are only identified, they have no tags
+    if (isPcmFileName(file)) {
+        PcmFile pcm(file);
+        return identify(pcm);
+    }
+    MQA_identifier id(file, add_tags);
+    FileScan scan = identify(id);
+    if (scan.isMQA() && add_tags) {
+        const auto write = writeMQATags(id, rewrite_tags, padding_reserve);
+        scan.tags_written = tagsAdded(write);
+        if (write.status == TagWriteStatus::Failed && scan.error.empty())
+            scan.error = "couldn't write the MQA tags: " + write.error;
+    }
+    return scan;
+}
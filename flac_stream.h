@@ -0,0 +1,141 @@
+/**
+ * @file        flac_stream.h
+ * @short       What MQA detection takes from a decoded flac stream, shared by the decoders of the tool
+ */
+
+#pragma once
+
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+
+#include <FLAC++/decoder.h>
+
+#include "mqa_detector.h"
+
+
+/**
+ * Flac stream as seen by MQA detection.
+ * Decoders hand it their metadata and frames: it keeps the STREAMINFO fields and the MQAENCODER tag, and feeds
+ * the first three seconds of 16 or 24 bit stereo streams to an MQADetector as they are decoded. Every decoder
+ * of the tool goes through it, so they agree on the streams they identify and on what they find in them.
+ */
+class FlacStream {
+ public:
+  static constexpr const char *kUnsupported = "unsupported stream (only 16bit/24bit stereo)";
+
+  uint32_t sample_rate = 0;
+  uint32_t channels = 0;
+  uint32_t bps = 0;
+  uint32_t max_blocksize = 0;
+  uint64_t total_samples = 0;
+  std::array<FLAC__byte, 16> md5{};
+  std::string mqa_encoder;
+  uint64_t decoded_samples = 0;
+
+  /**
+   * @short Forget the stream, to decode another one (keeps the capacity of the encoder tag)
+   */
+  void reset() {
+      this->sample_rate = this->channels = this->bps = this->max_blocksize = 0;
+      this->total_samples = 0;
+      this->md5 = {};
+      this->mqa_encoder.clear();
+      this->decoded_samples = 0;
+      this->detector_.reset();
+  }
+
+  /**
+   * @short Take what detection needs from a STREAMINFO or VORBIS_COMMENT block
+   */
+  void metadata(const ::FLAC__StreamMetadata *metadata) {
+      if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
+          const auto &info = metadata->data.stream_info;
+          this->sample_rate = info.sample_rate;
+          this->channels = info.channels;
+          this->bps = info.bits_per_sample;
+          this->max_blocksize = info.max_blocksize;
+          this->total_samples = info.total_samples;
+          std::memcpy(this->md5.data(), info.md5sum, this->md5.size());
+          this->detector_.reset();
+          if (this->supported())
+              this->detector_.emplace(this->bps, uint64_t(this->sample_rate) * 3);    // read only 3 first seconds
+
+      } else if (metadata->type == FLAC__METADATA_TYPE_VORBIS_COMMENT) {
+          for (FLAC__uint32 i = 0; i < metadata->data.vorbis_comment.num_comments; i++) {
+              const auto &comment = metadata->data.vorbis_comment.comments[i];
+              this->comment(reinterpret_cast<const char *>(comment.entry), comment.length);
+          }
+      }
+  }
+
+  /**
+   * @short Take what detection needs from a comment of the VORBIS_COMMENT block ("NAME=value", not terminated;
+   *        field names are case insensitive)
+   */
+  void comment(const char *entry, size_t length) {
+      static constexpr char kField[] = "MQAENCODER=";
+      constexpr size_t kLength = sizeof(kField) - 1;
+      if (length < kLength)
+          return;
+      for (size_t i = 0; i < kLength; i++)
+          if (std::toupper(static_cast<unsigned char>(entry[i])) != kField[i])
+              return;
+      this->mqa_encoder.assign(entry + kLength, length - kLength);
+  }
+
+  /**
+   * @short Whether the stream can be identified: 16 or 24 bit stereo (known once STREAMINFO is read)
+   */
+  [[nodiscard]] bool supported() const noexcept {
+      return this->channels == 2 && (this->bps == 16 || this->bps == 24) && this->sample_rate > 0;
+  }
+
+  /**
+   * @short Count a decoded frame and search it, until the result is known
+   * @return where detection stands
+   */
+  MQADetector::Result frame(const ::FLAC__Frame *frame, const FLAC__int32 *const buffer[]) {
+      this->decoded_samples += frame->header.blocksize;
+      if (!this->detector_)
+          return MQADetector::Result::NotMQA;
+      return this->detector_->addPlanar(buffer[0], buffer[1], frame->header.blocksize);
+  }
+
+  /**
+   * @short The stream ended: a detection still pending gives up (not to be called when decoding failed)
+   */
+  void finish() {
+      if (this->detector_)
+          this->detector_->finish();
+  }
+
+  /**
+   * @short Where detection stands: pending until STREAMINFO is read, not MQA for unsupported streams
+   */
+  [[nodiscard]] MQADetector::Result detection() const noexcept {
+      if (this->detector_)
+          return this->detector_->result();
+      return this->channels ? MQADetector::Result::NotMQA : MQADetector::Result::Pending;
+  }
+
+  /**
+   * @short Whether detection reached a result: MQA found, or its window searched (or the stream ended) without it
+   */
+  [[nodiscard]] bool identified() const noexcept {
+      return this->detector_ && this->detector_->result() != MQADetector::Result::Pending;
+  }
+
+  /**
+   * @short What detection found (meaningful once detection() is MQA)
+   */
+  [[nodiscard]] MQAStream found() const noexcept {
+      return this->detector_ ? this->detector_->stream() : MQAStream{};
+  }
+
+ private:
+  std::optional<MQADetector> detector_;
+};
@@ -0,0 +1,233 @@
+/**
+ * @file        frame_reader.h
+ * @short       Pull-style decoding of a flac file, frame by frame, with MQA detection along the way
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <FLAC++/decoder.h>
+
+#include "flac_stream.h"
+
+
+/**
+ * Frame reader.
+ * Frames are decoded when the caller asks for them, with next() or by iterating over the reader, instead of
+ * being pushed through libFLAC's callbacks; the caller interleaves its own work and stops whenever it likes,
+ * the file is released with the reader. Frames of any format are pulled, and those of 16 or 24 bit stereo
+ * streams also feed MQA detection over the first three seconds (through FlacStream, as file scans do), so
+ * detection() tells as soon as the stream is known to be MQA or not, and pulling can stop there.
+ * Frames live in buffers reused by the next pull. Not thread safe.
+ */
+class FrameReader {
+ public:
+  /**
+   * Decoded frame, valid until the next pull
+   */
+  struct Frame {
+      uint64_t first_sample = 0;      // index of its first sample in the stream
+      uint32_t samples = 0;           // per channel
+      uint32_t channels = 0;
+      uint32_t bps = 0;
+      const FLAC__int32 *const *planes = nullptr;     // one plane of samples per channel
+  };
+
+  /**
+   * Input iterator over the frames left, each step pulls one
+   */
+  class iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Frame;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const Frame *;
+    using reference = const Frame &;
+
+    iterator() = default;
+    explicit iterator(FrameReader *reader) : reader_(reader), frame_(reader->next()) {}
+
+    reference operator*() const { return *this->frame_; }
+    pointer operator->() const { return this->frame_; }
+
+    iterator &operator++() {
+        this->frame_ = this->reader_->next();
+        return *this;
+    }
+
+    bool operator==(const iterator &other) const { return this->frame_ == other.frame_; }
+    bool operator!=(const iterator &other) const { return this->frame_ != other.frame_; }
+
+   private:
+    FrameReader *reader_ = nullptr;
+    const Frame *frame_ = nullptr;      // null at the end
+  };
+
+  /**
+   * @param file path of the flac file (opened by the first pull)
+   */
+  explicit FrameReader(std::string file) : file_(std::move(file)) {}
+
+  FrameReader(const FrameReader &) = delete;
+  FrameReader &operator=(const FrameReader &) = delete;
+
+  /**
+   * @short Open the file and read its metadata, if not done yet
+   * @return false if it couldn't be opened (see error())
+   */
+  bool open() {
+      if (this->decoder_.opened)
+          return this->decoder_.initialized;
+      this->decoder_.opened = true;
+
+      (void) this->decoder_.set_metadata_respond(FLAC__METADATA_TYPE_VORBIS_COMMENT);
+      const auto status = this->decoder_.init(this->file_.c_str());
+      this->decoder_.initialized = status == FLAC__STREAM_DECODER_INIT_STATUS_OK;
+      if (!this->decoder_.initialized) {
+          this->decoder_.error = FLAC__StreamDecoderInitStatusString[status];
+          this->decoder_.failed = true;
+          return false;
+      }
+      if (!this->decoder_.process_until_end_of_metadata())
+          this->decoder_.fail();
+      return true;
+  }
+
+  /**
+   * @short Decode the next frame
+   * @return the frame, nullptr at the end of the stream or on error
+   */
+  const Frame *next() {
+      if (!this->open() || this->decoder_.ended)
+          return nullptr;
+
+      this->decoder_.got_frame = false;
+      while (!this->decoder_.got_frame) {
+          if (this->decoder_.get_state() == FLAC__STREAM_DECODER_END_OF_STREAM || !this->decoder_.process_single()) {
+              // a stream that failed to decode isn't identified, its detection stays pending
+              if (this->decoder_.get_state() == FLAC__STREAM_DECODER_END_OF_STREAM)
+                  this->decoder_.end();
+              else
+                  this->decoder_.fail();
+              return nullptr;
+          }
+      }
+      return &this->decoder_.frame;
+  }
+
+  iterator begin() { return iterator(this); }
+  iterator end() { return iterator(); }
+
+  /**
+   * @short Where MQA detection stands after the frames pulled so far
+   */
+  [[nodiscard]] MQADetector::Result detection() const noexcept {
+      return this->decoder_.stream.detection();
+  }
+
+  /**
+   * @short What detection found (meaningful once detection() is MQA)
+   */
+  [[nodiscard]] MQAStream stream() const noexcept {
+      return this->decoder_.stream.found();
+  }
+
+  /**
+   * @short First error met, empty if there was none
+   */
+  [[nodiscard]] const std::string &error() const noexcept { return this->decoder_.error; }
+
+  /**
+   * @short Whether decoding stopped on an error (the file couldn't be opened, or a frame couldn't be decoded)
+   */
+  [[nodiscard]] bool failed() const noexcept { return this->decoder_.failed; }
+
+  // known once open
+  [[nodiscard]] uint32_t sampleRate() const noexcept { return this->decoder_.stream.sample_rate; }
+  [[nodiscard]] uint32_t channels() const noexcept { return this->decoder_.stream.channels; }
+  [[nodiscard]] uint32_t bitsPerSample() const noexcept { return this->decoder_.stream.bps; }
+  [[nodiscard]] uint64_t totalSamples() const noexcept { return this->decoder_.stream.total_samples; }
+  [[nodiscard]] const std::string &getMQA_encoder() const noexcept { return this->decoder_.stream.mqa_encoder; }
+
+  /**
+   * @short Number of samples (per channel) pulled so far
+   */
+  [[nodiscard]] uint64_t decodedSamples() const noexcept { return this->decoder_.stream.decoded_samples; }
+
+ private:
+  class Decoder : public FLAC::Decoder::File {
+   public:
+    bool opened = false;
+    bool initialized = false;
+    bool ended = false;
+    bool failed = false;
+    bool got_frame = false;
+    FlacStream stream;
+    std::string error;
+
+    Frame frame;
+    std::vector<std::vector<FLAC__int32>> planes;
+    std::vector<const FLAC__int32 *> plane_pointers;
+
+    ~Decoder() override {
+        (void) this->finish();
+    }
+
+    /**
+     * @short Decoding can't go on: no more frames, a detection still pending stays so
+     */
+    void fail() {
+        if (this->error.empty()) this->error = this->get_state().resolved_as_cstring(*this);
+        this->failed = this->ended = true;
+    }
+
+    /**
+     * @short End of the stream: a detection still pending gives up
+     */
+    void end() {
+        this->ended = true;
+        this->stream.finish();
+    }
+
+   protected:
+    ::FLAC__StreamDecoderWriteStatus write_callback(const ::FLAC__Frame *header,
+                                                    const FLAC__int32 *const buffer[]) override {
+        const uint32_t samples = header->header.blocksize;
+        const uint32_t channels = this->stream.channels;
+        if (this->planes.size() < channels) {
+            this->planes.resize(channels);
+            this->plane_pointers.resize(channels);
+        }
+        for (uint32_t c = 0; c < channels; c++) {
+            this->planes[c].assign(buffer[c], buffer[c] + samples);
+            this->plane_pointers[c] = this->planes[c].data();
+        }
+
+        this->frame.first_sample = this->stream.decoded_samples;
+        this->frame.samples = samples;
+        this->frame.channels = channels;
+        this->frame.bps = this->stream.bps;
+        this->frame.planes = this->plane_pointers.data();
+        this->got_frame = true;
+
+        (void) this->stream.frame(header, buffer);
+        return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+
+    void metadata_callback(const ::FLAC__StreamMetadata *metadata) override {
+        this->stream.metadata(metadata);
+    }
+
+    void error_callback(::FLAC__StreamDecoderErrorStatus status) override {
+        if (this->error.empty()) this->error = FLAC__StreamDecoderErrorStatusString[status];
+    }
+  };
+
+  std::string file_;
+  Decoder decoder_;
+};
@@ -0,0 +1,110 @@
+/**
+ * @file        io_stats.h
+ * @short       Byte-level I/O accounting of the scanned files
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+
+/**
+ * Bytes moved at each level while a file is identified, from what the scan window needs down to storage
+ */
+struct IoStats {
+    uint64_t requested = 0;     // asked for by libFLAC's read callback
+    uint64_t returned = 0;      // handed to libFLAC (short at the end of the file)
+    uint64_t os_read = 0;       // read from the OS by stdio, buffering included
+    uint64_t storage = 0;       // read from storage by this thread, readahead included (0 from the page cache)
+    uint64_t metadata = 0;      // size of the metadata blocks (pictures included)
+    uint64_t needed = 0;        // end of the last decoded frame: the least that reaches the end of the window
+};
+
+
+/**
+ * @short Bytes this thread made the kernel read from storage so far (Linux only)
+ * @return false if unknown
+ */
+inline bool threadStorageBytes(uint64_t &bytes) {
+#if defined(__linux__)
+    std::FILE *io = std::fopen("/proc/thread-self/io", "r");
+    if (!io)
+        return false;
+    char line[128];
+    bool found = false;
+    while (!found && std::fgets(line, sizeof line, io))
+        if (std::strncmp(line, "read_bytes:", 11) == 0)
+            found = std::sscanf(line + 11, "%llu", reinterpret_cast<unsigned long long *>(&bytes)) == 1;
+    std::fclose(io);
+    return found;
+#else
+    (void) bytes;
+    return false;
+#endif
+}
+
+
+/**
+ * @short Human readable byte count
+ */
+inline std::string byteCount(uint64_t bytes) {
+    char text[32];
+    if (bytes < 10000)
+        std::snprintf(text, sizeof text, "%llu B", static_cast<unsigned long long>(bytes));
+    else if (bytes < 10000000)
+        std::snprintf(text, sizeof text, "%.1f kB", bytes / 1e3);
+    else if (bytes < 10000000000ull)
+        std::snprintf(text, sizeof text, "%.1f MB", bytes / 1e6);
+    else
+        std::snprintf(text, sizeof text, "%.2f GB", bytes / 1e9);
+    return text;
+}
+
+
+/**
+ * I/O totals of a run
+ */
+class IoSummary {
+ public:
+  void add(const IoStats &io) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      this->total_.requested += io.requested;
+      this->total_.returned += io.returned;
+      this->total_.os_read += io.os_read;
+      this->total_.storage += io.storage;
+      this->total_.metadata += io.metadata;
+      this->total_.needed += io.needed;
+      this->files_++;
+  }
+
+  /**
+   * @param storage_known whether storage reads could be measured on this system
+   */
+  void report(std::ostream &out, bool storage_known) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      out << "\nI/O of " << this->files_ << " decoded files (amplification over the bytes needed)\n";
+      const auto line = [&](const char *what, uint64_t bytes) {
+          char text[96];
+          std::snprintf(text, sizeof text, "  %-24s %12s  %6.2fx\n", what, byteCount(bytes).c_str(),
+                        this->total_.needed ? static_cast<double>(bytes) / this->total_.needed : 0.0);
+          out << text;
+      };
+      line("needed (window)", this->total_.needed);
+      line("  of which metadata", this->total_.metadata);
+      line("requested by libFLAC", this->total_.requested);
+      line("returned to libFLAC", this->total_.returned);
+      line("read from the OS", this->total_.os_read);
+      if (storage_known)
+          line("read from storage", this->total_.storage);
+  }
+
+ private:
+  IoStats total_;
+  size_t files_ = 0;
+  std::mutex mutex_;
+};
@@ -11,14 +11,39 @@
  #include <filesystem>
 #endif
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "mqa_identifier.h"
-#include <FLAC++/metadata.h>
+#include "checkpoint.h"
+#include "file_scan.h"
+#include "io_stats.h"
+#include "memory_stats.h"
+#include "metrics.h"
+#include "path_store.h"
+#include "perf_counters.h"
+#include "progress.h"
+#include "record_writer.h"
+#include "result_cache.h"
+#include "scan_state.h"
+#include "status.h"
+#include "tag_stage.h"
+#include "trace.h"
+#include "tag_writer.h"
+#include "xattr_store.h"
 
 #ifdef __ANDROID__
  namespace fs = boost::filesystem;
@@ -40,172 +65,794 @@ auto getSampleRateString(const uint32_t fs) {
 
 
 /**
- * @short Recursively scan a directory for .flac files
+ * @short Recursively scan a directory for the files to identify (see isScannable())
  * @param curDir directory to scan
- * @param files vector to add the file paths
+ * @param files store to add the file paths
+ * @param dirId node of curDir in the store
+ * @param state listings of the previous run, unchanged directories aren't listed again (optional)
+ * @param found counter of the files found, kept up to date during the walk (optional)
  */
-void recursiveScan(const fs::directory_entry &curDir, std::vector<std::string> &files) {
+void recursiveScan(const fs::directory_entry &curDir, PathStore &files, PathStore::DirId dirId,
+                   ScanState *state = nullptr, std::atomic<size_t> *found = nullptr) {
+    FileStamp stamp;
+    if (state && statFile(curDir.path().string(), stamp)) {
+        if (const auto *dir = state->unchanged(curDir.path().string(), stamp.mtime_ns)) {
+            for (const auto &name : dir->files)
+                files.addFile(dirId, name, true);
+            if (found) *found += dir->files.size();
+            for (const auto &name : dir->subdirs) {
+                const fs::directory_entry sub(curDir.path() / name);
+                if (fs::is_directory(sub))
+                    recursiveScan(sub, files, files.addDirectory(dirId, name), state, found);
+            }
+            return;
+        }
+    }
+
+    ScanState::Directory listing;
     for (const auto &entry : fs::directory_iterator(curDir)) {
-        if (fs::is_regular_file(entry) && (fs::path(entry).extension() == ".flac"))
-            files.push_back(entry.path().string());
+        if (fs::is_regular_file(entry) && isScannable(entry.path())) {
+            files.addFile(dirId, entry.path().filename().string());
+            if (found) found->fetch_add(1, std::memory_order_relaxed);
+            if (state) listing.files.push_back(entry.path().filename().string());
+        }
+        else if (fs::is_directory(entry)) {
+            recursiveScan(entry, files, files.addDirectory(dirId, entry.path().filename().string()), state, found);
+            if (state) listing.subdirs.push_back(entry.path().filename().string());
+        }
+    }
+
+    if (state) {
+        listing.mtime_ns = stamp.mtime_ns;
+        state->record(curDir.path().string(), std::move(listing));
+    }
+}
+
+
+/**
+ * Options and running totals shared by every scanned file
+ */
+struct ScanSession {
+    bool add_mqaencoder = false;
+    bool rewrite_founded_tags = false;
+    bool stream_output = false;
+    std::unique_ptr<ResultCache> cache;
+    std::unique_ptr<ScanState> scan_state;
+    std::unique_ptr<CheckpointJournal> journal;
+    bool dedupe = false;
+    bool xattr = false;
+    bool io_stats = false;      // per file I/O accounting
+    bool buffer_estimates = false;  // decoder buffer estimates by format
+    std::unique_ptr<MemoryBudget> memory_budget;    // limits the files in flight
+    uint32_t padding_reserve = 8192;
+    unsigned tag_writers = 1;
+    std::unique_ptr<TagWriterStage> tagger;
+    std::unique_ptr<RecordWriter> records;     // machine readable output instead of the table
+    std::unique_ptr<Trace> trace;
+    std::unique_ptr<PerfCounters> perf;
+    std::unique_ptr<LiveProgress> progress;     // drawn on stderr, erased before printing under output_mutex
+    std::unordered_map<std::string, FileResult> content_results;
+
+    // relaxed counters, read by the metrics writer, --progress and SIGUSR1 while the scan goes on
+    std::atomic<size_t> files_found{0};
+    std::atomic<size_t> count{0};
+    std::atomic<size_t> mqa_files{0};
+    std::atomic<size_t> failed_files{0};
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> decoded_samples{0};
+    std::atomic<bool> discovering{true};
+    std::atomic<uint64_t> decode_ns{0};
+    std::array<std::atomic<uint64_t>, kDecodeErrorStatuses> decode_errors{};
+
+    size_t added_tags = 0;
+    size_t tags_in_place = 0;
+    size_t tags_rewritten = 0;
+    uint64_t tag_bytes_written = 0;
+
+#ifdef MQAID_STAGE_TIMING
+    StageStats stage_stats{10};
+#endif
+    IoSummary io_summary;
+    BufferEstimates buffers;
+
+    std::mutex output_mutex;    // result rows and the tag counters, shared with the writer stage
+    size_t reused_results = 0;
+    size_t resumed = 0;
+    size_t xattr_hits = 0;
+    std::atomic<size_t> xattr_failed{0};
+};
+
+
+/**
+ * @short Tell why a file couldn't be identified or tagged, on stderr
+ */
+void printError(ScanSession &session, const std::string &file, const std::string &error) {
+    std::lock_guard<std::mutex> lock(session.output_mutex);
+    if (session.progress) session.progress->erase();
+    std::cerr << "ERROR: " << file << ": " << error << "\n";
+}
+
+
+/**
+ * @short Identify a file, print its result row and add MQA tags if requested
+ * @param file full path of the file
+ * @param name name to print in the result row
+ * @param session options and totals of the current run
+ * @param carried the file's directory is unchanged since the last run, its cached result is trusted
+ */
+void scanFile(const std::string &file, std::string_view name, ScanSession &session, bool carried = false) {
+    TraceSpan span(nullptr, "file", file);
+    FileActivity activity(file);
+
+    std::ostringstream row;
+    row << std::setw(3) << session.count.fetch_add(1, std::memory_order_relaxed) + 1 << "\t";
+
+    // Files finished before an interrupted run stopped aren't scanned again, their journaled result is reported
+    // (and stored like a fresh one, the interrupted run may not have got to it)
+    FileResult result;
+    FileStamp stamp;
+    bool stamped = false;
+    const auto *done = session.journal ? session.journal->completed(file) : nullptr;
+    if (done) {
+        result = done->result;
+        session.resumed++;
+        stamped = session.cache && statFile(file, stamp);
+        std::lock_guard<std::mutex> lock(session.output_mutex);    // the tag counters are shared with the writers
+        session.added_tags += done->added_tags;
+    }
+
+    // Unchanged files are answered from the cache without being opened
+    bool known = done || (carried && session.cache && session.cache->lookup(file, result));
+    if (!known) {
+        stamped = session.cache && statFile(file, stamp);
+        known = stamped && session.cache->lookup(file, stamp, result);
+    }
+    // Results stored on the file itself by an earlier --xattr run
+    int64_t mtime_ns = 0;
+    if (session.xattr && (!known || done)) {
+        FileStamp current = stamp;
+        if (stamped || statFile(file, current)) {
+            mtime_ns = current.mtime_ns;
+            if (!done) {
+                known = xattr_store::load(file, mtime_ns, result);
+                session.xattr_hits += known;
+            }
+        }
+    }
+    // uncompressed files have no tags to write
+    const bool pcm_file = isPcmFileName(file);
+    if (known && !done && result.isMQA() && session.add_mqaencoder && !result.tagged && !pcm_file) {
+        known = false;
+        stamped = session.cache && statFile(file, stamp);
+    }
+    const bool fresh = !known || done;      // the result is stored in the cache and attributes
+
+    // Detection and tagging share the identifier, its file handle and its parsed metadata
+    std::unique_ptr<MQA_identifier> id;
+    std::unique_ptr<PcmFile> pcm;           // uncompressed files are searched in their mapping, without decoding
+    std::shared_ptr<MemoryCharge> charge;   // held until the file is done, tag writing included
+    double decode_ms = 0;
+    IoStats io;
+    if (!known && pcm_file) {
+        pcm = std::make_unique<PcmFile>(file);
+        const auto started = std::chrono::steady_clock::now();
+        const auto scan = identify(*pcm);
+        const auto elapsed = std::chrono::steady_clock::now() - started;
+        if (session.buffer_estimates)
+            session.buffers.record(pcm->sampleRate(), pcm->bitsPerSample(), 0, residentBytes());
+        decode_ms = std::chrono::duration<double, std::milli>(elapsed).count();
+        session.decode_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                                    std::memory_order_relaxed);
+        result.status = scan.status;
+        result.isMQAStudio = scan.isMQAStudio;
+        result.originalSampleRate = scan.originalSampleRate;
+        result.mqaEncoder.clear();
+        result.tagged = false;
+
+        session.bytes_read.fetch_add(scan.bytes_read, std::memory_order_relaxed);
+        session.decoded_samples.fetch_add(scan.decoded_samples, std::memory_order_relaxed);
+    } else if (!known) {
+        id = std::make_unique<MQA_identifier>(file, session.add_mqaencoder);
+        if (session.io_stats)
+            id->trackIO();
+        // with a memory budget, a file waits for its decoder buffers to fit (the size is known from the metadata)
+        if (session.memory_budget) {
+            id->readMetadata();
+            charge = std::make_shared<MemoryCharge>(*session.memory_budget, id->decoderBufferEstimate());
+        }
+
+        // Identical audio (same STREAMINFO MD5) is only decoded once
+        bool reused = false;
+        std::string content;
+        if (session.dedupe && id->readMetadata() && !(content = contentKey(id->audioMD5())).empty()) {
+            const auto it = session.content_results.find(content);
+            if (it != session.content_results.end()) {
+                result = it->second;
+                reused = true;
+            } else
+                reused = session.cache && session.cache->lookupContent(content, result);
+        }
+
+        if (reused)
+            session.reused_results++;
+        else {
+            const auto started = std::chrono::steady_clock::now();
+            const auto scan = identify(*id);
+            const auto elapsed = std::chrono::steady_clock::now() - started;
+            if (session.buffer_estimates)
+                session.buffers.record(id->sampleRate(), id->bitsPerSample(), id->decoderBufferEstimate(),
+                                       residentBytes());
+            decode_ms = std::chrono::duration<double, std::milli>(elapsed).count();
+            session.decode_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                                    std::memory_order_relaxed);
+            result.status = scan.status;
+            result.isMQAStudio = scan.isMQAStudio;
+            result.originalSampleRate = scan.originalSampleRate;
+            result.audioMD5 = id->audioMD5();
+            // a copy that couldn't be decoded says nothing about the others with the same audio
+            if (!content.empty() && scan.status != ScanStatus::Error)
+                session.content_results[content] = result;
+        }
+        // tags belong to this very file
+        result.mqaEncoder = id->getMQA_encoder();
+        result.tagged = false;
+
+        session.bytes_read.fetch_add(id->bytesRead(), std::memory_order_relaxed);
+        if (session.io_stats) {
+            io = id->ioStats();
+            session.io_summary.add(io);
+        }
+        session.decoded_samples.fetch_add(id->decodedSamples(), std::memory_order_relaxed);
+        const auto &errors = id->decodeErrors();
+        for (size_t i = 0; i < errors.size(); i++)
+            session.decode_errors[i].fetch_add(errors[i], std::memory_order_relaxed);
+    }
+    if (id && !id->error().empty())
+        printError(session, file, id->error());
+    else if (pcm && !pcm->error().empty())
+        printError(session, file, pcm->error());
+
+    const bool failed = result.status == ScanStatus::Error;
+    session.failed_files.fetch_add(failed, std::memory_order_relaxed);
+    const bool tag = result.isMQA() && session.add_mqaencoder && !known && !pcm_file;
+    if (result.isMQA())
+        session.mqa_files.fetch_add(1, std::memory_order_relaxed);
+
+    if (session.records) {
+        ScanRecord record;
+        record.path = file;
+        record.status = result.status;
+        record.isMQAStudio = result.isMQAStudio;
+        record.originalSampleRate = result.originalSampleRate;
+        record.encoder = result.mqaEncoder;
+        if (id) {
+            record.error = id->error();
+            record.bytes_read = id->bytesRead();
+        } else if (pcm) {
+            record.error = pcm->error();
+            record.bytes_read = pcm->bytesRead();
+        }
+        record.decode_ms = decode_ms;
+        record.io = io;
+        session.records->write(record);
+    } else {
+        if (result.isMQA())
+            row << "MQA " << (result.isMQAStudio ? "Studio " : "")
+                << getSampleRateString(result.originalSampleRate) << "  \t"
+                << name << "\n";
+        else
+            row << "NOT MQA \t" << name << "\n";
+        if (id && session.io_stats)
+            row << "   \tI/O needed " << byteCount(io.needed) << ", requested " << byteCount(io.requested)
+                << ", OS " << byteCount(io.os_read) << ", storage " << byteCount(io.storage) << "\t" << name << "\n";
+
+        std::lock_guard<std::mutex> lock(session.output_mutex);
+        if (session.progress) session.progress->erase();
+        std::cout << row.str();
+        // In pipeline mode every row goes out as soon as its file is done
+        if (session.stream_output)
+            std::cout << std::flush;
+    }
+
+    if (!tag) {
+#ifdef MQAID_STAGE_TIMING
+        if (id)
+            session.stage_stats.record(file, id->stageTimes(), id->error());
+        else if (pcm)
+            session.stage_stats.record(file, pcm->stageTimes(), pcm->error());
+#endif
+        // a file that couldn't be identified (read error, truncated or unsupported stream) is tried again next run
+        if (stamped && fresh && !failed)
+            session.cache->store(file, stamp, result);
+        if (mtime_ns && fresh && !failed)
+            session.xattr_failed.fetch_add(!xattr_store::store(file, mtime_ns, result), std::memory_order_relaxed);
+        if (session.journal && !done && !failed)
+            session.journal->record(file, result, false);
+        return;
+    }
+
+    // add tags if use flag --add-mqaencoder and -rw if yor want rewrite existing ones
+    // The file is handed over to the writer stage, detection goes on with the next one
+    FileStamp where = stamp;
+    const uint64_t device = stamped || statFile(file, where) ? where.device : 0;
+    session.tagger->submit(device, std::move(id),
+                           [&session, file, name = std::string(name), stamped, stamp, mtime_ns, result, charge]
+                               (const TagWriteResult &write, MQA_identifier &written) mutable {
+        result.tagged = write.status != TagWriteStatus::Failed;
+        const bool added = tagsAdded(write);
+        // the file changed, so did its stamp
+        if (added && (stamped || mtime_ns)) {
+            FileStamp current;
+            if (statFile(file, current)) {
+                stamp = current;
+                mtime_ns = mtime_ns ? current.mtime_ns : 0;
+            }
+        }
+        if (stamped)
+            session.cache->store(file, stamp, result);
+        if (mtime_ns && result.status != ScanStatus::Error)
+            session.xattr_failed.fetch_add(!xattr_store::store(file, mtime_ns, result), std::memory_order_relaxed);
+        if (session.journal)
+            session.journal->record(file, result, added);
+        if (write.status == TagWriteStatus::Failed)
+            printError(session, file, write.error);
+#ifdef MQAID_STAGE_TIMING
+        session.stage_stats.record(file, written.stageTimes(),
+                                   write.status == TagWriteStatus::Rewritten ? "file rewritten" : written.error());
+#else
+        (void) written;
+#endif
+        if (!added)
+            return;
+
+        std::lock_guard<std::mutex> lock(session.output_mutex);
+        session.added_tags += 1;
+        session.tag_bytes_written += write.bytes_written;
+        if (write.status == TagWriteStatus::InPlace) session.tags_in_place++;
+        else session.tags_rewritten++;
+        if (session.records)
+            return;
+        if (session.progress) session.progress->erase();
+        std::cout << "   \ttags " << (write.status == TagWriteStatus::InPlace ? "written in place" : "rewritten file")
+                  << " (" << write.bytes_written << " bytes)\t" << name << "\n";
+        if (session.stream_output)
+            std::cout << std::flush;
+    });
+}
+
+
+/**
+ * @short Add the counters and queue depths of the running scan to a metrics file
+ */
+void renderMetrics(ScanSession &session, PrometheusText &text) {
+    const size_t scanned = session.count.load(std::memory_order_relaxed);
+    const size_t found = session.files_found.load(std::memory_order_relaxed);
+
+    text.metric("mqaid_files_scanned_total", "counter", "Files scanned.", scanned);
+    text.metric("mqaid_mqa_files_total", "counter", "Files identified as MQA.",
+                session.mqa_files.load(std::memory_order_relaxed));
+    text.metric("mqaid_files_failed_total", "counter", "Files that couldn't be identified.",
+                session.failed_files.load(std::memory_order_relaxed));
+    text.metric("mqaid_read_bytes_total", "counter", "Bytes read from the scanned files.",
+                session.bytes_read.load(std::memory_order_relaxed));
+    text.metric("mqaid_decode_seconds_total", "counter", "Time spent decoding and detecting.",
+                session.decode_ns.load(std::memory_order_relaxed) / 1e9);
+
+    text.family("mqaid_decode_errors_total", "counter", "Decoder error callbacks by FLAC__StreamDecoderErrorStatus.");
+    for (size_t i = 0; i < session.decode_errors.size(); i++) {
+        const uint64_t errors = session.decode_errors[i].load(std::memory_order_relaxed);
+        // statuses known to every libFLAC since 1.3 are always present, newer ones once they happen
+        if (i < 4 || errors)
+            text.sample("mqaid_decode_errors_total", static_cast<double>(errors), "status",
+                        FLAC__StreamDecoderErrorStatusString[i]);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(session.output_mutex);
+        text.metric("mqaid_tags_written_total", "counter", "Files MQA tags were added to.", session.added_tags);
+        text.metric("mqaid_tag_bytes_written_total", "counter", "Bytes written while adding tags.",
+                    session.tag_bytes_written);
+    }
+
+    text.family("mqaid_queue_depth", "gauge", "Files waiting in each stage.");
+    text.sample("mqaid_queue_depth", found > scanned ? found - scanned : 0, "stage", "scan");
+    if (session.tagger)
+        text.sample("mqaid_queue_depth", session.tagger->queued(), "stage", "tag write");
+}
+
+
+/**
+ * @short Describe what the scan is doing right now (SIGUSR1)
+ * @param bytes_rate bytes read, sampled every second
+ * @param started start of the scan
+ */
+std::string statusSnapshot(ScanSession &session, const RateWindow &bytes_rate,
+                           std::chrono::steady_clock::time_point started) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    const size_t scanned = session.count.load(std::memory_order_relaxed);
+    const size_t found = session.files_found.load(std::memory_order_relaxed);
+
+    out << "=== MQA identifier status after " << elapsed << "s ===\n";
+    out << "Files: " << scanned << " scanned of " << found << " found" << (session.discovering ? " so far" : "")
+        << ", " << session.mqa_files.load(std::memory_order_relaxed) << " MQA\n";
+
+    out << "Workers:\n";
+    WorkerBoard::instance().visit([&](const std::string &worker, const std::string &file,
+                                      WorkerBoard::Clock::duration busy, int stage) {
+        out << "  " << std::left << std::setw(12) << worker << std::right;
+        if (file.empty()) {
+            out << "idle\n";
+            return;
+        }
+        out << std::setw(10) << (stage >= 0 ? kStageNames[stage] : "-") << std::setw(9)
+            << std::chrono::duration<double>(busy).count() << "s  " << file << "\n";
+    });
+
+    out << "Queues: scan " << (found > scanned ? found - scanned : 0);
+    if (session.tagger)
+        out << ", tag write " << session.tagger->queued();
+    out << "\n";
+
+    if (session.cache) {
+        const size_t hits = session.cache->hits(), lookups = hits + session.cache->misses();
+        out << "Cache: " << hits << " hits of " << lookups << " lookups ("
+            << (lookups ? 100.0 * hits / lookups : 0.0) << "%)\n";
+    }
+
+    double window = 0;
+    const double rate = bytes_rate.perSecond(window);
+    out << "Read: " << rate / 1e6 << " MB/s over the last " << window << "s ("
+        << byteCount(session.bytes_read.load(std::memory_order_relaxed)) << " in total)\n";
+    return out.str();
+}
+
 
-        else if (fs::is_directory(entry))
-            recursiveScan(entry, files);
+/**
+ * @short Scan paths read from a list, as they arrive
+ * @param in stream of newline or NUL separated paths
+ * @param separator path separator ('\n' or '\0')
+ * @param session options and totals of the current run
+ */
+void scanFileList(std::istream &in, char separator, ScanSession &session) {
+    std::string line;
+    while (std::getline(in, line, separator)) {
+        if (separator == '\n' && !line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty())
+            continue;
+
+        if (fs::is_directory(line)) {
+            PathStore files;
+            if (session.scan_state) session.scan_state->addRoot(line);
+            recursiveScan(fs::directory_entry(line), files, files.addDirectory(PathStore::kNoParent, line),
+                          session.scan_state.get(), &session.files_found);
+            for (size_t i = 0; i < files.size(); i++)
+                scanFile(files.path(i), files.filename(i), session, files.carried(i));
+        }
+        else if (fs::is_regular_file(line) && isScannable(line)) {
+            session.files_found.fetch_add(1, std::memory_order_relaxed);
+            scanFile(line, fs::path(line).filename().string(), session);
+        }
+
+        else
+            std::cerr << line << " " << kNotScannable << "\n" << std::flush;
     }
 }
 
 
 int main(int argc, char *argv[]) {
 
-    std::vector<std::string> files;
-	bool add_mqaencoder = false;
-	bool rewrite_founded_tags = false;
+    PathStore files;
+    ScanSession session;
+    std::string files_from;
+    char separator = '\n';
+    std::string checkpoint;
+    bool resume = false;
+    std::string format = "table";
+    std::string metrics_file;
+    unsigned long metrics_interval = 15;
+    bool progress = false;
+    std::string status_file;
 
 	if (argc == 1) {
 		std::cout << "HINT: To use the tool provide files and/or directories as program arguments\n" \
-			"      If yor want add tags use flag --add-mqaencoder and -rw if yor want rewrite existing ones.\n\n";
+			"      (flac files, and uncompressed WAV/BWF, RF64, Wave64 and AIFF files, which are only identified).\n" \
+			"      If yor want add tags use flag --add-mqaencoder and -rw if yor want rewrite existing ones,\n" \
+			"      files without room for the tags are rewritten with --padding BYTES of padding (default 8192),\n" \
+			"      --tag-writers N sets how many files are tagged at once on each disk (default 1).\n" \
+			"      To read paths from a list (or stdin) use --files-from FILE|- (add --null for NUL separated lists).\n" \
+			"      To skip unchanged files on later runs use --cache FILE (and --scan-state FILE to skip unchanged folders),\n" \
+			"      to decode identical audio once use --dedupe.\n" \
+			"      For machine readable output use --format jsonl|csv|tsv (one record per file, summary on stderr).\n" \
+			"      To record a timeline of the scan (chrome://tracing, Perfetto) use --trace FILE.\n" \
+			"      To publish metrics for node_exporter's textfile collector use --metrics FILE.prom\n" \
+			"      (updated every --metrics-interval SECONDS, default 15).\n" \
+			"      To follow big runs on stderr (rates, MQA hit rate and ETA) use --progress.\n" \
+			"      To count cycles, instructions, branch and cache misses of each stage (Linux) use --perf-counters.\n" \
+			"      To account the bytes read for each file (needed, requested, from the OS, from storage) use --io-stats.\n" \
+			"      To see the decoder buffers estimated by sample rate and bit depth use --buffer-estimates, to cap\n" \
+			"      the estimated memory of the files waiting to be tagged use --max-memory BYTES (K, M or G suffix).\n" \
+			"      Send SIGUSR1 for a snapshot of the workers, queues and rates on stderr (or in --status-file FILE).\n" \
+			"      To keep results in extended attributes of the files (and trust them on later runs) use --xattr.\n" \
+			"      To be able to resume an interrupted scan use --checkpoint FILE, then add --resume to continue it.\n\n";
+    }
+
+    // Options go first, so they apply to every path whatever their position
+    std::vector<bool> is_option(argc, false);
+    for (auto argn = 1; argn < argc; argn++) {
+        const std::string arg = argv[argn];
+        const bool has_value = argn + 1 < argc;
+
+        if (arg == "--files-from" && has_value)
+            files_from = argv[argn + 1];
+        else if (arg == "--cache" && has_value) {
+            session.cache = std::make_unique<ResultCache>(argv[argn + 1]);
+            if (session.cache->refused()) {
+                std::cerr << "ERROR: " << argv[argn + 1] << " isn't a result cache, not overwriting it\n";
+                return 1;
+            }
+        }
+        else if (arg == "--scan-state" && has_value)
+            session.scan_state = std::make_unique<ScanState>(argv[argn + 1]);
+        else if (arg == "--checkpoint" && has_value)
+            checkpoint = argv[argn + 1];
+        else if (arg == "--resume")
+            resume = true;
+        else if (arg == "--dedupe")
+            session.dedupe = true;
+        else if (arg == "--format" && has_value)
+            format = argv[argn + 1];
+        else if (arg == "--slowest" && has_value) {
+#ifdef MQAID_STAGE_TIMING
+            session.stage_stats.setSlowest(std::strtoul(argv[argn + 1], nullptr, 10));
+#else
+            std::cerr << "--slowest needs a build with MQAID_STAGE_TIMING, ignoring it\n";
+#endif
+        }
+        else if (arg == "--trace" && has_value) {
+            session.trace = Trace::start(argv[argn + 1]);
+            if (!session.trace)
+                std::cerr << "ERROR: can't create trace file " << argv[argn + 1] << "\n";
+            else
+                session.trace->nameThread("scan");
+        }
+        else if (arg == "--metrics" && has_value)
+            metrics_file = argv[argn + 1];
+        else if (arg == "--metrics-interval" && has_value)
+            metrics_interval = std::max(std::strtoul(argv[argn + 1], nullptr, 10), 1ul);
+        else if (arg == "--progress")
+            progress = true;
+        else if (arg == "--perf-counters") {
+#ifndef MQAID_NO_STAGE_HOOKS
+            session.perf = PerfCounters::start();
+            if (!session.perf)
+                std::cerr << "Hardware counters aren't available (unsupported, or not permitted by "
+                             "perf_event_paranoid), ignoring --perf-counters\n";
+#else
+            std::cerr << "--perf-counters needs a build with MQAID_STAGE_HOOKS, ignoring it\n";
+#endif
+        }
+        else if (arg == "--status-file" && has_value)
+            status_file = argv[argn + 1];
+        else if (arg == "--buffer-estimates")
+            session.buffer_estimates = true;
+        else if (arg == "--max-memory" && has_value) {
+            const auto limit = parseByteCount(argv[argn + 1]);
+            if (!limit) {
+                std::cerr << "ERROR: invalid --max-memory " << argv[argn + 1] << " (use a byte count like 512M)\n";
+                return 1;
+            }
+            session.memory_budget = std::make_unique<MemoryBudget>(limit);
+        }
+        else if (arg == "--io-stats")
+            session.io_stats = true;
+        else if (arg == "--xattr")
+            session.xattr = true;
+        else if (arg == "--null")
+            separator = '\0';
+        else if (arg == "--add-mqaencoder")
+            session.add_mqaencoder = true;
+        else if (arg == "--padding" && has_value)
+            // a metadata block is at most 16 MiB
+            session.padding_reserve = static_cast<uint32_t>(std::min(std::strtoul(argv[argn + 1], nullptr, 10), 0xfffffful));
+        else if (arg == "--tag-writers" && has_value)
+            session.tag_writers = static_cast<unsigned>(std::strtoul(argv[argn + 1], nullptr, 10));
+        else if (session.add_mqaencoder && arg == "-rw")
+            session.rewrite_founded_tags = true;
+        else
+            continue;
+
+        is_option[argn] = true;
+        if (arg == "--files-from" || arg == "--cache" || arg == "--scan-state" || arg == "--checkpoint"
+            || arg == "--padding" || arg == "--tag-writers" || arg == "--format"
+            || arg == "--slowest" || arg == "--trace" || arg == "--metrics" || arg == "--metrics-interval"
+            || arg == "--status-file" || arg == "--max-memory")
+            is_option[++argn] = true;
+    }
+
+    if (resume && checkpoint.empty())
+        checkpoint = "mqa_identifier.checkpoint";
+    if (!checkpoint.empty()) {
+        session.journal = std::make_unique<CheckpointJournal>(checkpoint, resume);
+        if (!session.journal->isOpen())
+            std::cerr << "ERROR: can't open checkpoint journal " << checkpoint << "\n";
     }
 
+    RecordWriter::Format record_format;
+    if (RecordWriter::parseFormat(format, record_format))
+        session.records = std::make_unique<RecordWriter>(record_format, stdout, session.io_stats);
+    else if (format != "table")
+        std::cerr << "ERROR: unknown --format " << format << " (use jsonl, csv or tsv), printing the table\n";
+
+    if (session.xattr && !xattr_store::kSupported) {
+        std::cerr << "--xattr isn't supported on this system, ignoring it\n";
+        session.xattr = false;
+    }
+
+    if (session.add_mqaencoder)
+        session.tagger = std::make_unique<TagWriterStage>(session.rewrite_founded_tags, session.padding_reserve,
+                                                          session.tag_writers);
+
+    if (session.scan_state && !session.cache) {
+        std::cerr << "--scan-state needs --cache to carry results forward, ignoring it\n";
+        session.scan_state.reset();
+    }
+
+    // Metrics cover the walk too, they are updated until the last tag is written
+    std::unique_ptr<MetricsFile> metrics;
+    if (!metrics_file.empty())
+        metrics = std::make_unique<MetricsFile>(metrics_file, std::chrono::seconds(metrics_interval),
+                                                [&session](PrometheusText &text) { renderMetrics(session, text); });
+    // A snapshot of the scan on SIGUSR1, written by a watcher thread while the scan goes on
+    WorkerBoard::instance().registerThread("scan");
+    const auto started = std::chrono::steady_clock::now();
+    RateWindow bytes_rate;
+    StatusSignal status([&session, &bytes_rate] { bytes_rate.sample(session.bytes_read.load(std::memory_order_relaxed)); },
+                        [&session, &bytes_rate, &status_file, started] {
+        const auto snapshot = statusSnapshot(session, bytes_rate, started);
+        if (!status_file.empty()) {
+            const auto tmp = status_file + ".tmp";
+            std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+            file << snapshot;
+            file.close();
+            if (file && std::rename(tmp.c_str(), status_file.c_str()) == 0)
+                return;
+            std::cerr << "ERROR: can't write status file " << status_file << "\n";
+        }
+        std::lock_guard<std::mutex> lock(session.output_mutex);
+        if (session.progress) session.progress->erase();
+        std::cerr << snapshot << std::flush;
+    });
+
+    if (progress)
+        session.progress = std::make_unique<LiveProgress>([&session] {
+            ProgressSample sample;
+            sample.found = session.files_found.load(std::memory_order_relaxed);
+            sample.discovering = session.discovering;
+            sample.done = session.count.load(std::memory_order_relaxed);
+            sample.mqa = session.mqa_files.load(std::memory_order_relaxed);
+            sample.bytes_read = session.bytes_read.load(std::memory_order_relaxed);
+            sample.samples = session.decoded_samples.load(std::memory_order_relaxed);
+            return sample;
+        }, session.output_mutex);
+
     for (auto argn = 1; argn < argc; argn++) {
+        if (is_option[argn])
+            continue;
 
-        if (fs::is_directory(argv[argn]))
-            recursiveScan(fs::directory_entry(argv[argn]), files);
+        if (fs::is_directory(argv[argn])) {
+            if (session.scan_state) session.scan_state->addRoot(argv[argn]);
+            recursiveScan(fs::directory_entry(argv[argn]), files, files.addDirectory(PathStore::kNoParent, argv[argn]),
+                          session.scan_state.get(), &session.files_found);
+        }
 
         else if (fs::is_regular_file(argv[argn])) {
-            if (fs::path(argv[argn]).extension() == ".flac")
-                files.emplace_back(argv[argn]);
+            if (isScannable(argv[argn]))
+                files.addFile(argv[argn]);
             else
-                std::cerr << argv[argn] << " not .flac file\n";
+                std::cerr << argv[argn] << " " << kNotScannable << "\n";
         }
-		if (std::string(argv[argn]) == "--add-mqaencoder")
-			add_mqaencoder = true;
-
-		if (add_mqaencoder && std::string(argv[argn]) == "-rw")
-			rewrite_founded_tags = true;
+        session.files_found = files.size();
     }
+    session.stream_output = !files_from.empty();
+    session.discovering = session.stream_output;
 
     // Flush error buffer (just to make sure our print is pretty and no error line get in between)
     std::cerr << std::flush;
 
-    // Let's do some printing
-    std::cout << "**************************************************\n";
-    std::cout << "***********  MQA flac identifier tool  ***********\n";
-    std::cout << "********  Stavros Avramidis (@purpl3F0x)  ********\n";
-    std::cout << "** https://github.com/purpl3F0x/MQA_identifier  **\n";
-    std::cout << "**************************************************\n";
-
-    std::cout << "Found " << files.size() << " file for scanning...\n\n";
+    // Let's do some printing (records alone go to stdout in record mode, the rest goes to stderr)
+    std::ostream &out = session.records ? std::cerr : std::cout;
+    {
+        std::lock_guard<std::mutex> lock(session.output_mutex);
+        if (session.progress) session.progress->erase();
+        if (!session.records) {
+            out << "**************************************************\n";
+            out << "***********  MQA flac identifier tool  ***********\n";
+            out << "********  Stavros Avramidis (@purpl3F0x)  ********\n";
+            out << "** https://github.com/purpl3F0x/MQA_identifier  **\n";
+            out << "**************************************************\n";
+        }
 
+        out << "Found " << files.size() << " file for scanning...\n";
+        if (!files_from.empty())
+            out << "Reading more files from " << (files_from == "-" ? "stdin" : files_from) << "...\n";
+        out << "\n";
 
-    // Start parsing the files
-    size_t count = 0;
-    size_t mqa_files = 0;
-	size_t added_tags = 0;
-    std::cout << "  #\tEncoding\t\tName\n";
-    for (const auto &file : files) 
-    {
-        std::cout << std::setw(3) << ++count << "\t";
-
-        //auto id = MQA_identifier(file);
-        MQA_identifier id(file);
-        if (id.detect())
-        {
-            std::cout << "MQA " << (id.isMQAStudio() ? "Studio " : "")
-                      << getSampleRateString(id.originalSampleRate()) << "  \t"
-                      << fs::path(file).filename().string() << "\n";
-            mqa_files++;
-
-            // add tags if use flag --add-mqaencoder and -rw if yor want rewrite existing ones
-			if (add_mqaencoder) 
-			{
-				//////////////////////////////////////////
-				// read a file using FLAC::Metadata::Chain class
-				FLAC::Metadata::Chain chain;
-				chain.read(file.c_str());
-				// now, find vorbis comment block and make changes in it
-				{
-					FLAC::Metadata::Iterator iterator;
-					iterator.init(chain);
-					// find vorbis comment block
-					FLAC::Metadata::VorbisComment* vcBlock = 0;
-					do {
-						FLAC::Metadata::Prototype* block = iterator.get_block();
-						if (block->get_type() == FLAC__METADATA_TYPE_VORBIS_COMMENT) {
-							vcBlock = (FLAC::Metadata::VorbisComment*) block;
-							break;
-						}
-					} while (iterator.next());
-					// if not found, create a new one
-					if (vcBlock == 0) {
-						// create a new block
-						vcBlock = new FLAC::Metadata::VorbisComment();
-						// move iterator to the end
-						while (iterator.next()) {
-						}
-						// insert a new block at the end
-						if (!iterator.insert_block_after(vcBlock)) {
-							delete vcBlock;
-						}
-					}
-					//if the tags (ENCODER,MQAENCODER,ORIGINALSAMPLERATE) is found, we simply delete it
-					int ENCODERs = -1;
-					int MQAENCODERs = -1;
-					int ORIGINALSAMPLERATEs = -1;
-					for (int i = 0; i < vcBlock->get_num_comments(); ++i)
-					{
-						int ENCODER = vcBlock->find_entry_from(i, "ENCODER");
-						if (ENCODER > -1)
-							ENCODERs = ENCODER;
-					}
-					if (ENCODERs > -1 && rewrite_founded_tags)
-					{
-						vcBlock->delete_comment(ENCODERs);
-					}
-					for (int i = 0; i < vcBlock->get_num_comments(); ++i)
-					{
-						int MQAENCODER = vcBlock->find_entry_from(i, "MQAENCODER");
-						if (MQAENCODER > -1)
-							MQAENCODERs = MQAENCODER;
-					}
-					if (MQAENCODERs > -1 && rewrite_founded_tags)
-					{
-						vcBlock->delete_comment(MQAENCODERs);
-					}
-					for (int i = 0; i < vcBlock->get_num_comments(); ++i)
-					{
-						int ORIGINALSAMPLERATE = vcBlock->find_entry_from(i, "ORIGINALSAMPLERATE");
-						if (ORIGINALSAMPLERATE > -1)
-							ORIGINALSAMPLERATEs = ORIGINALSAMPLERATE;
-					}
-					if (ORIGINALSAMPLERATEs > -1 && rewrite_founded_tags)
-					{
-						vcBlock->delete_comment(ORIGINALSAMPLERATEs);
-					}
-					//add tags (ENCODER,MQAENCODER,ORIGINALSAMPLERATE) to the flac file if not found or if -rw flag rewrite existing
-					std::string OrigSamp = std::to_string(id.originalSampleRate());
-					if(ENCODERs == -1 || ENCODERs > -1 && rewrite_founded_tags)
-						vcBlock->append_comment(FLAC::Metadata::VorbisComment::Entry("ENCODER", "MQAEncode v1.1, 2.3.3+800 (a505918), F8EC1703-7616-45E5-B81E-D60821434062, Dec 01 2017 22:19:30"));
-					if (MQAENCODERs == -1 || MQAENCODERs > -1 && rewrite_founded_tags)
-						vcBlock->append_comment(FLAC::Metadata::VorbisComment::Entry("MQAENCODER", "MQAEncode v1.1, 2.3.3+800 (a505918), F8EC1703-7616-45E5-B81E-D60821434062, Dec 01 2017 22:19:30"));
-					if (ORIGINALSAMPLERATEs == -1 || ORIGINALSAMPLERATEs > -1 && rewrite_founded_tags)
-						vcBlock->append_comment(FLAC::Metadata::VorbisComment::Entry("ORIGINALSAMPLERATE", OrigSamp.c_str()));
-
-					if (ENCODERs == -1 || ENCODERs > -1 && rewrite_founded_tags
-						|| MQAENCODERs == -1 || MQAENCODERs > -1 && rewrite_founded_tags
-						|| ORIGINALSAMPLERATEs == -1 || ORIGINALSAMPLERATEs > -1 && rewrite_founded_tags)
-						added_tags += 1;
-				}
-				chain.write();//save flac file
-			}
-            
-        } 
-        else
-            std::cout << "NOT MQA \t" << fs::path(file).filename().string() << "\n";
+        // Start parsing the files
+        if (!session.records)
+            std::cout << "  #\tEncoding\t\tName\n";
+        out << std::flush;
+    }
+    for (size_t i = 0; i < files.size(); i++)
+        // paths are only materialised for the file being scanned
+        scanFile(files.path(i), files.filename(i), session, files.carried(i));
 
+    if (!files_from.empty()) {
+        if (files_from == "-")
+            scanFileList(std::cin, separator, session);
+        else {
+            std::ifstream list(files_from, std::ios::binary);
+            if (!list)
+                std::cerr << "ERROR: can't open file list " << files_from << "\n";
+            scanFileList(list, separator, session);
+        }
+        session.discovering = false;
     }
 
-    std::cout << "\n**************************************************\n";
-    std::cout << "Scanned " << files.size() << " files\n"; 
-    std::cout << "Found " << mqa_files << " MQA files\n";
-	std::cout << "Added " << added_tags << " tags for MQA files\n";
+    // Wait for the last tags to be written
+    if (session.tagger)
+        session.tagger->finish();
+    if (session.trace)
+        session.trace->finish();
+    if (session.progress)
+        session.progress->finish();
+    if (metrics && !metrics->finish())
+        std::cerr << "ERROR: can't write metrics file " << metrics_file << "\n";
+
+    // The scan completed, nothing left to resume
+    if (session.journal)
+        session.journal->finish();
+
+    if (session.records)
+        session.records->flush();
+
+    out << "\n**************************************************\n";
+    out << "Scanned " << session.count << " files\n";
+    out << "Found " << session.mqa_files << " MQA files\n";
+	out << "Added " << session.added_tags << " tags for MQA files\n";
+    if (session.added_tags)
+        out << "Wrote tags in place to " << session.tags_in_place << " files, rewrote " << session.tags_rewritten
+                  << " files (" << session.tag_bytes_written << " bytes written)\n";
+    if (session.journal)
+        out << "Resumed " << session.resumed << " files finished by the interrupted run\n";
+    if (session.cache) {
+        out << "Answered " << session.cache->hits() << " files from cache\n";
+        if (session.cache->failed())
+            std::cerr << "ERROR: couldn't write the result cache, results of this run may be missing from it\n";
+    }
+    if (session.xattr) {
+        out << "Answered " << session.xattr_hits << " files from extended attributes\n";
+        if (session.xattr_failed)
+            std::cerr << "ERROR: couldn't store extended attributes on " << session.xattr_failed << " files\n";
+    }
+    if (session.scan_state) {
+        out << "Skipped listing " << session.scan_state->skipped() << " unchanged folders\n";
+        if (!session.scan_state->save())
+            std::cerr << "ERROR: can't write scan state\n";
+    }
+    if (session.dedupe)
+        out << "Reused " << session.reused_results << " results of identical audio\n";
+#ifdef MQAID_STAGE_TIMING
+    session.stage_stats.report(out);
+#endif
+    if (session.io_stats) {
+        uint64_t storage = 0;
+        session.io_summary.report(out, threadStorageBytes(storage));
+    }
+    if (session.buffer_estimates)
+        session.buffers.report(out, session.memory_budget.get());
+    if (session.perf)
+        reportPerfCounters(out, *session.perf, session.decoded_samples);
 }
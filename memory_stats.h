@@ -0,0 +1,210 @@
+/**
+ * @file        memory_stats.h
+ * @short       Decoder buffer estimates of the scanned files, and a budget for the files in flight
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+
+#ifndef _WIN32
+ #include <sys/resource.h>
+ #include <unistd.h>
+#endif
+
+#include "io_stats.h"
+
+
+/**
+ * @short Resident set size of the process (Linux only, 0 elsewhere)
+ */
+inline uint64_t residentBytes() {
+#if defined(__linux__)
+    std::FILE *statm = std::fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    unsigned long long size = 0, resident = 0;
+    const bool ok = std::fscanf(statm, "%llu %llu", &size, &resident) == 2;
+    std::fclose(statm);
+    return ok ? resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) : 0;
+#else
+    return 0;
+#endif
+}
+
+
+/**
+ * @short Peak resident set size of the process so far (0 if unknown)
+ */
+inline uint64_t peakResidentBytes() {
+#ifndef _WIN32
+    struct rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+ #ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);            // bytes
+ #else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;     // kilobytes
+ #endif
+#else
+    return 0;
+#endif
+}
+
+
+/**
+ * @short Parse a byte count: digits with an optional K, M or G suffix (powers of 1024)
+ * @return 0 if invalid (sign, spaces, anything after the suffix) or out of the 64 bit range
+ */
+inline uint64_t parseByteCount(const std::string &text) {
+    // strtoull would take leading spaces and a sign (wrapping "-1" around to 2^64 - 1)
+    if (text.empty() || text[0] < '0' || text[0] > '9')
+        return 0;
+    errno = 0;
+    char *end = nullptr;
+    const auto value = std::strtoull(text.c_str(), &end, 10);
+    if (errno == ERANGE)
+        return 0;
+
+    unsigned shift;
+    switch (*end ? *end | 0x20 : 0) {
+        case 0: shift = 0; break;
+        case 'k': shift = 10; break;
+        case 'm': shift = 20; break;
+        case 'g': shift = 30; break;
+        default: return 0;
+    }
+    if ((*end && end[1]) || value > (UINT64_MAX >> shift))
+        return 0;
+    return value << shift;
+}
+
+
+/**
+ * Memory budget of the files in flight.
+ * Files are charged an estimate of what they hold, sized from their metadata (the decoder's block buffers),
+ * not their actual allocations, from the start of their decoding until they are done, tag writing included.
+ * As files are decoded one at a time, what the budget limits is the backlog of files waiting for the tag
+ * writers. A file waits until its charge fits in the budget, except when nothing else is charged, so a file
+ * larger than the whole budget still goes through, alone.
+ */
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(uint64_t limit) : limit_(limit) {}
+
+  void acquire(uint64_t bytes) {
+      std::unique_lock<std::mutex> lock(this->mutex_);
+      this->freed_.wait(lock, [&] { return this->used_ == 0 || this->used_ + bytes <= this->limit_; });
+      this->used_ += bytes;
+      this->peak_ = std::max(this->peak_, this->used_);
+  }
+
+  void release(uint64_t bytes) {
+      {
+          std::lock_guard<std::mutex> lock(this->mutex_);
+          this->used_ -= std::min(bytes, this->used_);
+      }
+      this->freed_.notify_all();
+  }
+
+  [[nodiscard]] uint64_t limit() const noexcept { return this->limit_; }
+
+  [[nodiscard]] uint64_t peak() {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      return this->peak_;
+  }
+
+ private:
+  const uint64_t limit_;
+  uint64_t used_ = 0;
+  uint64_t peak_ = 0;
+  std::mutex mutex_;
+  std::condition_variable freed_;
+};
+
+
+/**
+ * Charge of a file on a memory budget, released on destruction
+ */
+class MemoryCharge {
+ public:
+  /**
+   * @short Charge a file, waits until it fits in the budget
+   */
+  MemoryCharge(MemoryBudget &budget, uint64_t bytes) : budget_(budget), bytes_(bytes) {
+      budget.acquire(bytes);
+  }
+
+  ~MemoryCharge() {
+      this->budget_.release(this->bytes_);
+  }
+
+  MemoryCharge(const MemoryCharge &) = delete;
+  MemoryCharge &operator=(const MemoryCharge &) = delete;
+
+ private:
+  MemoryBudget &budget_;
+  uint64_t bytes_;
+};
+
+
+/**
+ * Decoder buffers of the decoded files by sample rate and bit depth, as computed from their STREAMINFO: nothing
+ * is measured per file, only the process RSS is read, which covers every thread and file in flight
+ */
+class BufferEstimates {
+ public:
+  /**
+   * @param buffer estimated size of the file's decoder buffers (0 for files searched without decoding)
+   * @param resident resident set size of the process once the file was decoded (0 if unknown)
+   */
+  void record(uint32_t sample_rate, uint32_t bps, uint64_t buffer, uint64_t resident) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      auto &format = this->formats_[{sample_rate, bps}];
+      format.files++;
+      format.buffer_total += buffer;
+      format.buffer_max = std::max(format.buffer_max, buffer);
+      format.resident_max = std::max(format.resident_max, resident);
+  }
+
+  void report(std::ostream &out, MemoryBudget *budget) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      out << "\nDecoder buffers by format (estimated from STREAMINFO, not measured), and process RSS after decoding\n";
+      out << "  format        files  est. buf avg  est. buf max  process RSS max\n";
+      for (const auto &[key, format] : this->formats_) {
+          char name[32], line[128];
+          std::snprintf(name, sizeof name, "%.1fk/%u", key.first / 1000.0, key.second);
+          std::snprintf(line, sizeof line, "  %-12s %6llu %13s %13s %16s\n", name,
+                        static_cast<unsigned long long>(format.files),
+                        byteCount(format.buffer_total / format.files).c_str(), byteCount(format.buffer_max).c_str(),
+                        format.resident_max ? byteCount(format.resident_max).c_str() : "-");
+          out << line;
+      }
+      if (const auto peak = peakResidentBytes())
+          out << "Peak RSS of the run: " << byteCount(peak) << "\n";
+      if (budget)
+          out << "Peak estimated charge of files in flight: " << byteCount(budget->peak())
+              << " of a " << byteCount(budget->limit()) << " budget\n";
+  }
+
+ private:
+  struct Format {
+      uint64_t files = 0;
+      uint64_t buffer_total = 0;
+      uint64_t buffer_max = 0;
+      uint64_t resident_max = 0;
+  };
+
+  std::map<std::pair<uint32_t, uint32_t>, Format> formats_;
+  std::mutex mutex_;
+};
@@ -0,0 +1,161 @@
+/**
+ * @file        metrics.h
+ * @short       Prometheus textfile-collector metrics of a scan
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#ifdef _WIN32
+ #include <io.h>
+#else
+ #include <unistd.h>
+#endif
+
+
+/**
+ * Metrics in the Prometheus text exposition format
+ */
+class PrometheusText {
+ public:
+  /**
+   * @short Start a metric family (HELP and TYPE lines)
+   * @param type counter or gauge
+   */
+  void family(const char *name, const char *type, const char *help) {
+      this->text_ += "# HELP ";
+      this->text_ += name;
+      this->text_ += ' ';
+      this->text_ += help;
+      this->text_ += "\n# TYPE ";
+      this->text_ += name;
+      this->text_ += ' ';
+      this->text_ += type;
+      this->text_ += '\n';
+  }
+
+  /**
+   * @short Add a sample
+   * @param label optional label name, the sample has no labels when empty
+   * @param value_of_label value of the label (escaped here)
+   */
+  void sample(const char *name, double value, std::string_view label = {}, std::string_view value_of_label = {}) {
+      this->text_ += name;
+      if (!label.empty()) {
+          this->text_ += '{';
+          this->text_ += label;
+          this->text_ += "=\"";
+          for (const char c : value_of_label) {
+              if (c == '\\' || c == '"') this->text_ += '\\';
+              if (c == '\n') { this->text_ += "\\n"; continue; }
+              this->text_ += c;
+          }
+          this->text_ += "\"}";
+      }
+      char number[32];
+      std::snprintf(number, sizeof number, " %.17g\n", value);
+      this->text_ += number;
+  }
+
+  /**
+   * @short Single sample family
+   */
+  void metric(const char *name, const char *type, const char *help, double value) {
+      this->family(name, type, help);
+      this->sample(name, value);
+  }
+
+  [[nodiscard]] const std::string &str() const noexcept { return this->text_; }
+
+ private:
+  std::string text_;
+};
+
+
+/**
+ * Metrics file.
+ * The metrics are rendered and written every interval from a background thread, and once more when the scan
+ * ends. Every write goes to a temporary file that is then renamed over the metrics file, so a collector
+ * never reads a partial file (the temporary name doesn't end in .prom, node_exporter ignores it).
+ */
+class MetricsFile {
+ public:
+  using Render = std::function<void(PrometheusText &)>;
+
+  /**
+   * @param file path of the metrics file (should end in .prom)
+   * @param interval time between two updates
+   * @param render adds the metrics of the scan
+   */
+  MetricsFile(std::string file, std::chrono::seconds interval, Render render)
+      : file_(std::move(file)), interval_(interval), render_(std::move(render)) {
+      this->worker_ = std::thread([this] {
+          std::unique_lock<std::mutex> lock(this->mutex_);
+          while (!this->wake_.wait_for(lock, this->interval_, [this] { return this->stop_; }))
+              this->write(true);
+      });
+  }
+
+  ~MetricsFile() {
+      this->finish();
+  }
+
+  /**
+   * @short Stop the updates and write the final metrics
+   * @return false if the file couldn't be written
+   */
+  bool finish() {
+      {
+          std::lock_guard<std::mutex> lock(this->mutex_);
+          if (this->stop_)
+              return true;
+          this->stop_ = true;
+      }
+      this->wake_.notify_one();
+      this->worker_.join();
+      return this->write(false);
+  }
+
+ private:
+  std::string file_;
+  std::chrono::seconds interval_;
+  Render render_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_ = false;
+  std::thread worker_;
+
+
+  bool write(bool running) {
+      PrometheusText text;
+      this->render_(text);
+      text.metric("mqaid_scan_running", "gauge", "Whether the scan is still running.", running);
+      text.metric("mqaid_last_update_timestamp_seconds", "gauge", "Time these metrics were written.",
+                  std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count());
+
+      const auto tmp = this->file_ + ".tmp";
+      std::FILE *out = std::fopen(tmp.c_str(), "wb");
+      if (!out)
+          return false;
+      bool ok = std::fwrite(text.str().data(), 1, text.str().size(), out) == text.str().size()
+                && std::fflush(out) == 0;
+#ifdef _WIN32
+      ok = ok && _commit(_fileno(out)) == 0;
+#else
+      ok = ok && fsync(fileno(out)) == 0;
+#endif
+      ok = std::fclose(out) == 0 && ok;
+#ifdef _WIN32
+      std::remove(this->file_.c_str());
+#endif
+      return ok && std::rename(tmp.c_str(), this->file_.c_str()) == 0;
+  }
+};
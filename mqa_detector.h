@@ -0,0 +1,222 @@
+/**
+ * @file        mqa_detector.h
+ * @short       MQA detection on decoded PCM, fed incrementally by any decoder
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+/**
+ * Returns original Sample rate (in Hz) from waveform bytecode.
+ * @param c 4bit bytecode
+ * @return
+ */
+inline uint32_t OriginalSampleRateDecoder(unsigned c) {
+    /*
+     * If LSB is 0 then base is 44100 else 48000
+     * 3 MSB need to be rotated and raised to the power of 2 (so 1, 2, 4, 8, ...)
+     * output is base * multiplier
+     */
+    const uint32_t base = (c & 1u) ? 48000 : 44100;
+
+    uint32_t multiplier = 1u << (((c >> 3u) & 1u) | (((c >> 2u) & 1u) << 1u) | (((c >> 1u) & 1u) << 2u));
+    // Double for DSD
+    if (multiplier > 16) multiplier *= 2;
+
+    return base * multiplier;
+}
+
+
+/**
+ * What the sync search found in a stream
+ */
+struct MQAStream {
+    bool isMQA = false;
+    bool isMQAStudio = false;
+    uint32_t originalSampleRate = 0;    // in Hz, 0 when not MQA
+};
+
+
+/**
+ * Incremental MQA detector.
+ * Stereo PCM is fed in blocks of any size, interleaved or planar, as int16, packed little-endian int24 or
+ * int32. The sync word is searched across blocks; once it is found the stream info that follows it (34
+ * samples) is read, so the result is known as soon as those samples are in and the rest of the stream can be
+ * skipped. Nothing is allocated while searching.
+ */
+class MQADetector {
+ public:
+  enum class Result {
+      Pending,    // feed more samples
+      MQA,
+      NotMQA      // the window was searched in vain, the stream ended or isn't supported (see error())
+  };
+
+  /**
+   * @param bits width the sample values span: 16 or 24 for samples in the low bits of their container, 32 for
+   *             samples left-justified in int32
+   * @param window samples per channel searched for the sync word before giving up, 0 to search until finish()
+   */
+  explicit MQADetector(uint32_t bits, uint64_t window = 0) : window_(window) {
+      if (bits < 16 || bits > 32) {
+          this->error_ = "unsupported sample width (only 16 to 32 bits)";
+          this->result_ = Result::NotMQA;
+      } else
+          this->pos_ = bits - 16u;   // aim for 16th bit
+  }
+
+  /**
+   * @short Feed frames of left and right samples, interleaved
+   */
+  Result addInterleaved(const int16_t *samples, size_t frames) {
+      return this->addFrames(frames, [&](size_t i) {
+          return bitsOf(samples[2 * i]) ^ bitsOf(samples[2 * i + 1]);
+      });
+  }
+
+  Result addInterleaved(const int32_t *samples, size_t frames) {
+      return this->addFrames(frames, [&](size_t i) {
+          return bitsOf(samples[2 * i]) ^ bitsOf(samples[2 * i + 1]);
+      });
+  }
+
+  /**
+   * @short Feed frames of packed little-endian 24 bit samples (3 bytes each), interleaved
+   */
+  Result addInterleaved24(const uint8_t *samples, size_t frames) {
+      return this->addFrames(frames, [&](size_t i) {
+          return bitsOf24(samples + 6 * i) ^ bitsOf24(samples + 6 * i + 3);
+      });
+  }
+
+  /**
+   * @short Feed frames of left and right samples, one plane per channel
+   */
+  Result addPlanar(const int16_t *left, const int16_t *right, size_t frames) {
+      return this->addFrames(frames, [&](size_t i) { return bitsOf(left[i]) ^ bitsOf(right[i]); });
+  }
+
+  Result addPlanar(const int32_t *left, const int32_t *right, size_t frames) {
+      return this->addFrames(frames, [&](size_t i) { return bitsOf(left[i]) ^ bitsOf(right[i]); });
+  }
+
+  Result addPlanar24(const uint8_t *left, const uint8_t *right, size_t frames) {
+      return this->addFrames(frames, [&](size_t i) { return bitsOf24(left + 3 * i) ^ bitsOf24(right + 3 * i); });
+  }
+
+  /**
+   * @short Feed frames in any other layout, given the left ^ right bits of each
+   * @param xorAt called with the index of each frame in turn, until the result is known
+   */
+  template <class Xor>
+  Result addFrames(size_t frames, Xor xorAt) {
+      for (size_t i = 0; i < frames && this->result_ == Result::Pending; i++)
+          this->step(xorAt(i));
+      return this->result_;
+  }
+
+  /**
+   * @short End of the stream: a search still pending gives up
+   */
+  Result finish() {
+      if (this->result_ == Result::Pending)
+          this->result_ = Result::NotMQA;
+      return this->result_;
+  }
+
+  [[nodiscard]] Result result() const noexcept { return this->result_; }
+
+  /**
+   * @short Sync word, original sample rate and MQA Studio flag (meaningful once the result is MQA)
+   */
+  [[nodiscard]] const MQAStream &stream() const noexcept { return this->found_; }
+
+  /**
+   * @short Number of samples (per channel) searched so far
+   */
+  [[nodiscard]] uint64_t samples() const noexcept { return this->samples_; }
+
+  /**
+   * @short Why the detector gave up without searching, empty otherwise
+   */
+  [[nodiscard]] const std::string &error() const noexcept { return this->error_; }
+
+ private:
+  static constexpr uint64_t kSyncWord = 0xbe0498c88;     // MQA magic word
+  static constexpr uint64_t kSyncMask = 0xFFFFFFFFFu;
+  static constexpr unsigned kInfoSamples = 34;          // stream info, from the last sample of the sync word
+
+  const uint64_t window_;
+  unsigned pos_ = 0;
+  Result result_ = Result::Pending;
+  MQAStream found_;
+  std::string error_;
+  uint64_t samples_ = 0;
+
+  //check the bufer three times from the P,P+1,P+2 value
+  std::array<uint64_t, 3> buffers_{};
+  unsigned shift_ = 0;          // bit the sync word was found on
+  unsigned info_count_ = 0;     // stream info samples read, 0 while searching
+  uint64_t info_bits_ = 0;      // bit m is the sync bit of sample m of the stream info
+
+
+  static uint32_t bitsOf(int32_t sample) { return static_cast<uint32_t>(sample); }
+
+  static uint32_t bitsOf24(const uint8_t *sample) {
+      return sample[0] | (uint32_t(sample[1]) << 8u) | (uint32_t(sample[2]) << 16u);
+  }
+
+  void step(uint32_t x) {
+      // reading the stream info that follows the sync word
+      if (this->info_count_) {
+          this->info_bits_ |= uint64_t((x >> this->shift_) & 1u) << this->info_count_;
+          if (++this->info_count_ == kInfoSamples)
+              this->readStreamInfo();
+          return;
+      }
+
+      if (this->window_ && this->samples_ >= this->window_) {
+          this->result_ = Result::NotMQA;
+          return;
+      }
+      this->samples_++;
+
+      for (unsigned k = 0; k < this->buffers_.size(); k++)
+          this->buffers_[k] |= (x >> (this->pos_ + k)) & 1u;
+
+      for (unsigned k = 0; k < this->buffers_.size(); k++)
+          if (this->buffers_[k] == kSyncWord) {
+              this->shift_ = this->pos_ + k;
+              this->info_bits_ = (x >> this->shift_) & 1u;
+              this->info_count_ = 1;
+              return;
+          }
+
+      for (auto &buffer : this->buffers_)
+          buffer = (buffer << 1u) & kSyncMask;
+  }
+
+  void readStreamInfo() {
+      const auto bit = [this](unsigned m) { return unsigned(this->info_bits_ >> m) & 1u; };
+      this->found_.isMQA = true;
+
+      // Get Original Sample Rate
+      uint8_t orsf = 0;
+      for (auto m = 3u; m < 7; m++)   // TODO: this need fix (orsf is 5bits)
+          orsf |= bit(m) << (6u - m);
+      this->found_.originalSampleRate = OriginalSampleRateDecoder(orsf);
+
+      // Get MQA Studio
+      uint8_t provenance = 0u;
+      for (auto m = 29u; m < 34; m++)
+          provenance |= bit(m) << (33u - m);
+      this->found_.isMQAStudio = provenance > 8;
+
+      this->result_ = Result::MQA;
+  }
+};
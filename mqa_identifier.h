@@ -8,57 +8,82 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cinttypes>
+#include <cstdio>
 #include <cstring>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <sys/stat.h>
+#ifdef _WIN32
+ #include <io.h>
+#else
+ #include <unistd.h>
+#endif
+
 #include <FLAC++/decoder.h>
+#include <FLAC++/metadata.h>
+
+#include "flac_stream.h"
+#include "io_stats.h"
+#include "mqa_detector.h"
+#include "stage_timer.h"
 
 
 /**
- * Returns original Sample rate (in Hz) from waveform bytecode.
- * @param c 4bit bytecode
- * @return
+ * Number of FLAC__StreamDecoderErrorStatus values counted per file (libFLAC 1.3 has 4, 1.4 has 5)
  */
-uint32_t OriginalSampleRateDecoder(unsigned c) {
-    /*
-     * If LSB is 0 then base is 44100 else 48000
-     * 3 MSB need to be rotated and raised to the power of 2 (so 1, 2, 4, 8, ...)
-     * output is base * multiplier
-     */
-    const uint32_t base = (c & 1u) ? 48000 : 44100;
-
-    uint32_t multiplier = 1u << (((c >> 3u) & 1u) | (((c >> 2u) & 1u) << 1u) | (((c >> 1u) & 1u) << 2u));
-    // Double for DSD
-    if (multiplier > 16) multiplier *= 2;
-
-    return base * multiplier;
-}
+constexpr size_t kDecodeErrorStatuses = 8;
+using DecodeErrorCounts = std::array<uint32_t, kDecodeErrorStatuses>;
 
 
 class MQA_identifier {
  private:
-  class MyDecoder : public FLAC::Decoder::File {
+  class MyDecoder : public FLAC::Decoder::Stream {
    public:
-    uint32_t sample_rate = 0;
-    uint32_t channels = 0;
-    uint32_t bps = 0;
-    FLAC__uint64 decoded_samples = 0;
-    std::vector<std::array<const FLAC__int32, 2>> samples;
-    std::string mqa_encoder;
-    uint32_t original_sample_rate = 0;
-
-
-    explicit MyDecoder(std::string file) : FLAC::Decoder::File(), file_(std::move(file)) {};
-
+    FlacStream stream;      // STREAMINFO, MQAENCODER tag and detection, samples are searched as they are decoded
+    std::unique_ptr<FLAC::Metadata::VorbisComment> vorbis_comment;  // kept when writable
+    std::FILE *handle = nullptr;
+    uint64_t bytes_read = 0;
+    std::string error;      // first problem met while decoding
+    DecodeErrorCounts error_counts{};   // error callbacks by FLAC__StreamDecoderErrorStatus
+    IoStats io{};
+    bool track_io = false;      // account OS and storage reads and the bytes needed
+#ifdef MQAID_STAGE_TIMING
+    StageTimes stage_times{};
+#endif
+
+
+    MyDecoder(std::string file, bool writable)
+        : FLAC::Decoder::Stream(), file_(std::move(file)), writable_(writable) {};
+    ~MyDecoder() override;
+
+    ::FLAC__StreamDecoderInitStatus open();
     ::FLAC__StreamDecoderInitStatus decode();
+    bool makeWritable();
+    void close();
+    IoStats ioSnapshot();
 
    protected:
     std::string file_;
-    using FLAC::Decoder::File::init;
+    bool writable_;
+    bool opened_ = false;
+    bool updating_ = false;         // handle reopened for update
+    ::FLAC__StreamDecoderInitStatus init_status_ = FLAC__STREAM_DECODER_INIT_STATUS_OK;
+    int64_t os_mark_ = 0;           // OS file offset since the last seek
+    uint64_t storage_start_ = 0;
+    bool storage_known_ = false;
+    int64_t osOffset() const;
+    using FLAC::Decoder::Stream::init;
+    ::FLAC__StreamDecoderReadStatus read_callback(FLAC__byte buffer[], size_t *bytes) override;
+    ::FLAC__StreamDecoderSeekStatus seek_callback(FLAC__uint64 absolute_byte_offset) override;
+    ::FLAC__StreamDecoderTellStatus tell_callback(FLAC__uint64 *absolute_byte_offset) override;
+    ::FLAC__StreamDecoderLengthStatus length_callback(FLAC__uint64 *stream_length) override;
+    bool eof_callback() override;
     virtual ::FLAC__StreamDecoderWriteStatus write_callback(const ::FLAC__Frame *frame,
                                                             const FLAC__int32 *const buffer[]) override;
     void metadata_callback(const ::FLAC__StreamMetadata *metadata) override;
@@ -76,12 +101,94 @@ class MQA_identifier {
   bool isMQAStudio_ = false;
 
  public:
-  explicit MQA_identifier(std::string file) : file_(std::move(file)), decoder(file_), isMQA_(false) {}
+  /**
+   * @param file path of the flac file
+   * @param writable keep what tagging needs, so the tags can be written after detection (see makeWritable())
+   */
+  explicit MQA_identifier(std::string file, bool writable = false)
+      : file_(std::move(file)), decoder(file_, writable), isMQA_(false) {}
 
 
+  bool readMetadata();
   bool detect();
 
+  /**
+   * @short Handle the file was decoded from, positioned anywhere (nullptr if it couldn't be opened)
+   */
+  [[nodiscard]] std::FILE *handle() const noexcept;
+
+  /**
+   * @short Reopen the file for update, once detection is done, so its tags can be written through handle()
+   * The file is read-only while it is decoded, so only the files that get tagged are ever opened for writing.
+   * @return false if the identifier isn't writable or the file can't be opened for update (handle() unchanged)
+   */
+  bool makeWritable();
+
+  /**
+   * @short VORBIS_COMMENT block read while decoding (only kept when writable, nullptr if the file has none)
+   */
+  [[nodiscard]] const FLAC::Metadata::VorbisComment *vorbisComment() const noexcept;
+
+  /**
+   * @short Release the decoder and close the file
+   */
+  void close();
+
+  /**
+   * @short First error met while opening or decoding the file, empty if there was none
+   * A stream can have decoder errors and still be identified, see identified().
+   */
+  [[nodiscard]] const std::string &error() const noexcept;
+
+  /**
+   * @short Whether detect() got to a result, MQA or not (false if the file couldn't be opened or decoded, or
+   *        isn't a 16 or 24 bit stereo stream)
+   */
+  [[nodiscard]] bool identified() const noexcept;
+
+  /**
+   * @short Number of bytes read from the file so far
+   */
+  [[nodiscard]] uint64_t bytesRead() const noexcept;
+
+  /**
+   * @short Number of samples (per channel) decoded so far
+   */
+  [[nodiscard]] uint64_t decodedSamples() const noexcept;
+
+  /**
+   * @short Size of the decoder's block buffers held until close(), computed from STREAMINFO rather than measured
+   *        (known once the metadata is read; decoded samples aren't kept)
+   */
+  [[nodiscard]] uint64_t decoderBufferEstimate() const noexcept;
+
+  [[nodiscard]] uint32_t sampleRate() const noexcept;
+  [[nodiscard]] uint32_t bitsPerSample() const noexcept;
+
+  /**
+   * @short Also account OS and storage reads and the bytes the window needs (call before reading the file)
+   */
+  void trackIO() noexcept;
+
+  /**
+   * @short Bytes moved so far at each level (only requested and returned unless trackIO() was called)
+   */
+  [[nodiscard]] IoStats ioStats();
+
+  /**
+   * @short Number of decoder error callbacks so far, by FLAC__StreamDecoderErrorStatus
+   */
+  [[nodiscard]] const DecodeErrorCounts &decodeErrors() const noexcept;
+
+#ifdef MQAID_STAGE_TIMING
+  /**
+   * @short Time spent by this file in each stage so far
+   */
+  [[nodiscard]] StageTimes &stageTimes() noexcept;
+#endif
+
   [[nodiscard]] std::string getMQA_encoder() const noexcept;
+  [[nodiscard]] const std::array<uint8_t, 16> &audioMD5() const noexcept;
   [[nodiscard]] uint32_t originalSampleRate() const noexcept;
   [[nodiscard]] bool isMQA() const noexcept;
   [[nodiscard]] bool isMQAStudio() const noexcept;
@@ -89,190 +196,325 @@ class MQA_identifier {
 };
 
 
-::FLAC__StreamDecoderWriteStatus MQA_identifier::MyDecoder::write_callback(const ::FLAC__Frame *frame,
+inline ::FLAC__StreamDecoderWriteStatus MQA_identifier::MyDecoder::write_callback(const ::FLAC__Frame *frame,
                                                                            const FLAC__int32 *const buffer[]) {
 
-    if (channels != 2 || (bps != 16 && bps != 24)) {
-        std::cerr << "ERROR: this tool only supports 16bit/24bit stereo streams\n";
-        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
-    }
+    /* search the decoded PCM samples (timed apart from the decoding around it) */
+    MQAID_TIME_STAGE(this->stage_times, Stage::Detect);
+    this->stream.frame(frame, buffer);
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
 
-    /* increase number of read samples */
-    this->decoded_samples += frame->header.blocksize;
 
-    /* write decoded PCM samples */
-    for (size_t i = 0; i < frame->header.blocksize; i++)
-        this->samples.push_back(std::array < const FLAC__int32, 2 > {buffer[0][i], buffer[1][i]});
+inline void MQA_identifier::MyDecoder::metadata_callback(const ::FLAC__StreamMetadata *metadata) {
 
-    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    this->stream.metadata(metadata);
+    if (metadata->type == FLAC__METADATA_TYPE_VORBIS_COMMENT && this->writable_)
+        this->vorbis_comment = std::make_unique<FLAC::Metadata::VorbisComment>(metadata);
 }
 
 
-void MQA_identifier::MyDecoder::metadata_callback(const ::FLAC__StreamMetadata *metadata) {
+inline void MQA_identifier::MyDecoder::error_callback(::FLAC__StreamDecoderErrorStatus status) {
+    if (static_cast<size_t>(status) < this->error_counts.size())
+        this->error_counts[status]++;
+    if (this->error.empty()) this->error = FLAC__StreamDecoderErrorStatusString[status];
+}
 
-    if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
-        this->sample_rate = metadata->data.stream_info.sample_rate;
-        this->channels = metadata->data.stream_info.channels;
-        this->bps = metadata->data.stream_info.bits_per_sample;
 
-    } else if (metadata->type == FLAC__METADATA_TYPE_VORBIS_COMMENT) {
-        for (FLAC__uint32 i = 0; i < metadata->data.vorbis_comment.num_comments; i++) {
-            const auto comment = reinterpret_cast<char *>(metadata->data.vorbis_comment.comments[i].entry);
+inline ::FLAC__StreamDecoderReadStatus MQA_identifier::MyDecoder::read_callback(FLAC__byte buffer[], size_t *bytes) {
+    if (*bytes == 0)
+        return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
 
-            if (std::strncmp("MQAENCODER", comment, 10) == 0)
-                this->mqa_encoder =
-                    std::string(comment + 10, comment + metadata->data.vorbis_comment.comments[i].length);
-        }
-    }
+    this->io.requested += *bytes;
+    *bytes = std::fread(buffer, sizeof(FLAC__byte), *bytes, this->handle);
+    this->bytes_read += *bytes;
+    if (std::ferror(this->handle))
+        return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+    return *bytes == 0 ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM : FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+
+inline int64_t MQA_identifier::MyDecoder::osOffset() const {
+#ifdef _WIN32
+    return this->handle ? _lseeki64(_fileno(this->handle), 0, SEEK_CUR) : 0;
+#else
+    return this->handle ? static_cast<int64_t>(lseek(fileno(this->handle), 0, SEEK_CUR)) : 0;
+#endif
+}
 
+
+inline ::FLAC__StreamDecoderSeekStatus MQA_identifier::MyDecoder::seek_callback(FLAC__uint64 absolute_byte_offset) {
+    // stdio reads ahead of the stream; what it read up to here counts, wherever the seek goes
+    if (this->track_io)
+        this->io.os_read += static_cast<uint64_t>(std::max<int64_t>(this->osOffset() - this->os_mark_, 0));
+#ifdef _WIN32
+    const auto failed = _fseeki64(this->handle, static_cast<__int64>(absolute_byte_offset), SEEK_SET);
+#else
+    const auto failed = fseeko(this->handle, static_cast<off_t>(absolute_byte_offset), SEEK_SET);
+#endif
+    if (this->track_io)
+        this->os_mark_ = this->osOffset();
+    return failed ? FLAC__STREAM_DECODER_SEEK_STATUS_ERROR : FLAC__STREAM_DECODER_SEEK_STATUS_OK;
+}
+
+
+inline ::FLAC__StreamDecoderTellStatus MQA_identifier::MyDecoder::tell_callback(FLAC__uint64 *absolute_byte_offset) {
+#ifdef _WIN32
+    const auto pos = _ftelli64(this->handle);
+#else
+    const auto pos = ftello(this->handle);
+#endif
+    if (pos < 0)
+        return FLAC__STREAM_DECODER_TELL_STATUS_ERROR;
+    *absolute_byte_offset = static_cast<FLAC__uint64>(pos);
+    return FLAC__STREAM_DECODER_TELL_STATUS_OK;
 }
 
 
-void MQA_identifier::MyDecoder::error_callback(::FLAC__StreamDecoderErrorStatus status) {
-    std::cerr << "Got error callback: " << FLAC__StreamDecoderErrorStatusString[status] << "\n";
+inline ::FLAC__StreamDecoderLengthStatus MQA_identifier::MyDecoder::length_callback(FLAC__uint64 *stream_length) {
+#ifdef _WIN32
+    struct _stat64 st{};
+    if (_fstat64(_fileno(this->handle), &st) != 0)
+#else
+    struct stat st{};
+    if (fstat(fileno(this->handle), &st) != 0)
+#endif
+        return FLAC__STREAM_DECODER_LENGTH_STATUS_ERROR;
+    *stream_length = static_cast<FLAC__uint64>(st.st_size);
+    return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
 }
 
 
-::FLAC__StreamDecoderInitStatus MQA_identifier::MyDecoder::decode() {
-    bool ok = true;
+inline bool MQA_identifier::MyDecoder::eof_callback() {
+    return std::feof(this->handle) != 0;
+}
+
 
-    (void) this->set_md5_checking(true);
-    (void) this->set_metadata_respond(FLAC__METADATA_TYPE_VORBIS_COMMENT); /* instruct decoder to parse vorbis_comments */
-    FLAC__StreamDecoderInitStatus init_status = this->init(this->file_);
+inline ::FLAC__StreamDecoderInitStatus MQA_identifier::MyDecoder::open() {
+    if (this->opened_)
+        return this->init_status_;
+    this->opened_ = true;
 
-    if (init_status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
-        std::cerr << "ERROR: initializing decoder: " << FLAC__StreamDecoderInitStatusString[init_status] << "\n";
-        ok = false;
+    if (this->track_io)
+        this->storage_known_ = threadStorageBytes(this->storage_start_);
+
+    {
+        MQAID_TIME_STAGE(this->stage_times, Stage::Init);
+
+        // opened for update only once the file is known to be tagged, see makeWritable()
+        this->handle = std::fopen(this->file_.c_str(), "rb");
+
+        (void) this->set_md5_checking(true);
+        (void) this->set_metadata_respond(FLAC__METADATA_TYPE_VORBIS_COMMENT); /* instruct decoder to parse vorbis_comments */
+        this->init_status_ = this->handle ? this->init() : FLAC__STREAM_DECODER_INIT_STATUS_ERROR_OPENING_FILE;
+
+        if (this->init_status_ != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+            this->error = FLAC__StreamDecoderInitStatusString[this->init_status_];
     }
 
+    MQAID_TIME_STAGE(this->stage_times, Stage::Metadata);
     this->process_until_end_of_metadata();
+    if (this->track_io && this->init_status_ == FLAC__STREAM_DECODER_INIT_STATUS_OK
+        && !this->get_decode_position(&this->io.metadata))
+        this->io.metadata = 0;
+
+    return this->init_status_;
+}
+
+
+inline bool MQA_identifier::MyDecoder::makeWritable() {
+    if (this->updating_)
+        return true;
+    if (!this->writable_ || !this->handle)
+        return false;
+    std::FILE *update = std::fopen(this->file_.c_str(), "r+b");
+    if (!update)
+        return false;
+    std::fclose(this->handle);
+    this->handle = update;
+    this->updating_ = true;
+    return true;
+}
+
+
+inline void MQA_identifier::MyDecoder::close() {
+    (void) this->finish();
+    if (this->handle)
+        std::fclose(this->handle);
+    this->handle = nullptr;
+    this->updating_ = false;
+}
 
-    // pre-allocate samples vector
-    this->samples.reserve(this->sample_rate * 3);
 
-    while (ok && this->decoded_samples < this->sample_rate * 3 /* read only 3 first seconds */ )
-        ok = this->process_single();
+inline MQA_identifier::MyDecoder::~MyDecoder() {
+    this->close();
+}
+
 
+inline ::FLAC__StreamDecoderInitStatus MQA_identifier::MyDecoder::decode() {
+    FLAC__StreamDecoderInitStatus init_status = this->open();
+    bool ok = init_status == FLAC__STREAM_DECODER_INIT_STATUS_OK;
+    if (ok && !this->stream.supported()) {
+        if (this->error.empty()) this->error = FlacStream::kUnsupported;
+        return init_status;
+    }
 
-    if (!ok) {
-        std::cerr << "decoding FAILED\n";
-        std::cerr << this->get_state().resolved_as_cstring(*this);
+    {
+        // the samples are searched as they are decoded, up to the first 3 seconds: decoding stops once the
+        // result is known (streams shorter than that end early)
+        MQAID_TIME_STAGE(this->stage_times, Stage::Decode);
+        while (ok && this->stream.detection() == MQADetector::Result::Pending
+               && this->get_state() != FLAC__STREAM_DECODER_END_OF_STREAM)
+            ok = this->process_single();
+        // a stream that failed to decode isn't identified
+        if (ok)
+            this->stream.finish();
     }
+    if (this->track_io && (!ok || !this->get_decode_position(&this->io.needed)))
+        this->io.needed = 0;
+
+
+    if (!ok && this->error.empty())
+        this->error = this->get_state().resolved_as_cstring(*this);
     return init_status;
 }
 
 
-bool MQA_identifier::detect() {
+inline IoStats MQA_identifier::MyDecoder::ioSnapshot() {
+    IoStats snapshot = this->io;
+    snapshot.returned = this->bytes_read;
+    if (!this->track_io)
+        return snapshot;
+
+    snapshot.os_read += static_cast<uint64_t>(std::max<int64_t>(this->osOffset() - this->os_mark_, 0));
+    // a file that wasn't decoded only needed its metadata
+    if (snapshot.needed == 0)
+        snapshot.needed = snapshot.metadata;
+    uint64_t storage = 0;
+    if (this->storage_known_ && threadStorageBytes(storage) && storage >= this->storage_start_)
+        snapshot.storage = storage - this->storage_start_;
+    return snapshot;
+}
+
+
+inline bool MQA_identifier::readMetadata() {
+    return this->decoder.open() == FLAC__STREAM_DECODER_INIT_STATUS_OK;
+}
+
+
+inline bool MQA_identifier::detect() {
     this->decoder.decode();
-    //check the bufer three times from the P,P+1,P+2 value
-    uint64_t buffer = 0;
-    uint64_t buffer1 = 0;
-    uint64_t buffer2 = 0;
-    const auto pos = (this->decoder.bps - 16u); // aim for 16th bit
-
-    for (const auto &s: this->decoder.samples) {
-        buffer  |= ((static_cast<uint32_t>(s[0]) ^ static_cast<uint32_t>(s[1])) >> pos    ) & 1u;
-        buffer1 |= ((static_cast<uint32_t>(s[0]) ^ static_cast<uint32_t>(s[1])) >> pos + 1) & 1u;
-        buffer2 |= ((static_cast<uint32_t>(s[0]) ^ static_cast<uint32_t>(s[1])) >> pos + 2) & 1u;
-
-        if (buffer == 0xbe0498c88) {        // MQA magic word
-            this->isMQA_ = true;
-            // Get Original Sample Rate
-            uint8_t orsf = 0;
-            for (auto m = 3u; m < 7; m++) { // TODO: this need fix (orsf is 5bits)
-                auto cur = *(&s + m);
-                auto j = ((static_cast<uint32_t>(cur[0]) ^ static_cast<uint32_t>(cur[1])) >> pos) & 1u;
-                orsf |= j << (6u - m);
-            }
-            this->decoder.original_sample_rate = OriginalSampleRateDecoder(orsf);
-
-            // Get MQA Studio
-            uint8_t provenance = 0u;
-            for (auto m = 29u; m < 34; m++) {
-                auto cur = *(&s + m);
-                auto j = ((static_cast<uint32_t>(cur[0]) ^ static_cast<uint32_t>(cur[1])) >> pos) & 1u;
-                provenance |= j << (33u - m);
-            }
-            this->isMQAStudio_ = provenance > 8;
-
-            // We are done return true
-            return true;
-        } else
-        if (buffer1 == 0xbe0498c88) {        // MQA magic word
-            this->isMQA_ = true;
-            // Get Original Sample Rate
-            uint8_t orsf = 0;
-            for (auto m = 3u; m < 7; m++) { // TODO: this need fix (orsf is 5bits)
-                auto cur = *(&s + m);
-                auto j = ((static_cast<uint32_t>(cur[0]) ^ static_cast<uint32_t>(cur[1])) >> pos + 1) & 1u;
-                orsf |= j << (6u - m);
-            }
-            this->decoder.original_sample_rate = OriginalSampleRateDecoder(orsf);
-
-            // Get MQA Studio
-            uint8_t provenance = 0u;
-            for (auto m = 29u; m < 34; m++) {
-                auto cur = *(&s + m);
-                auto j = ((static_cast<uint32_t>(cur[0]) ^ static_cast<uint32_t>(cur[1])) >> pos + 1) & 1u;
-                provenance |= j << (33u - m);
-            }
-            this->isMQAStudio_ = provenance > 8;
-
-            // We are done return true
-            return true;
-        } else
-        if (buffer2 == 0xbe0498c88) {        // MQA magic word
-            this->isMQA_ = true;
-            // Get Original Sample Rate
-            uint8_t orsf = 0;
-            for (auto m = 3u; m < 7; m++) { // TODO: this need fix (orsf is 5bits)
-                auto cur = *(&s + m);
-                auto j = ((static_cast<uint32_t>(cur[0]) ^ static_cast<uint32_t>(cur[1])) >> pos + 2) & 1u;
-                orsf |= j << (6u - m);
-            }
-            this->decoder.original_sample_rate = OriginalSampleRateDecoder(orsf);
-
-            // Get MQA Studio
-            uint8_t provenance = 0u;
-            for (auto m = 29u; m < 34; m++) {
-                auto cur = *(&s + m);
-                auto j = ((static_cast<uint32_t>(cur[0]) ^ static_cast<uint32_t>(cur[1])) >> pos + 2) & 1u;
-                provenance |= j << (33u - m);
-            }
-            this->isMQAStudio_ = provenance > 8;
-
-            // We are done return true
-            return true;
-
-        } else
-        buffer = (buffer << 1u) & 0xFFFFFFFFFu;
-        buffer1 = (buffer1 << 1u) & 0xFFFFFFFFFu;
-        buffer2 = (buffer2 << 1u) & 0xFFFFFFFFFu;
-    }
-    return false;
+    const auto found = this->decoder.stream.found();
+    this->isMQA_ = found.isMQA;
+    this->isMQAStudio_ = found.isMQAStudio;
+    return found.isMQA;
+}
+
+
+inline std::string MQA_identifier::getMQA_encoder() const noexcept {
+    return this->decoder.stream.mqa_encoder;
+}
+
+
+#ifdef MQAID_STAGE_TIMING
+inline StageTimes &MQA_identifier::stageTimes() noexcept {
+    return this->decoder.stage_times;
+}
+#endif
+
+
+inline const std::string &MQA_identifier::error() const noexcept {
+    return this->decoder.error;
+}
+
+
+inline uint64_t MQA_identifier::bytesRead() const noexcept {
+    return this->decoder.bytes_read;
+}
+
+
+inline uint64_t MQA_identifier::decoderBufferEstimate() const noexcept {
+    // libFLAC keeps an output and a residual buffer of the largest block for each channel
+    const auto &stream = this->decoder.stream;
+    return uint64_t(stream.max_blocksize) * std::max(stream.channels, 1u) * 2 * sizeof(FLAC__int32);
+}
+
+
+inline uint32_t MQA_identifier::sampleRate() const noexcept {
+    return this->decoder.stream.sample_rate;
+}
+
+
+inline uint32_t MQA_identifier::bitsPerSample() const noexcept {
+    return this->decoder.stream.bps;
+}
+
+
+inline void MQA_identifier::trackIO() noexcept {
+    this->decoder.track_io = true;
+}
+
+
+inline IoStats MQA_identifier::ioStats() {
+    return this->decoder.ioSnapshot();
+}
+
+
+inline uint64_t MQA_identifier::decodedSamples() const noexcept {
+    return this->decoder.stream.decoded_samples;
+}
+
+
+inline const DecodeErrorCounts &MQA_identifier::decodeErrors() const noexcept {
+    return this->decoder.error_counts;
+}
+
+
+inline std::FILE *MQA_identifier::handle() const noexcept {
+    return this->decoder.handle;
+}
+
+
+inline bool MQA_identifier::makeWritable() {
+    return this->decoder.makeWritable();
+}
+
+
+inline const FLAC::Metadata::VorbisComment *MQA_identifier::vorbisComment() const noexcept {
+    return this->decoder.vorbis_comment.get();
+}
+
+
+inline void MQA_identifier::close() {
+    this->decoder.close();
+}
+
+
+inline const std::array<uint8_t, 16> &MQA_identifier::audioMD5() const noexcept {
+    return this->decoder.stream.md5;
 }
 
 
-std::string MQA_identifier::getMQA_encoder() const noexcept {
-    return this->decoder.mqa_encoder;
+inline uint32_t MQA_identifier::originalSampleRate() const noexcept {
+    return this->decoder.stream.found().originalSampleRate;
 }
 
 
-uint32_t MQA_identifier::originalSampleRate() const noexcept {
-    return this->decoder.original_sample_rate;
+inline bool MQA_identifier::identified() const noexcept {
+    return this->decoder.stream.identified();
 }
 
 
-bool MQA_identifier::isMQA() const noexcept {
+inline bool MQA_identifier::isMQA() const noexcept {
     return this->isMQA_;
 }
 
 
-bool MQA_identifier::isMQAStudio() const noexcept {
+inline bool MQA_identifier::isMQAStudio() const noexcept {
     return this->isMQAStudio_;
 }
 
 
-std::string MQA_identifier::filename() const noexcept {
+inline std::string MQA_identifier::filename() const noexcept {
     return this->file_;
 }
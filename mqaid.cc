@@ -0,0 +1,348 @@
+/**
+ * @file        mqaid.cc
+ * @short       C interface of libmqaid (see mqaid.h)
+ */
+
+#ifdef __ANDROID__
+ #include <boost/filesystem.hpp>
+#else
+ #include <filesystem>
+#endif
+
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "mqaid.h"
+#include "buffer_scanner.h"
+#include "file_scan.h"
+#include "frame_reader.h"
+#include "mqa_detector.h"
+
+#ifdef __ANDROID__
+ namespace fs = boost::filesystem;
+#else
+ namespace fs = std::filesystem;
+#endif
+
+
+struct mqaid_scanner {
+    mqaid_options options;
+    BufferScanner buffers;      // reused by every buffer scan
+};
+
+
+struct mqaid_pcm {
+    MQADetector detector;
+};
+
+
+struct mqaid_reader {
+    FrameReader reader;
+    std::string path;
+};
+
+
+namespace {
+
+int32_t pcmStatus(MQADetector::Result result) {
+    switch (result) {
+        case MQADetector::Result::Pending: return MQAID_PENDING;
+        case MQADetector::Result::MQA: return MQAID_MQA;
+        default: return MQAID_NOT_MQA;
+    }
+}
+
+/**
+ * Result set handed to the caller: the C view, and the storage its items point into
+ */
+struct ResultsBlock : mqaid_results {
+    std::vector<mqaid_result> results;
+    std::deque<std::string> strings;    // a deque, items keep pointers to its strings
+
+    ResultsBlock() : mqaid_results{0, nullptr} {}
+
+    const char *keep(std::string text) {
+        this->strings.push_back(std::move(text));
+        return this->strings.back().c_str();
+    }
+
+    mqaid_result &add(const std::string &path) {
+        this->results.push_back(mqaid_result{});
+        auto &result = this->results.back();
+        result.path = this->keep(path);
+        result.encoder = "";
+        result.error = "";
+        return result;
+    }
+
+    void fail(const std::string &path, const std::string &error) {
+        auto &result = this->add(path);
+        result.status = MQAID_ERROR;
+        result.error = this->keep(error);
+    }
+
+    mqaid_results *publish() {
+        this->count = this->results.size();
+        this->items = this->results.data();
+        return this;
+    }
+};
+
+
+int32_t scanStatus(ScanStatus status) {
+    switch (status) {
+        case ScanStatus::MQA: return MQAID_MQA;
+        case ScanStatus::NotMQA: return MQAID_NOT_MQA;
+        default: return MQAID_ERROR;
+    }
+}
+
+
+void scanFile(const mqaid_options &options, const std::string &file, ResultsBlock &block) {
+    const auto scan = identifyFile(file, options.add_mqaencoder != 0, options.rewrite_tags != 0,
+                                   options.padding_reserve);
+    auto &result = block.add(file);
+    result.status = scanStatus(scan.status);
+    result.studio = scan.isMQAStudio;
+    result.original_sample_rate = scan.originalSampleRate;
+    result.tags_written = scan.tags_written;
+    result.encoder = block.keep(scan.encoder);
+    result.error = block.keep(scan.error);
+    result.bytes_read = scan.bytes_read;
+}
+
+
+void scanPath(const mqaid_options &options, const std::string &path, ResultsBlock &block) {
+    const fs::path root(path);
+    if (fs::is_directory(root)) {
+        std::vector<std::string> files;
+        for (const auto &entry : fs::recursive_directory_iterator(root))
+            if (fs::is_regular_file(entry) && isScannable(entry.path()))
+                files.push_back(entry.path().string());
+        std::sort(files.begin(), files.end());
+        for (const auto &file : files)
+            scanFile(options, file, block);
+    } else if (!fs::exists(root))
+        block.fail(path, "no such file or directory");
+    else if (!isScannable(root))
+        block.fail(path, kNotScannable);
+    else
+        scanFile(options, path, block);
+}
+
+}
+
+
+extern "C" {
+
+const char *mqaid_version(void) {
+    return "1.0";
+}
+
+
+void mqaid_options_init(mqaid_options *options) {
+    if (!options)
+        return;
+    *options = mqaid_options{};
+    options->struct_size = sizeof(mqaid_options);
+    options->padding_reserve = 8192;
+}
+
+
+mqaid_scanner *mqaid_scanner_new(const mqaid_options *options) {
+    auto *scanner = new(std::nothrow) mqaid_scanner;
+    if (!scanner)
+        return nullptr;
+    mqaid_options_init(&scanner->options);
+    // fields past what the caller's struct holds keep their defaults
+    if (options && options->struct_size >= sizeof(uint32_t)) {
+        const auto size = std::min<size_t>(options->struct_size, sizeof(mqaid_options));
+        std::copy_n(reinterpret_cast<const char *>(options), size, reinterpret_cast<char *>(&scanner->options));
+        scanner->options.struct_size = sizeof(mqaid_options);
+    }
+    return scanner;
+}
+
+
+void mqaid_scanner_free(mqaid_scanner *scanner) {
+    delete scanner;
+}
+
+
+mqaid_results *mqaid_scan_paths(mqaid_scanner *scanner, const char *const *paths, size_t count) {
+    if (!scanner || (!paths && count))
+        return nullptr;
+    auto *block = new(std::nothrow) ResultsBlock;
+    if (!block)
+        return nullptr;
+    // nothing may unwind through the C boundary
+    for (size_t i = 0; i < count; i++) {
+        const std::string path = paths[i] ? paths[i] : "";
+        try {
+            scanPath(scanner->options, path, *block);
+        } catch (const std::bad_alloc &) {
+            delete block;
+            return nullptr;
+        } catch (const std::exception &e) {
+            try { block->fail(path, e.what()); } catch (...) { delete block; return nullptr; }
+        } catch (...) {
+            try { block->fail(path, "unknown error"); } catch (...) { delete block; return nullptr; }
+        }
+    }
+    return block->publish();
+}
+
+
+mqaid_results *mqaid_scan_path(mqaid_scanner *scanner, const char *path) {
+    return mqaid_scan_paths(scanner, &path, 1);
+}
+
+
+void mqaid_results_free(mqaid_results *results) {
+    delete static_cast<ResultsBlock *>(results);
+}
+
+
+int32_t mqaid_scan_buffer(mqaid_scanner *scanner, const void *data, size_t size, mqaid_result *result) {
+    if (!scanner || !result)
+        return MQAID_ERROR;
+    *result = mqaid_result{};
+    result->path = "";
+    try {
+        auto &buffers = scanner->buffers;
+        const bool mqa = buffers.scan(static_cast<const uint8_t *>(data), size);
+        result->bytes_read = buffers.bytesRead();
+        result->encoder = buffers.getMQA_encoder().c_str();
+        result->error = buffers.error().c_str();
+        result->studio = buffers.isMQAStudio();
+        result->original_sample_rate = buffers.originalSampleRate();
+        result->status = !buffers.identified() ? MQAID_ERROR : mqa ? MQAID_MQA : MQAID_NOT_MQA;
+    } catch (...) {
+        result->encoder = "";
+        result->error = "unknown error";
+        result->status = MQAID_ERROR;
+    }
+    return result->status;
+}
+
+
+mqaid_pcm *mqaid_pcm_new(uint32_t bits, uint64_t window) {
+    try {
+        return new mqaid_pcm{MQADetector(bits, window)};
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+
+int32_t mqaid_pcm_add_interleaved(mqaid_pcm *pcm, const void *samples, size_t frames, int32_t format) {
+    if (!pcm || (!samples && frames))
+        return MQAID_ERROR;
+    auto &detector = pcm->detector;
+    switch (format) {
+        case MQAID_S16: return pcmStatus(detector.addInterleaved(static_cast<const int16_t *>(samples), frames));
+        case MQAID_S24: return pcmStatus(detector.addInterleaved24(static_cast<const uint8_t *>(samples), frames));
+        case MQAID_S32: return pcmStatus(detector.addInterleaved(static_cast<const int32_t *>(samples), frames));
+        default: return MQAID_ERROR;
+    }
+}
+
+
+int32_t mqaid_pcm_add_planar(mqaid_pcm *pcm, const void *left, const void *right, size_t frames, int32_t format) {
+    if (!pcm || ((!left || !right) && frames))
+        return MQAID_ERROR;
+    auto &detector = pcm->detector;
+    switch (format) {
+        case MQAID_S16:
+            return pcmStatus(detector.addPlanar(static_cast<const int16_t *>(left),
+                                                static_cast<const int16_t *>(right), frames));
+        case MQAID_S24:
+            return pcmStatus(detector.addPlanar24(static_cast<const uint8_t *>(left),
+                                                  static_cast<const uint8_t *>(right), frames));
+        case MQAID_S32:
+            return pcmStatus(detector.addPlanar(static_cast<const int32_t *>(left),
+                                                static_cast<const int32_t *>(right), frames));
+        default: return MQAID_ERROR;
+    }
+}
+
+
+int32_t mqaid_pcm_finish(mqaid_pcm *pcm, mqaid_result *result) {
+    if (!pcm)
+        return MQAID_ERROR;
+    const auto status = pcmStatus(pcm->detector.finish());
+    if (result) {
+        const auto &stream = pcm->detector.stream();
+        *result = mqaid_result{};
+        result->path = "";
+        result->encoder = "";
+        result->error = pcm->detector.error().c_str();
+        result->status = status;
+        result->studio = stream.isMQAStudio;
+        result->original_sample_rate = stream.originalSampleRate;
+    }
+    return status;
+}
+
+
+void mqaid_pcm_free(mqaid_pcm *pcm) {
+    delete pcm;
+}
+
+
+mqaid_reader *mqaid_reader_open(const char *path) {
+    if (!path)
+        return nullptr;
+    try {
+        return new mqaid_reader{FrameReader(path), path};
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+
+int32_t mqaid_reader_next(mqaid_reader *reader, mqaid_frame *frame) {
+    if (!reader || !frame)
+        return MQAID_ERROR;
+    try {
+        const auto *next = reader->reader.next();
+        if (!next)
+            return reader->reader.error().empty() ? 0 : MQAID_ERROR;
+        *frame = mqaid_frame{next->first_sample, next->samples, next->channels, next->bps, next->planes};
+        return 1;
+    } catch (...) {
+        return MQAID_ERROR;
+    }
+}
+
+
+int32_t mqaid_reader_detection(mqaid_reader *reader, mqaid_result *result) {
+    if (!reader)
+        return MQAID_ERROR;
+    auto status = pcmStatus(reader->reader.detection());
+    // decoding stopped before detection got a result: the file can't be identified
+    if (status == MQAID_PENDING && reader->reader.failed())
+        status = MQAID_ERROR;
+    if (result) {
+        const auto stream = reader->reader.stream();
+        *result = mqaid_result{};
+        result->path = reader->path.c_str();
+        result->status = status;
+        result->studio = stream.isMQAStudio;
+        result->original_sample_rate = stream.originalSampleRate;
+        result->encoder = reader->reader.getMQA_encoder().c_str();
+        result->error = reader->reader.error().c_str();
+    }
+    return status;
+}
+
+
+void mqaid_reader_free(mqaid_reader *reader) {
+    delete reader;
+}
+
+}
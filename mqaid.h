@@ -0,0 +1,185 @@
+/**
+ * @file        mqaid.h
+ * @short       C interface of libmqaid, MQA identification in-process
+ *
+ * A scanner holds the options of a series of scans. It isn't thread safe: use one scanner per thread.
+ * Scans return a result set owned by the caller, released with mqaid_results_free(); the strings of a
+ * result live as long as its set.
+ */
+
+#ifndef MQAID_H
+#define MQAID_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(MQAID_STATIC)
+ #define MQAID_API
+#elif defined(_WIN32)
+ #ifdef MQAID_BUILDING
+  #define MQAID_API __declspec(dllexport)
+ #else
+  #define MQAID_API __declspec(dllimport)
+ #endif
+#else
+ #define MQAID_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQAID_VERSION_MAJOR 1
+#define MQAID_VERSION_MINOR 0
+
+typedef enum mqaid_status {
+    MQAID_ERROR = -1,       /* the file couldn't be identified, see error */
+    MQAID_NOT_MQA = 0,
+    MQAID_MQA = 1,
+    MQAID_PENDING = 2       /* PCM detection needs more samples */
+} mqaid_status;
+
+typedef enum mqaid_sample_format {
+    MQAID_S16 = 0,
+    MQAID_S24 = 1,          /* packed little-endian, 3 bytes per sample */
+    MQAID_S32 = 2
+} mqaid_sample_format;
+
+typedef struct mqaid_options {
+    uint32_t struct_size;           /* sizeof(mqaid_options), set by mqaid_options_init() */
+    int32_t add_mqaencoder;         /* add MQA tags to the MQA files found */
+    int32_t rewrite_tags;           /* rewrite the tags if they already exist */
+    uint32_t padding_reserve;       /* padding left when a file has to be rewritten to fit the tags */
+} mqaid_options;
+
+typedef struct mqaid_result {
+    const char *path;
+    int32_t status;                 /* mqaid_status */
+    int32_t studio;                 /* MQA Studio */
+    uint32_t original_sample_rate;  /* in Hz, 0 when not MQA */
+    int32_t tags_written;           /* MQA tags were added to the file */
+    const char *encoder;            /* MQAENCODER tag, empty if none */
+    const char *error;              /* first error met, empty if none; also set along an MQA or NOT_MQA status
+                                       when decoding recovered from errors or the tags couldn't be written */
+    uint64_t bytes_read;
+} mqaid_result;
+
+typedef struct mqaid_results {
+    size_t count;
+    mqaid_result *items;
+} mqaid_results;
+
+typedef struct mqaid_frame {
+    uint64_t first_sample;          /* index of its first sample in the stream */
+    uint32_t samples;               /* per channel */
+    uint32_t channels;
+    uint32_t bits_per_sample;
+    const int32_t *const *planes;   /* one plane of samples per channel, valid until the next pull */
+} mqaid_frame;
+
+typedef struct mqaid_scanner mqaid_scanner;
+typedef struct mqaid_pcm mqaid_pcm;
+typedef struct mqaid_reader mqaid_reader;
+
+
+/** Version of the library ("major.minor") */
+MQAID_API const char *mqaid_version(void);
+
+/** Fill options with the defaults (no tagging, 8192 bytes of padding) */
+MQAID_API void mqaid_options_init(mqaid_options *options);
+
+/**
+ * Create a scanner
+ * @param options options of the scans, NULL for the defaults
+ * @return NULL if out of memory
+ */
+MQAID_API mqaid_scanner *mqaid_scanner_new(const mqaid_options *options);
+
+MQAID_API void mqaid_scanner_free(mqaid_scanner *scanner);
+
+/**
+ * Identify a file (flac, or uncompressed WAV/BWF, RF64, Wave64 or AIFF), or every such file under a directory.
+ * The first seconds of samples of uncompressed files are memory-mapped. The file size is checked once they are
+ * mapped, but a file truncated by another process while it is searched raises SIGBUS on POSIX systems; don't
+ * scan files that are being rewritten, or handle that signal.
+ * @return results in scan order (a path that can't be scanned gets an MQAID_ERROR result), NULL if out of memory
+ */
+MQAID_API mqaid_results *mqaid_scan_path(mqaid_scanner *scanner, const char *path);
+
+/**
+ * Identify several paths (files or directories) in one call
+ */
+MQAID_API mqaid_results *mqaid_scan_paths(mqaid_scanner *scanner, const char *const *paths, size_t count);
+
+MQAID_API void mqaid_results_free(mqaid_results *results);
+
+/**
+ * Identify a flac stream held in memory, without allocating once the scanner has seen its largest format (and
+ * its longest MQAENCODER tag).
+ * Tags are never written. The strings of the result stay valid until the next scan of the scanner.
+ * @param result filled with the outcome (path is empty)
+ * @return its status
+ */
+MQAID_API int32_t mqaid_scan_buffer(mqaid_scanner *scanner, const void *data, size_t size, mqaid_result *result);
+
+
+/**
+ * Start MQA detection on decoded stereo PCM, from any decoder
+ * @param bits width the sample values span: 16 or 24 in the low bits of their container, 32 if left-justified
+ * @param window samples per channel searched before giving up, 0 to search until mqaid_pcm_finish()
+ * @return NULL if out of memory
+ */
+MQAID_API mqaid_pcm *mqaid_pcm_new(uint32_t bits, uint64_t window);
+
+/**
+ * Feed frames of left and right samples, interleaved
+ * @param format mqaid_sample_format
+ * @return MQAID_PENDING until the result is known, then MQAID_MQA or MQAID_NOT_MQA (MQAID_ERROR on bad arguments)
+ */
+MQAID_API int32_t mqaid_pcm_add_interleaved(mqaid_pcm *pcm, const void *samples, size_t frames, int32_t format);
+
+/**
+ * Feed frames of left and right samples, one plane per channel
+ */
+MQAID_API int32_t mqaid_pcm_add_planar(mqaid_pcm *pcm, const void *left, const void *right, size_t frames,
+                                       int32_t format);
+
+/**
+ * End of the stream: a pending search gives up
+ * @param result filled with the outcome if not NULL (its strings live as long as pcm)
+ * @return MQAID_MQA or MQAID_NOT_MQA
+ */
+MQAID_API int32_t mqaid_pcm_finish(mqaid_pcm *pcm, mqaid_result *result);
+
+MQAID_API void mqaid_pcm_free(mqaid_pcm *pcm);
+
+
+/**
+ * Decode a flac file frame by frame, when asked to; MQA detection runs on the frames pulled
+ * @return NULL if out of memory (the file is opened by the first pull)
+ */
+MQAID_API mqaid_reader *mqaid_reader_open(const char *path);
+
+/**
+ * Pull the next frame
+ * @return 1 if frame was filled, 0 at the end of the stream, MQAID_ERROR if decoding failed
+ */
+MQAID_API int32_t mqaid_reader_next(mqaid_reader *reader, mqaid_frame *frame);
+
+/**
+ * Where MQA detection stands after the frames pulled so far (MQAID_NOT_MQA once the metadata shows a stream
+ * other than 16 or 24 bit stereo, as file scans don't identify those)
+ * @param result filled with the outcome if not NULL (its strings live until the next call on reader)
+ * @return MQAID_PENDING, MQAID_MQA or MQAID_NOT_MQA; MQAID_ERROR if the file couldn't be opened or a frame
+ *         couldn't be decoded before detection got a result (see the result's error)
+ */
+MQAID_API int32_t mqaid_reader_detection(mqaid_reader *reader, mqaid_result *result);
+
+/** Stop decoding and close the file */
+MQAID_API void mqaid_reader_free(mqaid_reader *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MQAID_H */
@@ -0,0 +1,172 @@
+/**
+ * @file        path_store.h
+ * @short       Compact storage for large lists of file paths
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+/**
+ * Interned path list.
+ * Directories are kept as a tree of nodes (roots hold the path as given, children only their own name),
+ * files as a (directory, leaf name) pair. All names live in a chunked arena, so every directory prefix is
+ * stored once and full paths are only materialised on demand.
+ */
+class PathStore {
+ public:
+  using DirId = uint32_t;
+  static constexpr DirId kNoParent = UINT32_MAX;
+
+#ifdef _WIN32
+  static constexpr char kSeparator = '\\';
+#else
+  static constexpr char kSeparator = '/';
+#endif
+
+  /**
+   * @short Add a directory node
+   * @param parent parent directory, or kNoParent for a root (then name is the full path)
+   * @param name directory name
+   * @return id of the new directory
+   */
+  DirId addDirectory(DirId parent, std::string_view name) {
+      this->dirs_.push_back(Node{parent, this->intern(name)});
+      return static_cast<DirId>(this->dirs_.size() - 1);
+  }
+
+  /**
+   * @short Add a file living in an already known directory
+   * @param carried the file comes from an unchanged directory and its previous result can be reused
+   */
+  void addFile(DirId dir, std::string_view name, bool carried = false) {
+      this->files_.push_back(Node{dir, this->intern(name)});
+      if (carried || !this->carried_.empty())
+          this->carried_.resize(this->files_.size(), false);
+      if (carried)
+          this->carried_.back() = true;
+  }
+
+  /**
+   * @short Add a file given by its full path (consecutive files of the same directory share its node)
+   */
+  void addFile(std::string_view path) {
+      auto sep = path.find_last_of(kSeparator);
+#ifdef _WIN32
+      const auto alt = path.find_last_of('/');
+      if (alt != std::string_view::npos && (sep == std::string_view::npos || alt > sep)) sep = alt;
+#endif
+      if (sep == std::string_view::npos) {
+          this->files_.push_back(Node{kNoParent, this->intern(path)});
+          return;
+      }
+
+      const auto dir = path.substr(0, sep + 1);
+      if (this->lastRoot_ == kNoParent || this->name(this->dirs_[this->lastRoot_].name) != dir)
+          this->lastRoot_ = this->addDirectory(kNoParent, dir);
+
+      this->addFile(this->lastRoot_, path.substr(sep + 1));
+  }
+
+  [[nodiscard]] size_t size() const noexcept { return this->files_.size(); }
+  [[nodiscard]] bool empty() const noexcept { return this->files_.empty(); }
+
+  /**
+   * @short Materialise the full path of the i-th file
+   */
+  [[nodiscard]] std::string path(size_t i) const {
+      const auto &leaf = this->files_[i];
+
+      std::string out;
+      this->appendDirectory(leaf.parent, out);
+      const auto name = this->name(leaf.name);
+      out.append(name.data(), name.size());
+      return out;
+  }
+
+  /**
+   * @short Name of the i-th file, without its directory
+   */
+  [[nodiscard]] std::string_view filename(size_t i) const noexcept {
+      return this->name(this->files_[i].name);
+  }
+
+  /**
+   * @short Whether the i-th file was added as carried forward
+   */
+  [[nodiscard]] bool carried(size_t i) const noexcept {
+      return i < this->carried_.size() && this->carried_[i];
+  }
+
+  /**
+   * @short Approximate heap usage in bytes
+   */
+  [[nodiscard]] size_t memoryUsage() const noexcept {
+      return this->arena_bytes_
+             + this->chunks_.capacity() * sizeof(this->chunks_[0])
+             + this->dirs_.capacity() * sizeof(Node)
+             + this->files_.capacity() * sizeof(Node)
+             + this->carried_.capacity() / 8;
+  }
+
+ private:
+  static constexpr size_t kChunkSize = 1u << 20u;
+
+  struct NameRef {
+      uint32_t chunk;
+      uint32_t offset;
+      uint32_t length;
+  };
+
+  struct Node {
+      DirId parent;
+      NameRef name;
+  };
+
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  size_t used_ = kChunkSize;
+  size_t arena_bytes_ = 0;      // allocated for the chunks, oversized ones included
+  std::vector<Node> dirs_;
+  std::vector<Node> files_;
+  std::vector<bool> carried_;
+  DirId lastRoot_ = kNoParent;
+
+
+  NameRef intern(std::string_view name) {
+      // Names never straddle chunks, a chunk is far larger than any path component (a longer name gets its own)
+      if (this->used_ + name.size() > kChunkSize) {
+          const size_t size = std::max(kChunkSize, name.size());
+          this->chunks_.emplace_back(new char[size]);
+          this->arena_bytes_ += size;
+          this->used_ = 0;
+      }
+
+      const NameRef ref{static_cast<uint32_t>(this->chunks_.size() - 1), static_cast<uint32_t>(this->used_),
+                        static_cast<uint32_t>(name.size())};
+      std::copy(name.begin(), name.end(), this->chunks_.back().get() + this->used_);
+      this->used_ += name.size();
+      return ref;
+  }
+
+  [[nodiscard]] std::string_view name(const NameRef &ref) const noexcept {
+      return {this->chunks_[ref.chunk].get() + ref.offset, ref.length};
+  }
+
+  void appendDirectory(DirId dir, std::string &out) const {
+      if (dir == kNoParent) return;
+
+      const auto &node = this->dirs_[dir];
+      this->appendDirectory(node.parent, out);
+
+      const auto name = this->name(node.name);
+      out.append(name.data(), name.size());
+      if (!name.empty() && name.back() != kSeparator && name.back() != '/')
+          out.push_back(kSeparator);
+  }
+};
@@ -0,0 +1,514 @@
+/**
+ * @file        pcm_file.h
+ * @short       MQA identification of uncompressed files (WAV/BWF, RF64, Wave64, AIFF) straight from a mapping
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#ifdef _WIN32
+ #ifndef NOMINMAX
+  #define NOMINMAX
+ #endif
+ #include <windows.h>
+#else
+ #include <fcntl.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <unistd.h>
+#endif
+
+#include "mqa_detector.h"
+#include "stage_timer.h"
+
+
+/**
+ * @short Whether a file name has the extension of an uncompressed container read by PcmFile (any case)
+ */
+inline bool isPcmFileName(const std::string &name) {
+    const auto dot = name.find_last_of("./\\");
+    if (dot == std::string::npos || name[dot] != '.')
+        return false;
+    std::string ext = name.substr(dot);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    return ext == ".wav" || ext == ".wave" || ext == ".bwf" || ext == ".rf64" || ext == ".w64"
+           || ext == ".aif" || ext == ".aiff" || ext == ".aifc";
+}
+
+
+/**
+ * Why a file given by path isn't identified (see isScannable())
+ */
+constexpr const char *kNotScannable = "not a .flac or WAV/AIFF file";
+
+
+/**
+ * @short Whether a file is identified by the scan: flac, or an uncompressed WAV/BWF, RF64, Wave64 or AIFF file
+ */
+inline bool isScannable(const std::filesystem::path &path) {
+    return path.extension() == ".flac" || isPcmFileName(path.filename().string());
+}
+
+
+/**
+ * Read-only file: its chunk headers are read with pread, and only the range of samples searched is mapped.
+ * The size is checked again once that range is mapped, as touching pages past the end of a file truncated in
+ * the meantime raises SIGBUS (Windows doesn't let mapped files be truncated).
+ */
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &file) {
+#ifdef _WIN32
+      this->file_ = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+      LARGE_INTEGER size{};
+      if (this->file_ != INVALID_HANDLE_VALUE && GetFileSizeEx(this->file_, &size))
+          this->size_ = static_cast<uint64_t>(size.QuadPart);
+#else
+      this->fd_ = open(file.c_str(), O_RDONLY);
+      struct stat st{};
+      if (this->fd_ >= 0 && fstat(this->fd_, &st) == 0)
+          this->size_ = static_cast<uint64_t>(st.st_size);
+#endif
+  }
+
+  ~MappedFile() {
+      this->unmap();
+#ifdef _WIN32
+      if (this->file_ != INVALID_HANDLE_VALUE) CloseHandle(this->file_);
+#else
+      if (this->fd_ >= 0) close(this->fd_);
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  [[nodiscard]] bool isOpen() const noexcept {
+#ifdef _WIN32
+      return this->file_ != INVALID_HANDLE_VALUE;
+#else
+      return this->fd_ >= 0;
+#endif
+  }
+
+  [[nodiscard]] uint64_t size() const noexcept { return this->size_; }
+
+  /**
+   * @short Read bytes of the file
+   * @return false unless they were all read
+   */
+  bool read(uint64_t offset, void *out, size_t length) const {
+      if (!this->isOpen() || offset > this->size_ || length > this->size_ - offset)
+          return false;
+      auto *bytes = static_cast<uint8_t *>(out);
+      while (length > 0) {
+#ifdef _WIN32
+          OVERLAPPED at{};
+          at.Offset = static_cast<DWORD>(offset);
+          at.OffsetHigh = static_cast<DWORD>(offset >> 32u);
+          DWORD got = 0;
+          if (!ReadFile(this->file_, bytes, static_cast<DWORD>(std::min<size_t>(length, 1u << 30u)), &got, &at))
+              return false;
+#else
+          const auto got = pread(this->fd_, bytes, length, static_cast<off_t>(offset));
+          if (got < 0 && errno == EINTR)
+              continue;
+#endif
+          if (got <= 0)
+              return false;
+          bytes += got;
+          offset += static_cast<uint64_t>(got);
+          length -= static_cast<size_t>(got);
+      }
+      return true;
+  }
+
+  /**
+   * @short Map a range of the file (replacing the previous one), read ahead in one go as it is faulted in
+   * @return the range, nullptr if it can't be mapped or isn't in the file anymore
+   */
+  const uint8_t *map(uint64_t offset, uint64_t length) {
+      this->unmap();
+      if (!this->isOpen() || length == 0 || offset > this->size_ || length > this->size_ - offset)
+          return nullptr;
+#ifdef _WIN32
+      SYSTEM_INFO info{};
+      GetSystemInfo(&info);
+      const uint64_t start = offset / info.dwAllocationGranularity * info.dwAllocationGranularity;
+      this->mapping_ = CreateFileMappingA(this->file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (!this->mapping_)
+          return nullptr;
+      this->view_ = MapViewOfFile(this->mapping_, FILE_MAP_READ, static_cast<DWORD>(start >> 32u),
+                                  static_cast<DWORD>(start), static_cast<SIZE_T>(offset + length - start));
+      if (!this->view_)
+          return nullptr;
+#else
+      const auto page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+      const uint64_t start = offset / page * page;
+      const auto span = static_cast<size_t>(offset + length - start);
+      void *view = mmap(nullptr, span, PROT_READ, MAP_SHARED, this->fd_, static_cast<off_t>(start));
+      if (view == MAP_FAILED)
+          return nullptr;
+      this->view_ = view;
+      this->view_size_ = span;
+ #ifdef POSIX_MADV_WILLNEED
+      (void) posix_madvise(view, span, POSIX_MADV_WILLNEED);
+ #endif
+      struct stat st{};
+      if (fstat(this->fd_, &st) != 0 || static_cast<uint64_t>(st.st_size) < offset + length) {
+          this->unmap();
+          return nullptr;
+      }
+#endif
+      return static_cast<const uint8_t *>(this->view_) + (offset - start);
+  }
+
+ private:
+  uint64_t size_ = 0;
+  void *view_ = nullptr;
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#else
+  int fd_ = -1;
+  size_t view_size_ = 0;
+#endif
+
+
+  void unmap() {
+#ifdef _WIN32
+      if (this->view_) UnmapViewOfFile(this->view_);
+      if (this->mapping_) CloseHandle(this->mapping_);
+      this->mapping_ = nullptr;
+#else
+      if (this->view_) munmap(this->view_, this->view_size_);
+#endif
+      this->view_ = nullptr;
+  }
+};
+
+
+/**
+ * Where and how the samples of an uncompressed file are stored
+ */
+struct PcmLayout {
+    uint32_t sample_rate = 0;
+    uint32_t channels = 0;
+    uint32_t container_bits = 0;    // bits stored per sample (block_align / channels), valid bits left-justified
+    uint32_t valid_bits = 0;
+    uint32_t block_align = 0;       // bytes per frame
+    bool big_endian = false;
+    uint64_t data_offset = 0;
+    uint64_t data_size = 0;         // clamped to the file
+};
+
+
+namespace pcm_file {
+
+inline uint16_t le16(const uint8_t *p) { return uint16_t(p[0] | (p[1] << 8u)); }
+inline uint32_t le32(const uint8_t *p) { return le16(p) | (uint32_t(le16(p + 2)) << 16u); }
+inline uint64_t le64(const uint8_t *p) { return le32(p) | (uint64_t(le32(p + 4)) << 32u); }
+inline uint16_t be16(const uint8_t *p) { return uint16_t((p[0] << 8u) | p[1]); }
+inline uint32_t be32(const uint8_t *p) { return (uint32_t(be16(p)) << 16u) | be16(p + 2); }
+
+// tail of the Wave64 GUIDs of the WAVE form and its chunks, after their four character code
+constexpr uint8_t kW64GuidTail[12] = {0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A};
+constexpr uint8_t kW64RiffGuid[16] = {'r', 'i', 'f', 'f', 0x2E, 0x91, 0xCF, 0x11,
+                                      0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00};
+
+inline bool isW64Guid(const uint8_t *guid, const char *fourcc) {
+    return std::memcmp(guid, fourcc, 4) == 0 && std::memcmp(guid + 4, kW64GuidTail, sizeof kW64GuidTail) == 0;
+}
+
+
+/**
+ * @short Parse a WAVEFORMATEX / WAVEFORMATEXTENSIBLE body
+ */
+inline std::string parseWaveFormat(const uint8_t *fmt, uint64_t length, PcmLayout &layout) {
+    if (length < 16)
+        return "truncated fmt chunk";
+    uint16_t tag = le16(fmt);
+    layout.channels = le16(fmt + 2);
+    layout.sample_rate = le32(fmt + 4);
+    layout.block_align = le16(fmt + 12);
+    const uint32_t bits = le16(fmt + 14);
+    layout.valid_bits = bits;
+    if (tag == 0xFFFE && length >= 40) {       // WAVE_FORMAT_EXTENSIBLE, the subformat GUID starts with the tag
+        layout.valid_bits = le16(fmt + 18) ? le16(fmt + 18) : bits;
+        tag = le16(fmt + 24);
+    }
+    if (tag != 1)
+        return "not integer PCM";
+
+    // The samples are as wide as the block alignment says; wBitsPerSample may be the valid bits (e.g. 20 in
+    // 3 bytes), but rounded up to bytes it has to be that width
+    if (layout.channels == 0 || layout.block_align % layout.channels != 0)
+        return "inconsistent fmt chunk (block align)";
+    layout.container_bits = layout.block_align / layout.channels * 8;
+    if ((bits + 7) / 8 * 8 != layout.container_bits || layout.valid_bits > layout.container_bits)
+        return "inconsistent fmt chunk (bits per sample)";
+    return "";
+}
+
+
+inline std::string parseRiff(const MappedFile &file, PcmLayout &layout) {
+    const uint64_t size = file.size();
+    uint64_t ds64_data = 0;
+    bool format = false;
+    uint8_t header[8];
+    for (uint64_t pos = 12; file.read(pos, header, sizeof header);) {
+        uint64_t length = le32(header + 4);
+        const uint64_t body = pos + 8;
+        if (std::memcmp(header, "ds64", 4) == 0 && length >= 24) {
+            uint8_t ds64[24];
+            if (file.read(body, ds64, sizeof ds64))
+                ds64_data = le64(ds64 + 8);
+        } else if (std::memcmp(header, "fmt ", 4) == 0) {
+            uint8_t fmt[40];
+            if (!file.read(body, fmt, static_cast<size_t>(std::min<uint64_t>(length, sizeof fmt))))
+                return "truncated fmt chunk";
+            const auto error = parseWaveFormat(fmt, length, layout);
+            if (!error.empty())
+                return error;
+            format = true;
+        } else if (std::memcmp(header, "data", 4) == 0) {
+            if (!format)
+                return "data chunk before fmt chunk";
+            if (length == 0xFFFFFFFF && ds64_data)    // RF64: the size is in ds64
+                length = ds64_data;
+            layout.data_offset = body;
+            layout.data_size = std::min(length, size - body);
+            return "";
+        }
+        pos = body + length + (length & 1u);
+    }
+    return "no data chunk";
+}
+
+
+inline std::string parseW64(const MappedFile &file, PcmLayout &layout) {
+    const uint64_t size = file.size();
+    bool format = false;
+    uint8_t header[24];
+    for (uint64_t pos = 40; file.read(pos, header, sizeof header);) {
+        const uint8_t *guid = header;
+        const uint64_t length = le64(header + 16);    // header included
+        if (length < 24)
+            return "invalid Wave64 chunk";
+        const uint64_t body = pos + 24;
+        if (isW64Guid(guid, "fmt ")) {
+            uint8_t fmt[40];
+            if (!file.read(body, fmt, static_cast<size_t>(std::min<uint64_t>(length - 24, sizeof fmt))))
+                return "truncated fmt chunk";
+            const auto error = parseWaveFormat(fmt, length - 24, layout);
+            if (!error.empty())
+                return error;
+            format = true;
+        } else if (isW64Guid(guid, "data")) {
+            if (!format)
+                return "data chunk before fmt chunk";
+            layout.data_offset = body;
+            layout.data_size = std::min(length - 24, size - body);
+            return "";
+        }
+        if (length > size - pos)
+            break;
+        pos += (length + 7) / 8 * 8;
+    }
+    return "no data chunk";
+}
+
+
+inline std::string parseAiff(const MappedFile &file, bool aifc, PcmLayout &layout) {
+    const uint64_t size = file.size();
+    bool common = false;
+    uint8_t header[8];
+    for (uint64_t pos = 12; file.read(pos, header, sizeof header);) {
+        const uint64_t length = be32(header + 4);
+        const uint64_t body = pos + 8;
+        if (std::memcmp(header, "COMM", 4) == 0) {
+            uint8_t comm[22];
+            if (length < 18 || !file.read(body, comm, 18))
+                return "truncated COMM chunk";
+            layout.channels = be16(comm);
+            layout.valid_bits = be16(comm + 6);
+            layout.container_bits = (layout.valid_bits + 7) / 8 * 8;
+            layout.block_align = layout.channels * (layout.container_bits / 8);
+            layout.big_endian = true;
+            // 80 bit extended precision sample rate
+            const uint8_t *rate = comm + 8;
+            const int exponent = (be16(rate) & 0x7FFF) - 16383 - 63;
+            const uint64_t mantissa = (uint64_t(be32(rate + 2)) << 32u) | be32(rate + 6);
+            layout.sample_rate = static_cast<uint32_t>(std::ldexp(static_cast<double>(mantissa), exponent) + 0.5);
+            if (aifc) {
+                if (length < 22 || !file.read(body + 18, comm + 18, 4))
+                    return "truncated COMM chunk";
+                const uint8_t *compression = comm + 18;
+                if (std::memcmp(compression, "sowt", 4) == 0)
+                    layout.big_endian = false;
+                else if (std::memcmp(compression, "NONE", 4) != 0 && std::memcmp(compression, "twos", 4) != 0)
+                    return "compressed AIFF-C";
+            }
+            common = true;
+        } else if (std::memcmp(header, "SSND", 4) == 0) {
+            if (!common)
+                return "SSND chunk before COMM chunk";
+            uint8_t ssnd[8];
+            if (length < 8 || !file.read(body, ssnd, sizeof ssnd))
+                return "truncated SSND chunk";
+            const uint64_t offset = be32(ssnd);
+            layout.data_offset = std::min(body + 8 + offset, size);
+            layout.data_size = std::min(length - 8 - std::min(offset, length - 8), size - layout.data_offset);
+            return "";
+        }
+        pos = body + length + (length & 1u);
+    }
+    return "no SSND chunk";
+}
+
+}
+
+
+/**
+ * @short Find the samples of a RIFF (WAV, BWF), RF64/BW64, Wave64 or AIFF/AIFF-C file
+ * @return empty if found, else why not
+ */
+inline std::string parsePcmLayout(const MappedFile &file, PcmLayout &layout) {
+    layout = PcmLayout{};
+    uint8_t head[40];
+    const uint64_t size = file.size();
+    if (!file.read(0, head, static_cast<size_t>(std::min<uint64_t>(size, sizeof head))))
+        return "couldn't read the file";
+    if (size >= 12 && (std::memcmp(head, "RIFF", 4) == 0 || std::memcmp(head, "RF64", 4) == 0
+                       || std::memcmp(head, "BW64", 4) == 0) && std::memcmp(head + 8, "WAVE", 4) == 0)
+        return pcm_file::parseRiff(file, layout);
+    if (size >= 40 && std::memcmp(head, pcm_file::kW64RiffGuid, 16) == 0 && pcm_file::isW64Guid(head + 24, "wave"))
+        return pcm_file::parseW64(file, layout);
+    if (size >= 12 && std::memcmp(head, "FORM", 4) == 0
+        && (std::memcmp(head + 8, "AIFF", 4) == 0 || std::memcmp(head + 8, "AIFC", 4) == 0))
+        return pcm_file::parseAiff(file, std::memcmp(head + 8, "AIFC", 4) == 0, layout);
+    return "unknown container";
+}
+
+
+/**
+ * Identifier of uncompressed files.
+ * The chunks of the file are parsed to find the samples, the first three seconds of them are mapped and the
+ * sync word is searched right in the mapping: there is no decoding, and only those pages are read in.
+ */
+class PcmFile {
+ public:
+  explicit PcmFile(std::string file) : file_(std::move(file)) {}
+
+  /**
+   * @short Identify the file
+   * @return whether it is MQA
+   */
+  bool detect() {
+      std::unique_ptr<MappedFile> mapping;
+      {
+          MQAID_TIME_STAGE(this->stage_times_, Stage::Init);
+          mapping = std::make_unique<MappedFile>(this->file_);
+      }
+      if (!mapping->isOpen())
+          this->error_ = "couldn't open the file";
+
+      {
+          MQAID_TIME_STAGE(this->stage_times_, Stage::Metadata);
+          if (this->error_.empty())
+              this->error_ = parsePcmLayout(*mapping, this->layout_);
+          if (this->error_.empty() && (this->layout_.channels != 2 || this->layout_.container_bits < 16
+                                       || this->layout_.container_bits > 32 || this->layout_.valid_bits < 16))
+              this->error_ = "unsupported stream (only 16 to 32 bit stereo)";
+      }
+      if (!this->error_.empty())
+          return false;
+
+      MQAID_TIME_STAGE(this->stage_times_, Stage::Detect);
+      const auto &layout = this->layout_;
+      const uint64_t window = uint64_t(layout.sample_rate) * 3;    // read only 3 first seconds
+      // the stream info following a sync word at the end of the window is read too
+      const uint64_t frames = std::min<uint64_t>(layout.data_size / layout.block_align, window + 34);
+      const uint8_t *samples = frames ? mapping->map(layout.data_offset, frames * layout.block_align) : nullptr;
+      if (frames && !samples) {
+          this->error_ = "couldn't map the samples (was the file truncated?)";
+          return false;
+      }
+      const unsigned bytes = layout.container_bits / 8;
+      const bool big_endian = layout.big_endian;
+      const auto value = [bytes, big_endian](const uint8_t *sample) {
+          uint32_t v = 0;
+          for (unsigned b = 0; b < bytes; b++)
+              v |= uint32_t(sample[big_endian ? bytes - 1 - b : b]) << (8u * b);
+          return v;
+      };
+
+      // the valid bits are left-justified, so their 16th bit from the top is the container's as well
+      MQADetector detector(layout.container_bits, window);
+      uint64_t read = 0;
+      detector.addFrames(static_cast<size_t>(frames), [&](size_t i) {
+          const uint8_t *frame = samples + i * layout.block_align;
+          read = i + 1;
+          return value(frame) ^ value(frame + bytes);
+      });
+      detector.finish();
+
+      this->identified_ = true;
+      this->decoded_samples_ = read;
+      this->bytes_read_ = layout.data_offset + read * layout.block_align;
+      this->found_ = detector.stream();
+      return this->found_.isMQA;
+  }
+
+  /**
+   * @short Why the file couldn't be identified, empty if it was
+   */
+  [[nodiscard]] const std::string &error() const noexcept { return this->error_; }
+
+  /**
+   * @short Whether detect() got to a result, MQA or not
+   */
+  [[nodiscard]] bool identified() const noexcept { return this->identified_; }
+
+  /**
+   * @short Bytes of the file looked at: up to the end of the last frame searched
+   */
+  [[nodiscard]] uint64_t bytesRead() const noexcept { return this->bytes_read_; }
+
+  /**
+   * @short Number of frames searched
+   */
+  [[nodiscard]] uint64_t decodedSamples() const noexcept { return this->decoded_samples_; }
+
+  [[nodiscard]] uint32_t sampleRate() const noexcept { return this->layout_.sample_rate; }
+  [[nodiscard]] uint32_t bitsPerSample() const noexcept { return this->layout_.valid_bits; }
+  [[nodiscard]] bool isMQA() const noexcept { return this->found_.isMQA; }
+  [[nodiscard]] bool isMQAStudio() const noexcept { return this->found_.isMQAStudio; }
+  [[nodiscard]] uint32_t originalSampleRate() const noexcept { return this->found_.originalSampleRate; }
+
+#ifdef MQAID_STAGE_TIMING
+  [[nodiscard]] StageTimes &stageTimes() noexcept { return this->stage_times_; }
+#endif
+
+ private:
+  std::string file_;
+  PcmLayout layout_;
+  MQAStream found_;
+  std::string error_;
+  bool identified_ = false;
+  uint64_t bytes_read_ = 0;
+  uint64_t decoded_samples_ = 0;
+#ifdef MQAID_STAGE_TIMING
+  StageTimes stage_times_{};
+#endif
+};
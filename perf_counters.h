@@ -0,0 +1,251 @@
+/**
+ * @file        perf_counters.h
+ * @short       Hardware performance counters of the scan stages (Linux perf_event_open)
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#if defined(__linux__) && !defined(__ANDROID__)
+ #include <cstring>
+ #include <linux/perf_event.h>
+ #include <sys/syscall.h>
+ #include <unistd.h>
+#endif
+
+
+/**
+ * Hardware counter totals, per stage.
+ * Each thread counts its own user-space events in one perf_event group (cycles, instructions, branch misses,
+ * cache misses), opened on its first stage. A stage reads the group when it starts and ends and adds the
+ * difference, scaled when the kernel had to multiplex the counters. Only one instance is active at a time;
+ * while none is, a stage costs a single atomic load.
+ */
+class PerfCounters {
+ public:
+  enum Event : unsigned { Cycles, Instructions, BranchMisses, CacheMisses, kEvents };
+  static constexpr size_t kStages = 8;
+
+  using Values = std::array<uint64_t, kEvents>;
+
+  /**
+   * @short Active counters, nullptr when not counting
+   */
+  static PerfCounters *active() noexcept {
+      return current_().load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @short Start counting
+   * @return nullptr if the counters aren't supported or permitted (see perf_event_paranoid)
+   */
+  static std::unique_ptr<PerfCounters> start() {
+      std::unique_ptr<PerfCounters> counters(new PerfCounters);
+      // the calling thread's group tells whether counting is possible at all
+      if (!counters->group().open())
+          return nullptr;
+      counters->available_ = counters->group().available;
+      current_().store(counters.get());
+      return counters;
+  }
+
+  ~PerfCounters() {
+      PerfCounters *self = this;
+      current_().compare_exchange_strong(self, nullptr);
+  }
+
+  /**
+   * @short Read the calling thread's counters
+   * @return false if its group couldn't be opened
+   */
+  bool read(Values &values) {
+      return this->group().read(values);
+  }
+
+  /**
+   * @short Account the events of a stage
+   */
+  void add(size_t stage, const Values &events) {
+      if (stage >= kStages)
+          return;
+      for (unsigned e = 0; e < kEvents; e++)
+          this->totals_[stage][e].fetch_add(events[e], std::memory_order_relaxed);
+      this->calls_[stage].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] uint64_t total(size_t stage, Event event) const noexcept {
+      return this->totals_[stage][event].load(std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] uint64_t calls(size_t stage) const noexcept {
+      return this->calls_[stage].load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @short Whether the hardware counts an event (e.g. cache misses are often missing in VMs)
+   */
+  [[nodiscard]] bool available(Event event) const noexcept {
+      return this->available_[event];
+  }
+
+ private:
+  /**
+   * perf_event group of a thread
+   */
+  struct Group {
+      bool tried = false;
+      int leader = -1;
+      std::array<int, kEvents> fds{-1, -1, -1, -1};
+      std::array<bool, kEvents> available{};
+      std::array<int, kEvents> slot{};     // position of each event in the group's read buffer
+
+      Group() = default;
+      Group(const Group &) = delete;
+      Group &operator=(const Group &) = delete;
+
+      ~Group() {
+#if defined(__linux__) && !defined(__ANDROID__)
+          for (const int fd : this->fds)
+              if (fd >= 0) close(fd);
+#endif
+      }
+
+      bool open() {
+#if defined(__linux__) && !defined(__ANDROID__)
+          if (this->tried)
+              return this->leader >= 0;
+          this->tried = true;
+
+          static const uint64_t kConfig[kEvents] = {
+              PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+              PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES
+          };
+          int slots = 0;
+          for (unsigned e = 0; e < kEvents; e++) {
+              perf_event_attr attr;
+              std::memset(&attr, 0, sizeof attr);
+              attr.size = sizeof attr;
+              attr.type = PERF_TYPE_HARDWARE;
+              attr.config = kConfig[e];
+              attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                                 | PERF_FORMAT_TOTAL_TIME_RUNNING;
+              attr.exclude_kernel = 1;
+              attr.exclude_hv = 1;
+              // this thread only, on any cpu
+              const int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, this->leader, 0));
+              if (fd < 0)
+                  continue;   // unsupported event, the others are still counted
+              if (this->leader < 0)
+                  this->leader = fd;
+              this->fds[e] = fd;
+              this->available[e] = true;
+              this->slot[e] = slots++;
+          }
+          return this->leader >= 0;
+#else
+          this->tried = true;
+          return false;
+#endif
+      }
+
+      bool read(Values &values) {
+          values.fill(0);
+          if (!this->open())
+              return false;
+#if defined(__linux__) && !defined(__ANDROID__)
+          // nr, time enabled, time running, then the values in group order
+          uint64_t buffer[3 + kEvents];
+          if (::read(this->leader, buffer, sizeof buffer) < static_cast<ssize_t>(3 * sizeof(uint64_t)))
+              return false;
+          const uint64_t enabled = buffer[1], running = buffer[2];
+          for (unsigned e = 0; e < kEvents; e++) {
+              if (!this->available[e] || static_cast<uint64_t>(this->slot[e]) >= buffer[0])
+                  continue;
+              uint64_t value = buffer[3 + this->slot[e]];
+              // multiplexed: extrapolate to the whole time the group was enabled
+              if (running > 0 && running < enabled)
+                  value = static_cast<uint64_t>(static_cast<double>(value) * enabled / running);
+              values[e] = value;
+          }
+          return true;
+#else
+          return false;
+#endif
+      }
+  };
+
+  std::array<std::array<std::atomic<uint64_t>, kEvents>, kStages> totals_{};
+  std::array<std::atomic<uint64_t>, kStages> calls_{};
+  std::array<bool, kEvents> available_{};
+
+
+  PerfCounters() = default;
+
+  static std::atomic<PerfCounters *> &current_() {
+      static std::atomic<PerfCounters *> current{nullptr};
+      return current;
+  }
+
+  /**
+   * @short Group of the calling thread, opened on first use
+   */
+  static Group &group() {
+      thread_local Group group;
+      return group;
+  }
+};
+
+
+/**
+ * Adds the hardware events of its scope to a stage of the active counters.
+ * Scopes nest: the events of an inner scope (detection within decoding) are taken out of the outer one.
+ */
+class PerfScope {
+ public:
+  explicit PerfScope(size_t stage) : counters_(PerfCounters::active()), stage_(stage) {
+      if (this->counters_ && !this->counters_->read(this->begin_))
+          this->counters_ = nullptr;
+      if (this->counters_) {
+          this->outer_ = innermost();
+          innermost() = this;
+      }
+  }
+
+  ~PerfScope() {
+      if (!this->counters_)
+          return;
+      innermost() = this->outer_;
+      PerfCounters::Values end, events;
+      if (!this->counters_->read(end))
+          return;
+      for (unsigned e = 0; e < PerfCounters::kEvents; e++) {
+          // scaled values of a multiplexed group aren't always monotonic
+          const uint64_t all = end[e] > this->begin_[e] ? end[e] - this->begin_[e] : 0;
+          events[e] = all - std::min(all, this->nested_[e]);
+          if (this->outer_)
+              this->outer_->nested_[e] += all;
+      }
+      this->counters_->add(this->stage_, events);
+  }
+
+  PerfScope(const PerfScope &) = delete;
+  PerfScope &operator=(const PerfScope &) = delete;
+
+ private:
+  PerfCounters *counters_;
+  size_t stage_;
+  PerfCounters::Values begin_;
+  PerfCounters::Values nested_{};     // events of the inner scopes
+  PerfScope *outer_ = nullptr;
+
+  static PerfScope *&innermost() {
+      thread_local PerfScope *scope = nullptr;
+      return scope;
+  }
+};
@@ -0,0 +1,218 @@
+/**
+ * @file        progress.h
+ * @short       Live progress line of a scan, with throughput and ETA
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+ #include <io.h>
+#else
+ #include <unistd.h>
+#endif
+
+
+/**
+ * Counters of a running scan, as seen by the progress line
+ */
+struct ProgressSample {
+    size_t found = 0;           // files discovered so far
+    bool discovering = false;   // more files may still be found
+    size_t done = 0;            // files finished
+    size_t mqa = 0;
+    uint64_t bytes_read = 0;
+    uint64_t samples = 0;       // decoded samples (per channel)
+};
+
+
+/**
+ * Progress line.
+ * A background thread samples the scan counters and draws the line on stderr, so the scan itself only keeps
+ * its counters up to date. On a terminal the line is redrawn in place a few times per second; otherwise a
+ * line is printed every few seconds. Rates are smoothed over the last seconds. The ETA divides the files
+ * left by the scan rate; while files are still being discovered, by how fast the scan catches up with the
+ * discovery.
+ */
+class LiveProgress {
+ public:
+  using Sample = std::function<ProgressSample()>;
+
+  /**
+   * @param sample reads the counters of the scan
+   * @param output_mutex lock held while anything else is printed to the terminal
+   */
+  LiveProgress(Sample sample, std::mutex &output_mutex)
+      : sample_(std::move(sample)), output_mutex_(output_mutex), tty_(isTerminal()),
+        interval_(tty_ ? std::chrono::milliseconds(250) : std::chrono::milliseconds(10000)) {
+      this->started_ = this->last_ = Clock::now();
+      this->worker_ = std::thread([this] {
+          std::unique_lock<std::mutex> lock(this->mutex_);
+          while (!this->wake_.wait_for(lock, this->interval_, [this] { return this->stop_; }))
+              this->update(false);
+      });
+  }
+
+  ~LiveProgress() {
+      this->finish();
+  }
+
+  /**
+   * @short Clear the progress line so other output can be printed (call with the output mutex held)
+   */
+  void erase() {
+      if (!this->tty_ || this->drawn_ == 0)
+          return;
+      std::fprintf(stderr, "\r%*s\r", static_cast<int>(this->drawn_), "");
+      std::fflush(stderr);
+      this->drawn_ = 0;
+  }
+
+  /**
+   * @short Stop the updates and leave the final line on screen
+   */
+  void finish() {
+      {
+          std::lock_guard<std::mutex> lock(this->mutex_);
+          if (this->stop_)
+              return;
+          this->stop_ = true;
+      }
+      this->wake_.notify_one();
+      this->worker_.join();
+      this->update(true);
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  static constexpr double kSmoothing = 5.0;     // time constant of the rates, in seconds
+
+  Sample sample_;
+  std::mutex &output_mutex_;
+  const bool tty_;
+  const Clock::duration interval_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_ = false;
+  std::thread worker_;
+
+  Clock::time_point started_;
+  Clock::time_point last_;
+  ProgressSample previous_;
+  bool smoothed_ = false;
+  double files_rate_ = 0;
+  double found_rate_ = 0;
+  double bytes_rate_ = 0;
+  double samples_rate_ = 0;
+  size_t drawn_ = 0;          // length of the line on screen
+
+
+  static bool isTerminal() {
+#ifdef _WIN32
+      return _isatty(_fileno(stderr)) != 0;
+#else
+      return isatty(fileno(stderr)) != 0;
+#endif
+  }
+
+  void update(bool final) {
+      const auto now = Clock::now();
+      const auto current = this->sample_();
+      const double dt = std::chrono::duration<double>(now - this->last_).count();
+
+      if (dt > 0) {
+          // exponential moving average, the first interval sets the rates
+          const double alpha = this->smoothed_ ? 1 - std::exp(-dt / kSmoothing) : 1;
+          const auto smooth = [&](double &rate, double delta) { rate += alpha * (delta / dt - rate); };
+          smooth(this->files_rate_, static_cast<double>(current.done - this->previous_.done));
+          smooth(this->found_rate_, static_cast<double>(current.found - this->previous_.found));
+          smooth(this->bytes_rate_, static_cast<double>(current.bytes_read - this->previous_.bytes_read));
+          smooth(this->samples_rate_, static_cast<double>(current.samples - this->previous_.samples));
+          this->smoothed_ = true;
+      }
+      this->previous_ = current;
+      this->last_ = now;
+
+      // the final line shows the averages of the whole run
+      double files_rate = this->files_rate_, bytes_rate = this->bytes_rate_, samples_rate = this->samples_rate_;
+      if (final) {
+          const double elapsed = std::chrono::duration<double>(now - this->started_).count();
+          files_rate = elapsed > 0 ? current.done / elapsed : 0;
+          bytes_rate = elapsed > 0 ? current.bytes_read / elapsed : 0;
+          samples_rate = elapsed > 0 ? current.samples / elapsed : 0;
+      }
+
+      const size_t found = std::max(current.found, current.done);
+      char count[64];
+      if (current.discovering)
+          std::snprintf(count, sizeof count, "%zu/%zu+", current.done, found);
+      else
+          std::snprintf(count, sizeof count, "%zu/%zu %3.0f%%", current.done, found,
+                        found ? 100.0 * current.done / found : 100.0);
+
+      const std::string time = final
+          ? "in " + duration(std::chrono::duration<double>(now - this->started_).count())
+          : "ETA " + this->eta(current, found);
+      char line[256];
+      int length = std::snprintf(line, sizeof line, "[%s] %.1f files/s  %.1f MB/s  %s samples/s  MQA %.1f%%  %s",
+                                 count, files_rate, bytes_rate / 1e6, si(samples_rate).c_str(),
+                                 current.done ? 100.0 * current.mqa / current.done : 0.0, time.c_str());
+      length = std::min(length, static_cast<int>(sizeof line) - 1);
+
+      std::lock_guard<std::mutex> lock(this->output_mutex_);
+      if (this->tty_) {
+          // pad over what's left of the previous line
+          const int pad = std::max(0, static_cast<int>(this->drawn_) - length);
+          std::fprintf(stderr, "\r%s%*s%s", line, pad, "", final ? "\n" : "");
+          this->drawn_ = final ? 0 : static_cast<size_t>(length);
+      } else
+          std::fprintf(stderr, "%s\n", line);
+      std::fflush(stderr);
+  }
+
+  [[nodiscard]] std::string eta(const ProgressSample &current, size_t found) const {
+      const double left = static_cast<double>(found - current.done);
+      // while discovering, the files left shrink at the scan rate minus the discovery rate
+      const double rate = current.discovering ? this->files_rate_ - this->found_rate_ : this->files_rate_;
+      if (left == 0 && !current.discovering)
+          return "0s";
+      if (rate <= 0)
+          return "?";
+      return (current.discovering ? "~" : "") + duration(left / rate);
+  }
+
+  static std::string duration(double seconds) {
+      const auto s = static_cast<unsigned long long>(seconds + 0.5);
+      char text[32];
+      if (s < 60)
+          std::snprintf(text, sizeof text, "%llus", s);
+      else if (s < 3600)
+          std::snprintf(text, sizeof text, "%llum%02llus", s / 60, s % 60);
+      else
+          std::snprintf(text, sizeof text, "%lluh%02llum", s / 3600, s / 60 % 60);
+      return text;
+  }
+
+  static std::string si(double value) {
+      char text[32];
+      if (value < 1e3)
+          std::snprintf(text, sizeof text, "%.0f", value);
+      else if (value < 1e6)
+          std::snprintf(text, sizeof text, "%.1fk", value / 1e3);
+      else if (value < 1e9)
+          std::snprintf(text, sizeof text, "%.1fM", value / 1e6);
+      else
+          std::snprintf(text, sizeof text, "%.1fG", value / 1e9);
+      return text;
+  }
+};
@@ -0,0 +1,272 @@
+/**
+ * @file        record_writer.h
+ * @short       Machine readable result records (JSON Lines, CSV, TSV)
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "io_stats.h"
+#include "result_cache.h"
+
+
+/**
+ * @short Length of the well-formed UTF-8 sequence starting s[i], 0 if it isn't one (RFC 3629: no overlong
+ *        forms, surrogates or code points past U+10FFFF)
+ */
+inline size_t utf8SequenceLength(std::string_view s, size_t i) {
+    const auto byte = [&s](size_t at) { return static_cast<unsigned char>(s[at]); };
+    const unsigned char lead = byte(i);
+    size_t length;
+    unsigned char low = 0x80, high = 0xbf;      // range of the second byte
+    if (lead < 0x80) return 1;
+    else if (lead >= 0xc2 && lead <= 0xdf) length = 2;
+    else if (lead >= 0xe0 && lead <= 0xef) {
+        length = 3;
+        if (lead == 0xe0) low = 0xa0;
+        else if (lead == 0xed) high = 0x9f;
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        length = 4;
+        if (lead == 0xf0) low = 0x90;
+        else if (lead == 0xf4) high = 0x8f;
+    } else
+        return 0;
+
+    if (i + length > s.size() || byte(i + 1) < low || byte(i + 1) > high)
+        return 0;
+    for (size_t k = 2; k < length; k++)
+        if ((byte(i + k) & 0xc0u) != 0x80u)
+            return 0;
+    return length;
+}
+
+
+/**
+ * @short Append a string as a quoted JSON string
+ * Bytes that aren't valid UTF-8 (file names on Linux are any bytes) become U+FFFD, so the output stays valid JSON.
+ */
+inline void appendJSONString(std::string &out, std::string_view s) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (size_t i = 0; i < s.size();) {
+        const char c = s[i];
+        if (static_cast<unsigned char>(c) >= 0x80) {
+            const auto length = utf8SequenceLength(s, i);
+            if (length)
+                out.append(s.data() + i, length);
+            else
+                out += "\\ufffd";
+            i += length ? length : 1;
+            continue;
+        }
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    out += "\\u00";
+                    out += hex[(c >> 4) & 15];
+                    out += hex[c & 15];
+                } else
+                    out += c;
+        }
+        i++;
+    }
+    out += '"';
+}
+
+
+/**
+ * Result record of a scanned file
+ */
+struct ScanRecord {
+    std::string path;
+    ScanStatus status = ScanStatus::NotMQA;
+    bool isMQAStudio = false;
+    uint32_t originalSampleRate = 0;
+    std::string encoder;
+    std::string error;
+    uint64_t bytes_read = 0;    // bytes read from the file (0 when the result was known)
+    double decode_ms = 0;       // time spent decoding and detecting
+    IoStats io;                 // written with the I/O columns only
+};
+
+
+/**
+ * Record writer.
+ * Records are formatted into a buffer that goes out once it's large enough or at most a few hundred
+ * milliseconds after the oldest record in it was written (a background thread takes care of the buffer when
+ * no more records come), so a file's record follows it closely without a write per file.
+ */
+class RecordWriter {
+ public:
+  enum class Format { JSONL, CSV, TSV };
+
+  /**
+   * @short Parse a --format value
+   * @return false if the name is unknown
+   */
+  static bool parseFormat(const std::string &name, Format &format) {
+      if (name == "jsonl") format = Format::JSONL;
+      else if (name == "csv") format = Format::CSV;
+      else if (name == "tsv") format = Format::TSV;
+      else return false;
+      return true;
+  }
+
+  /**
+   * @param io_columns add the I/O accounting of each file (see IoStats)
+   */
+  RecordWriter(Format format, std::FILE *out, bool io_columns = false)
+      : format_(format), out_(out), io_columns_(io_columns) {
+      this->buffer_.reserve(kBufferSize + 4096);
+      if (format == Format::CSV)
+          this->buffer_ += io_columns
+              ? "path,status,studio,original_rate,encoder,error,bytes_read,decode_ms,"
+                "bytes_requested,bytes_os,bytes_storage,bytes_metadata,bytes_needed\n"
+              : "path,status,studio,original_rate,encoder,error,bytes_read,decode_ms\n";
+      else if (format == Format::TSV)
+          this->buffer_ += io_columns
+              ? "path\tstatus\tstudio\toriginal_rate\tencoder\terror\tbytes_read\tdecode_ms\t"
+                "bytes_requested\tbytes_os\tbytes_storage\tbytes_metadata\tbytes_needed\n"
+              : "path\tstatus\tstudio\toriginal_rate\tencoder\terror\tbytes_read\tdecode_ms\n";
+      this->oldest_ = std::chrono::steady_clock::now();
+      this->flusher_ = std::thread(&RecordWriter::flushLate, this);
+  }
+
+  ~RecordWriter() {
+      {
+          std::lock_guard<std::mutex> lock(this->mutex_);
+          this->stop_ = true;
+      }
+      this->wake_.notify_one();
+      this->flusher_.join();
+      this->flush();
+  }
+
+  void write(const ScanRecord &r) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      if (this->buffer_.empty())
+          this->oldest_ = std::chrono::steady_clock::now();
+
+      char decode_ms[32];
+      std::snprintf(decode_ms, sizeof decode_ms, "%.3f", r.decode_ms);
+      const char *status = r.status == ScanStatus::MQA ? "MQA" : r.status == ScanStatus::NotMQA ? "NOT MQA" : "ERROR";
+
+      if (this->format_ == Format::JSONL) {
+          this->buffer_ += "{\"path\":";
+          appendJSONString(this->buffer_, r.path);
+          this->buffer_ += ",\"status\":\"";
+          this->buffer_ += status;
+          this->buffer_ += r.isMQAStudio ? "\",\"studio\":true" : "\",\"studio\":false";
+          this->buffer_ += ",\"original_rate\":" + std::to_string(r.originalSampleRate) + ",\"encoder\":";
+          appendJSONString(this->buffer_, r.encoder);
+          this->buffer_ += ",\"error\":";
+          appendJSONString(this->buffer_, r.error);
+          this->buffer_ += ",\"bytes_read\":" + std::to_string(r.bytes_read) + ",\"decode_ms\":" + decode_ms;
+          if (this->io_columns_)
+              this->buffer_ += ",\"bytes_requested\":" + std::to_string(r.io.requested)
+                               + ",\"bytes_os\":" + std::to_string(r.io.os_read)
+                               + ",\"bytes_storage\":" + std::to_string(r.io.storage)
+                               + ",\"bytes_metadata\":" + std::to_string(r.io.metadata)
+                               + ",\"bytes_needed\":" + std::to_string(r.io.needed);
+          this->buffer_ += "}\n";
+      } else {
+          const char sep = this->format_ == Format::CSV ? ',' : '\t';
+          this->field(r.path);
+          this->buffer_ += sep;
+          this->buffer_ += status;
+          this->buffer_ += sep;
+          this->buffer_ += r.isMQAStudio ? '1' : '0';
+          this->buffer_ += sep + std::to_string(r.originalSampleRate) + sep;
+          this->field(r.encoder);
+          this->buffer_ += sep;
+          this->field(r.error);
+          this->buffer_ += sep + std::to_string(r.bytes_read) + sep + decode_ms;
+          if (this->io_columns_)
+              this->buffer_ += sep + std::to_string(r.io.requested) + sep + std::to_string(r.io.os_read)
+                               + sep + std::to_string(r.io.storage) + sep + std::to_string(r.io.metadata)
+                               + sep + std::to_string(r.io.needed);
+          this->buffer_ += '\n';
+      }
+
+      if (this->buffer_.size() >= kBufferSize || std::chrono::steady_clock::now() - this->oldest_ >= kMaxDelay)
+          this->writeOut();
+  }
+
+  void flush() {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      this->writeOut();
+  }
+
+ private:
+  static constexpr size_t kBufferSize = 64 * 1024;
+  static constexpr std::chrono::milliseconds kMaxDelay{250};
+
+  Format format_;
+  std::FILE *out_;
+  bool io_columns_;
+  std::string buffer_;
+  std::chrono::steady_clock::time_point oldest_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_ = false;
+  std::thread flusher_;
+
+
+  void writeOut() {
+      if (!this->buffer_.empty())
+          std::fwrite(this->buffer_.data(), 1, this->buffer_.size(), this->out_);
+      std::fflush(this->out_);
+      this->buffer_.clear();
+  }
+
+  void flushLate() {
+      std::unique_lock<std::mutex> lock(this->mutex_);
+      while (!this->stop_) {
+          this->wake_.wait_for(lock, kMaxDelay);
+          if (!this->buffer_.empty() && std::chrono::steady_clock::now() - this->oldest_ >= kMaxDelay)
+              this->writeOut();
+      }
+  }
+
+
+  void field(const std::string &s) {
+      if (this->format_ == Format::TSV) {
+          // same escaping as the cache files
+          for (const char c : s) {
+              switch (c) {
+                  case '\\': this->buffer_ += "\\\\"; break;
+                  case '\t': this->buffer_ += "\\t"; break;
+                  case '\n': this->buffer_ += "\\n"; break;
+                  case '\r': this->buffer_ += "\\r"; break;
+                  default: this->buffer_ += c;
+              }
+          }
+          return;
+      }
+
+      // CSV (RFC 4180): fields with separators, quotes or line breaks are quoted, quotes doubled
+      if (s.find_first_of(",\"\r\n") == std::string::npos) {
+          this->buffer_ += s;
+          return;
+      }
+      this->buffer_ += '"';
+      for (const char c : s) {
+          if (c == '"') this->buffer_ += '"';
+          this->buffer_ += c;
+      }
+      this->buffer_ += '"';
+  }
+};
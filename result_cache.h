@@ -0,0 +1,401 @@
+/**
+ * @file        result_cache.h
+ * @short       Persistent cache of detection results
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+
+/**
+ * Identity of a file on disk, a cached result is only valid while all fields match
+ */
+struct FileStamp {
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+
+    bool operator==(const FileStamp &o) const noexcept {
+        return device == o.device && inode == o.inode && size == o.size && mtime_ns == o.mtime_ns;
+    }
+    bool operator!=(const FileStamp &o) const noexcept { return !(*this == o); }
+};
+
+
+/**
+ * @short Read the stamp of a file without opening it
+ * @return false if the file can't be stat'ed
+ */
+inline bool statFile(const std::string &path, FileStamp &stamp) {
+#ifdef _WIN32
+    struct _stat64 st{};
+    if (_stat64(path.c_str(), &st) != 0) return false;
+    stamp.device = st.st_dev;
+    stamp.inode = std::hash<std::string>{}(path); // no inode numbers on windows
+    stamp.mtime_ns = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#else
+    struct stat st{};
+    if (stat(path.c_str(), &st) != 0) return false;
+    stamp.device = st.st_dev;
+    stamp.inode = st.st_ino;
+ #ifdef __APPLE__
+    stamp.mtime_ns = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+ #else
+    stamp.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+ #endif
+#endif
+    stamp.size = st.st_size;
+    return true;
+}
+
+
+/**
+ * @short Write a string as a single field of a tab separated line
+ */
+inline void escapeField(std::ostream &out, const std::string &s) {
+    for (const char c : s) {
+        switch (c) {
+            case '\\': out << "\\\\"; break;
+            case '\t': out << "\\t"; break;
+            case '\n': out << "\\n"; break;
+            case '\r': out << "\\r"; break;
+            default: out << c;
+        }
+    }
+}
+
+
+/**
+ * @short Inverse of escapeField()
+ */
+inline std::string unescapeField(const std::string &s) {
+    std::string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] != '\\' || i + 1 == s.size()) {
+            out.push_back(s[i]);
+            continue;
+        }
+        switch (s[++i]) {
+            case 't': out.push_back('\t'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            default: out.push_back(s[i]);
+        }
+    }
+    return out;
+}
+
+
+enum class ScanStatus {
+    Error,      // the file couldn't be identified, see error
+    NotMQA,
+    MQA
+};
+
+
+/**
+ * Detection result of a single file
+ */
+struct FileResult {
+    ScanStatus status = ScanStatus::NotMQA;     // Error results are never stored, the file is tried again
+    bool isMQAStudio = false;
+    uint32_t originalSampleRate = 0;
+    std::string mqaEncoder;
+    bool tagged = false;    // MQA tags were found or written by --add-mqaencoder
+    std::array<uint8_t, 16> audioMD5{};     // STREAMINFO MD5 of the decoded audio, zero if unset
+
+    [[nodiscard]] bool isMQA() const noexcept { return this->status == ScanStatus::MQA; }
+};
+
+
+/**
+ * @short Key of the audio content of a file, empty if the encoder didn't store an MD5 signature
+ */
+inline std::string contentKey(const std::array<uint8_t, 16> &md5) {
+    for (const auto b : md5)
+        if (b != 0)
+            return {md5.begin(), md5.end()};
+    return {};
+}
+
+
+/**
+ * On-disk result cache.
+ * The cache is an append-only text log, one record per scanned file, keyed by path and validated with the
+ * file's stamp (device, inode, size, mtime). Later records override earlier ones; once superseded records
+ * outweigh live ones the log is compacted, on close or, after a run that was killed, when it is opened again.
+ * Records are flushed every few hundred files or seconds, so a killed run loses at most that much.
+ * Results are also indexed by audio MD5, so identical audio content under another name can reuse them.
+ */
+class ResultCache {
+ public:
+  explicit ResultCache(std::string file) : file_(std::move(file)) {
+      const bool valid = this->load();
+      // only an empty file or a cache is ever overwritten, anything else is left alone
+      if (!valid && !this->replaceable()) {
+          this->refused_ = this->failed_ = true;
+          return;
+      }
+      // a run killed before closing the cache left it uncompacted
+      if (valid && this->oversized() && this->compact()) {
+          this->records_ = this->entries_.size() + 1;
+          this->torn_ = false;
+      }
+      this->log_.open(this->file_, std::ios::binary | (valid ? std::ios::app : std::ios::trunc));
+      if (!valid)
+          this->log_ << kHeader << "\n";
+      else if (this->torn_)
+          this->log_ << "\n";
+      this->failed_ = !this->log_;
+      this->last_flush_ = std::chrono::steady_clock::now();
+  }
+
+  ~ResultCache() {
+      this->log_.close();
+      if (this->oversized())
+          (void) this->compact();
+  }
+
+  /**
+   * @short Look up the result of a file
+   * @return true if there is a record for path and its stamp still matches
+   */
+  bool lookup(const std::string &path, const FileStamp &stamp, FileResult &result) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+
+      const auto it = this->entries_.find(path);
+      if (it == this->entries_.end() || it->second.stamp != stamp) {
+          this->misses_++;
+          return false;
+      }
+      result = it->second.result;
+      this->hits_++;
+      return true;
+  }
+
+  /**
+   * @short Record the result of a freshly scanned file
+   */
+  void store(const std::string &path, const FileStamp &stamp, const FileResult &result) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+
+      auto &entry = this->entries_[path];
+      entry.stamp = stamp;
+      entry.result = result;
+      this->index(entry.result);
+      writeRecord(this->log_, path, entry);
+      this->records_++;
+
+      const auto now = std::chrono::steady_clock::now();
+      if (++this->unflushed_ >= kFlushRecords || now - this->last_flush_ >= kFlushInterval) {
+          this->log_.flush();
+          this->unflushed_ = 0;
+          this->last_flush_ = now;
+      }
+      if (!this->log_)
+          this->failed_ = true;
+  }
+
+  /**
+   * @short Whether the cache file couldn't be opened or written (results of this run may be missing from it)
+   */
+  [[nodiscard]] bool failed() const noexcept { return this->failed_; }
+
+  /**
+   * @short Whether the file exists but isn't a result cache, so it was left as it was and nothing is cached
+   */
+  [[nodiscard]] bool refused() const noexcept { return this->refused_; }
+
+  /**
+   * @short Look up the result of a file known to be unchanged, without checking its stamp
+   */
+  bool lookup(const std::string &path, FileResult &result) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+
+      const auto it = this->entries_.find(path);
+      if (it == this->entries_.end()) {
+          this->misses_++;
+          return false;
+      }
+      result = it->second.result;
+      this->hits_++;
+      return true;
+  }
+
+  /**
+   * @short Look up a result by audio content
+   * @param key content key of the file (see contentKey())
+   * @return true if a file with identical audio was scanned before
+   */
+  bool lookupContent(const std::string &key, FileResult &result) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+
+      const auto it = this->content_.find(key);
+      if (key.empty() || it == this->content_.end())
+          return false;
+      result = it->second;
+      return true;
+  }
+
+  [[nodiscard]] size_t hits() const noexcept { return this->hits_; }
+  [[nodiscard]] size_t misses() const noexcept { return this->misses_; }
+
+ private:
+  static constexpr const char *kHeader = "MQAID-CACHE 2";
+  static constexpr const char *kHeaderPrefix = "MQAID-CACHE ";     // any version, others are started over
+  static constexpr size_t kMinCompactRecords = 4096;
+  static constexpr size_t kFlushRecords = 256;
+  static constexpr std::chrono::seconds kFlushInterval{2};
+
+  struct Entry {
+      FileStamp stamp;
+      FileResult result;
+  };
+
+  std::string file_;
+  std::ofstream log_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::unordered_map<std::string, FileResult> content_;
+  size_t records_ = 0;
+  bool torn_ = false;
+  bool failed_ = false;
+  bool refused_ = false;
+  size_t unflushed_ = 0;
+  std::chrono::steady_clock::time_point last_flush_;
+  std::atomic<size_t> hits_{0};      // read while scanning (SIGUSR1 status)
+  std::atomic<size_t> misses_{0};
+  std::mutex mutex_;
+
+
+  [[nodiscard]] bool oversized() const noexcept {
+      return this->records_ > kMinCompactRecords && this->records_ > 2 * this->entries_.size();
+  }
+
+  void index(const FileResult &result) {
+      const auto key = contentKey(result.audioMD5);
+      if (!key.empty() && result.status != ScanStatus::Error)
+          this->content_[key] = result;
+  }
+
+  static void writeRecord(std::ostream &out, const std::string &path, const Entry &e) {
+      out << e.stamp.device << '\t' << e.stamp.inode << '\t' << e.stamp.size << '\t' << e.stamp.mtime_ns << '\t'
+          << e.result.isMQA() << '\t' << e.result.isMQAStudio << '\t' << e.result.originalSampleRate << '\t'
+          << e.result.tagged << '\t';
+      static const char hex[] = "0123456789abcdef";
+      for (const auto b : e.result.audioMD5)
+          out << hex[b >> 4u] << hex[b & 15u];
+      out << '\t';
+      escapeField(out, e.result.mqaEncoder);
+      out << '\t';
+      escapeField(out, path);
+      out << '\n';
+  }
+
+  static bool parseRecord(const std::string &line, std::string &path, Entry &e) {
+      // 8 numeric fields followed by md5, encoder and path
+      size_t fields[11];
+      size_t n = 0, start = 0;
+      for (size_t i = 0; i <= line.size() && n < 11; i++) {
+          if (i == line.size() || line[i] == '\t') {
+              fields[n++] = start;
+              start = i + 1;
+          }
+      }
+      if (n != 11 || fields[9] - fields[8] != 33) return false;
+
+      unsigned long long v[8];
+      for (int i = 0; i < 8; i++) {
+          char *end = nullptr;
+          v[i] = std::strtoull(line.c_str() + fields[i], &end, 10);
+          if (end == line.c_str() + fields[i] || *end != '\t') return false;
+      }
+      e.stamp = FileStamp{v[0], v[1], v[2], static_cast<int64_t>(v[3])};
+      e.result.status = v[4] != 0 ? ScanStatus::MQA : ScanStatus::NotMQA;
+      e.result.isMQAStudio = v[5] != 0;
+      e.result.originalSampleRate = static_cast<uint32_t>(v[6]);
+      e.result.tagged = v[7] != 0;
+      const auto nibble = [](char c) -> int {
+          if (c >= '0' && c <= '9') return c - '0';
+          if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+          return -1;
+      };
+      for (size_t i = 0; i < 16; i++) {
+          const int hi = nibble(line[fields[8] + 2 * i]), lo = nibble(line[fields[8] + 2 * i + 1]);
+          if (hi < 0 || lo < 0) return false;
+          e.result.audioMD5[i] = static_cast<uint8_t>(hi << 4 | lo);
+      }
+      e.result.mqaEncoder = unescapeField(line.substr(fields[9], fields[10] - fields[9] - 1));
+      path = unescapeField(line.substr(fields[10]));
+      return true;
+  }
+
+  bool load() {
+      std::ifstream in(this->file_, std::ios::binary);
+      std::string line;
+      if (!in || !std::getline(in, line) || line != kHeader)
+          return false;
+
+      this->records_ = 1;
+      std::string path;
+      Entry entry;
+      while (std::getline(in, line)) {
+          // a torn last record (interrupted run) is left out
+          if (in.eof()) {
+              this->torn_ = !line.empty();
+              break;
+          }
+          this->records_++;
+          if (parseRecord(line, path, entry)) {
+              this->index(entry.result);
+              this->entries_[path] = entry;
+          }
+      }
+      return true;
+  }
+
+  /**
+   * @short Whether the file can be started over: missing, empty, or a cache of any version
+   */
+  [[nodiscard]] bool replaceable() const {
+      std::ifstream in(this->file_, std::ios::binary);
+      std::string line;
+      return !in || !std::getline(in, line) || line.rfind(kHeaderPrefix, 0) == 0;
+  }
+
+  /**
+   * @return false if the log was left as it was
+   */
+  bool compact() {
+      const auto tmp = this->file_ + ".tmp";
+      {
+          std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+          out << kHeader << "\n";
+          for (const auto &[path, entry] : this->entries_)
+              writeRecord(out, path, entry);
+          out.close();
+          if (!out) {
+              std::remove(tmp.c_str());
+              return false;
+          }
+      }
+#ifdef _WIN32
+      std::remove(this->file_.c_str());
+#endif
+      return std::rename(tmp.c_str(), this->file_.c_str()) == 0;
+  }
+};
@@ -0,0 +1,162 @@
+/**
+ * @file        scan_state.h
+ * @short       Directory listings kept between runs to skip unchanged subtrees
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "result_cache.h"
+
+
+/**
+ * Scan state.
+ * For every walked directory the state keeps its mtime and the names of the files to identify and
+ * sub-directories found in it. A directory whose mtime didn't change since then still has the same entries, so
+ * the next walk reuses the recorded names instead of listing it (sub-directories are still checked one by one,
+ * as changes below them don't touch the parent's mtime). The mtime is the only check: counting the entries
+ * would take the listing it saves.
+ * Note that files edited in place don't change their directory's mtime; their results are carried forward.
+ */
+class ScanState {
+ public:
+  struct Directory {
+      int64_t mtime_ns = 0;
+      std::vector<std::string> files;
+      std::vector<std::string> subdirs;
+  };
+
+  explicit ScanState(std::string file) : file_(std::move(file)) {
+      this->started_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+      this->load();
+  }
+
+  /**
+   * @short Recorded listing of a directory, if it didn't change since
+   * @param path path of the directory
+   * @param mtime_ns current mtime of the directory
+   * @return the listing or nullptr if the directory has to be listed again
+   */
+  const Directory *unchanged(const std::string &path, int64_t mtime_ns) {
+      const auto it = this->previous_.find(path);
+      if (it == this->previous_.end() || it->second.mtime_ns != mtime_ns)
+          return nullptr;
+
+      this->skipped_++;
+      return &(this->current_[path] = std::move(it->second));
+  }
+
+  /**
+   * @short Record a fresh listing of a directory
+   */
+  void record(const std::string &path, Directory dir) {
+      // A directory modified within the timestamp granularity of this scan could change again without
+      // its mtime moving, so it is listed again next time
+      if (dir.mtime_ns >= this->started_ns_ - kRacyWindow_ns)
+          dir.mtime_ns = kNeverMatches;
+
+      this->listed_++;
+      this->current_[path] = std::move(dir);
+  }
+
+  /**
+   * @short Mark a path given to this run; recorded directories below it that weren't seen are dropped
+   */
+  void addRoot(const std::string &path) {
+      this->roots_.push_back(path);
+  }
+
+  /**
+   * @short Write the state of this run (directories outside its roots are kept)
+   */
+  bool save() {
+      for (auto &[path, dir] : this->previous_) {
+          bool underRoot = false;
+          for (const auto &root : this->roots_)
+              underRoot |= path.compare(0, root.size(), root) == 0
+                           && (path.size() == root.size() || root.back() == '/' || root.back() == '\\'
+                               || path[root.size()] == '/' || path[root.size()] == '\\');
+          if (!underRoot)
+              this->current_.emplace(path, std::move(dir));
+      }
+
+      const auto tmp = this->file_ + ".tmp";
+      {
+          std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+          out << kHeader << "\n" << this->started_ns_ << "\n";
+          for (const auto &[path, dir] : this->current_) {
+              out << "D\t" << dir.mtime_ns << '\t';
+              escapeField(out, path);
+              out << '\n';
+              for (const auto &name : dir.files) {
+                  out << "F\t";
+                  escapeField(out, name);
+                  out << '\n';
+              }
+              for (const auto &name : dir.subdirs) {
+                  out << "S\t";
+                  escapeField(out, name);
+                  out << '\n';
+              }
+          }
+          if (!out) return false;
+      }
+#ifdef _WIN32
+      std::remove(this->file_.c_str());
+#endif
+      return std::rename(tmp.c_str(), this->file_.c_str()) == 0;
+  }
+
+  [[nodiscard]] size_t skipped() const noexcept { return this->skipped_; }
+  [[nodiscard]] size_t listed() const noexcept { return this->listed_; }
+
+ private:
+  static constexpr const char *kHeader = "MQAID-SCANSTATE 3";
+  static constexpr int64_t kRacyWindow_ns = 2000000000;
+  static constexpr int64_t kNeverMatches = INT64_MIN;
+
+  std::string file_;
+  int64_t started_ns_ = 0;
+  std::unordered_map<std::string, Directory> previous_;
+  std::unordered_map<std::string, Directory> current_;
+  std::vector<std::string> roots_;
+  size_t skipped_ = 0;
+  size_t listed_ = 0;
+
+
+  void load() {
+      std::ifstream in(this->file_, std::ios::binary);
+      std::string line;
+      if (!in || !std::getline(in, line) || line != kHeader || !std::getline(in, line))
+          return;
+
+      Directory *dir = nullptr;
+      while (std::getline(in, line)) {
+          if (line.size() < 2 || line[1] != '\t')
+              continue;
+
+          if (line[0] == 'D') {
+              char *end = nullptr;
+              const auto mtime = std::strtoll(line.c_str() + 2, &end, 10);
+              if (*end != '\t') {
+                  dir = nullptr;
+                  continue;
+              }
+              dir = &this->previous_[unescapeField(end + 1)];
+              dir->mtime_ns = mtime;
+          } else if (dir && line[0] == 'F')
+              dir->files.push_back(unescapeField(line.substr(2)));
+          else if (dir && line[0] == 'S')
+              dir->subdirs.push_back(unescapeField(line.substr(2)));
+      }
+  }
+};
@@ -0,0 +1,325 @@
+/**
+ * @file        stage_timer.h
+ * @short       Optional timing of the decoding stages, with latency histograms
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+
+#include "perf_counters.h"
+#include "status.h"
+#include "trace.h"
+
+/**
+ * Stages of a file's scan
+ */
+enum class Stage : unsigned {
+    Init,           // opening the file and initializing the decoder
+    Metadata,       // process_until_end_of_metadata()
+    Decode,         // process_single() loop, detection left out
+    Detect,         // magic word search (for flac, of each frame as it is decoded)
+    TagWrite,       // writing the tags (in place or through libFLAC)
+    Count
+};
+
+constexpr const char *kStageNames[static_cast<size_t>(Stage::Count)] = {
+    "init", "metadata", "decode", "detect", "tag write"
+};
+
+static_assert(static_cast<size_t>(Stage::Count) <= PerfCounters::kStages, "too many stages for PerfCounters");
+
+#define MQAID_STAGE_CONCAT_(a, b) a##b
+#define MQAID_STAGE_CONCAT(a, b) MQAID_STAGE_CONCAT_(a, b)
+
+
+/**
+ * Everything a stage shows up in besides its timing: the trace (--trace), the hardware counters
+ * (--perf-counters) and the worker board (SIGUSR1); each costs a single check while not in use, about 7ns
+ * for the three on x86-64, a handful of times per file. Builds with MQAID_NO_STAGE_HOOKS compile them out.
+ */
+class StageSpan {
+ public:
+#ifndef MQAID_NO_STAGE_HOOKS
+  explicit StageSpan(Stage stage)
+      : span_(kStageNames[static_cast<size_t>(stage)]), perf_(static_cast<size_t>(stage)),
+        activity_(static_cast<int>(stage)) {}
+
+ private:
+  TraceSpan span_;
+  PerfScope perf_;
+  StageActivity activity_;
+#else
+  explicit StageSpan(Stage) {}
+#endif
+};
+
+
+#ifdef MQAID_STAGE_TIMING
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Nanoseconds spent by a file in each stage
+ */
+using StageTimes = std::array<uint64_t, static_cast<size_t>(Stage::Count)>;
+
+
+/**
+ * Adds the time spent in its scope to a stage (see also StageSpan).
+ * Scopes nest: the time of an inner scope (detection within decoding) is taken out of the outer one.
+ */
+class StageScope {
+ public:
+  StageScope(StageTimes &times, Stage stage)
+      : span_(stage), time_(times[static_cast<size_t>(stage)]), outer_(innermost()),
+        start_(std::chrono::steady_clock::now()) {
+      innermost() = this;
+  }
+
+  ~StageScope() {
+      const uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - this->start_).count();
+      this->time_ += elapsed - std::min(elapsed, this->nested_);
+      if (this->outer_)
+          this->outer_->nested_ += elapsed;
+      innermost() = this->outer_;
+  }
+
+  StageScope(const StageScope &) = delete;
+  StageScope &operator=(const StageScope &) = delete;
+
+ private:
+  StageSpan span_;
+  uint64_t &time_;
+  uint64_t nested_ = 0;       // time of the inner scopes
+  StageScope *outer_;
+  std::chrono::steady_clock::time_point start_;
+
+  static StageScope *&innermost() {
+      thread_local StageScope *scope = nullptr;
+      return scope;
+  }
+};
+
+#define MQAID_TIME_STAGE(times, stage) StageScope MQAID_STAGE_CONCAT(stage_scope_, __LINE__)((times), (stage))
+
+
+/**
+ * Latency histogram with 8 buckets per power of two (at most 12.5% error), from 1ns to hours
+ */
+class LatencyHistogram {
+ public:
+  void add(uint64_t ns) {
+      this->buckets_[bucket(ns)]++;
+      this->count_++;
+      this->max_ = std::max(this->max_, ns);
+  }
+
+  [[nodiscard]] uint64_t count() const noexcept { return this->count_; }
+  [[nodiscard]] uint64_t max() const noexcept { return this->max_; }
+
+  /**
+   * @short Upper bound of the bucket holding the given quantile
+   */
+  [[nodiscard]] uint64_t percentile(double q) const {
+      const auto rank = static_cast<uint64_t>(q * static_cast<double>(this->count_ - 1)) + 1;
+      uint64_t seen = 0;
+      for (size_t i = 0; i < kBuckets; i++)
+          if ((seen += this->buckets_[i]) >= rank)
+              return std::min(upperBound(i), this->max_);
+      return this->max_;
+  }
+
+ private:
+  static constexpr size_t kSubBuckets = 8;
+  static constexpr size_t kBuckets = 64 * kSubBuckets;
+
+  std::array<uint64_t, kBuckets> buckets_{};
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+
+
+  static size_t bucket(uint64_t ns) {
+      if (ns < kSubBuckets)
+          return static_cast<size_t>(ns);
+      unsigned exponent = 63;
+      while (!(ns >> exponent)) exponent--;
+      // 3 bits of mantissa under the leading one
+      const auto mantissa = (ns >> (exponent - 3)) & (kSubBuckets - 1);
+      return (exponent - 2) * kSubBuckets + mantissa;
+  }
+
+  static uint64_t upperBound(size_t index) {
+      if (index < kSubBuckets)
+          return index;
+      const auto exponent = index / kSubBuckets + 2;
+      const auto mantissa = index % kSubBuckets;
+      return ((kSubBuckets + mantissa + 1) << (exponent - 3)) - 1;
+  }
+};
+
+
+/**
+ * Stage timings of a run: a histogram per stage and the slowest files
+ */
+class StageStats {
+ public:
+  explicit StageStats(size_t slowest = 10) : slowest_(slowest) {}
+
+  /**
+   * @short Number of slowest files to report
+   */
+  void setSlowest(size_t slowest) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      this->slowest_ = slowest;
+  }
+
+  /**
+   * @short Account a finished file
+   * @param path path of the file
+   * @param times time spent in each stage
+   * @param note what the file went through (e.g. "file rewritten"), reported with the slowest files
+   */
+  void record(const std::string &path, const StageTimes &times, const std::string &note = {}) {
+      uint64_t total = 0;
+      size_t worst = 0;
+      for (size_t i = 0; i < times.size(); i++) {
+          total += times[i];
+          if (times[i] > times[worst]) worst = i;
+      }
+
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      for (size_t i = 0; i < times.size(); i++)
+          if (times[i] > 0)
+              this->stages_[i].add(times[i]);
+      this->total_.add(total);
+
+      if (this->slowest_ == 0 || (this->slow_.size() == this->slowest_ && total <= this->slow_.front().total))
+          return;
+      if (this->slow_.size() == this->slowest_) {
+          std::pop_heap(this->slow_.begin(), this->slow_.end(), Slow::faster);
+          this->slow_.pop_back();
+      }
+
+      // the reason is the stage the file spent most of its time in
+      char share[16];
+      std::snprintf(share, sizeof share, " %.0f%%", total ? 100.0 * times[worst] / total : 0.0);
+      std::string reason = kStageNames[worst] + std::string(share);
+      if (!note.empty())
+          reason += ", " + note;
+      this->slow_.push_back(Slow{total, path, std::move(reason)});
+      std::push_heap(this->slow_.begin(), this->slow_.end(), Slow::faster);
+  }
+
+  void report(std::ostream &out) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      out << "\nStage timings (" << this->total_.count() << " files decoded)\n";
+      out << "  stage        count       p50       p95       p99       max\n";
+      for (size_t i = 0; i <= this->stages_.size(); i++) {
+          const auto &h = i < this->stages_.size() ? this->stages_[i] : this->total_;
+          if (h.count() == 0)
+              continue;
+          char line[128];
+          std::snprintf(line, sizeof line, "  %-10s %7llu %9s %9s %9s %9s\n",
+                        i < this->stages_.size() ? kStageNames[i] : "total",
+                        static_cast<unsigned long long>(h.count()), duration(h.percentile(0.50)).c_str(),
+                        duration(h.percentile(0.95)).c_str(), duration(h.percentile(0.99)).c_str(),
+                        duration(h.max()).c_str());
+          out << line;
+      }
+
+      if (this->slow_.empty())
+          return;
+      auto slow = this->slow_;
+      std::sort(slow.begin(), slow.end(), [](const Slow &a, const Slow &b) { return a.total > b.total; });
+      out << "Slowest files\n";
+      for (const auto &s : slow)
+          out << "  " << duration(s.total) << "\t" << s.reason << "\t" << s.path << "\n";
+  }
+
+ private:
+  struct Slow {
+      uint64_t total;
+      std::string path;
+      std::string reason;
+
+      // min-heap on the total time, the fastest of the slowest is evicted first
+      static bool faster(const Slow &a, const Slow &b) { return a.total > b.total; }
+  };
+
+  size_t slowest_;
+  std::array<LatencyHistogram, static_cast<size_t>(Stage::Count)> stages_;
+  LatencyHistogram total_;
+  std::vector<Slow> slow_;
+  std::mutex mutex_;
+
+
+  static std::string duration(uint64_t ns) {
+      char text[32];
+      if (ns < 10000)
+          std::snprintf(text, sizeof text, "%lluns", static_cast<unsigned long long>(ns));
+      else if (ns < 10000000)
+          std::snprintf(text, sizeof text, "%.1fus", ns / 1e3);
+      else if (ns < 10000000000ull)
+          std::snprintf(text, sizeof text, "%.1fms", ns / 1e6);
+      else
+          std::snprintf(text, sizeof text, "%.2fs", ns / 1e9);
+      return text;
+  }
+};
+
+#elif !defined(MQAID_NO_STAGE_HOOKS)
+
+// stages still show up in traces, hardware counters and the worker board
+#define MQAID_TIME_STAGE(times, stage) StageSpan MQAID_STAGE_CONCAT(stage_span_, __LINE__)(stage)
+
+#else
+
+#define MQAID_TIME_STAGE(times, stage) ((void) 0)
+
+#endif
+
+
+/**
+ * @short Print the hardware events of each stage per decoded sample
+ * @param samples samples decoded during the run
+ */
+inline void reportPerfCounters(std::ostream &out, const PerfCounters &counters, uint64_t samples) {
+    out << "\nHardware counters per decoded sample (" << samples << " samples)\n";
+    out << "  stage         calls    cycles     instr    IPC  br-miss  cache-miss\n";
+    if (samples == 0)
+        samples = 1;
+
+    const auto column = [&](char *text, size_t size, size_t stage, PerfCounters::Event event, const char *format) {
+        if (counters.available(event))
+            std::snprintf(text, size, format, static_cast<double>(counters.total(stage, event)) / samples);
+        else
+            std::snprintf(text, size, "-");
+    };
+    for (size_t i = 0; i < static_cast<size_t>(Stage::Count); i++) {
+        if (counters.calls(i) == 0)
+            continue;
+        char cycles[16], instructions[16], branch[16], cache[16], ipc[16] = "-";
+        column(cycles, sizeof cycles, i, PerfCounters::Cycles, "%.2f");
+        column(instructions, sizeof instructions, i, PerfCounters::Instructions, "%.2f");
+        column(branch, sizeof branch, i, PerfCounters::BranchMisses, "%.4f");
+        column(cache, sizeof cache, i, PerfCounters::CacheMisses, "%.4f");
+        if (counters.total(i, PerfCounters::Cycles) > 0 && counters.available(PerfCounters::Instructions))
+            std::snprintf(ipc, sizeof ipc, "%.2f", static_cast<double>(counters.total(i, PerfCounters::Instructions))
+                                                   / counters.total(i, PerfCounters::Cycles));
+
+        char line[128];
+        std::snprintf(line, sizeof line, "  %-10s %8llu %9s %9s %6s %8s %11s\n", kStageNames[i],
+                      static_cast<unsigned long long>(counters.calls(i)), cycles, instructions, ipc, branch, cache);
+        out << line;
+    }
+}
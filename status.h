@@ -0,0 +1,269 @@
+/**
+ * @file        status.h
+ * @short       Live introspection of a scan: what each worker is doing, dumped on SIGUSR1
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+
+/**
+ * Board of the scan workers.
+ * Threads that register get a slot holding the file they work on, since when, and the stage it is in. Slots
+ * are only written by their thread; the file is guarded by a per-slot lock taken once per file, the stage is
+ * a relaxed atomic, so keeping the board up to date costs next to nothing. Unregistered threads skip it, and
+ * a slot leaves the board when its thread exits.
+ */
+class WorkerBoard {
+ public:
+  static constexpr int kIdle = -1;
+
+  using Clock = std::chrono::steady_clock;
+  using Visit = std::function<void(const std::string &worker, const std::string &file, Clock::duration elapsed,
+                                   int stage)>;
+
+  static WorkerBoard &instance() {
+      static WorkerBoard board;
+      return board;
+  }
+
+  /**
+   * @short Give the calling thread a slot on the board, until it exits
+   */
+  void registerThread(std::string_view name) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      auto &slot = threadSlot();
+      if (!slot) {
+          this->slots_.push_back(std::make_unique<Slot>());
+          slot = this->slots_.back().get();
+      }
+      slot->name = name;
+  }
+
+  /**
+   * @short Visit every slot (file is empty and stage kIdle for idle workers)
+   */
+  void visit(const Visit &visit) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      const auto now = Clock::now();
+      for (const auto &slot : this->slots_) {
+          std::string file;
+          Clock::time_point started;
+          {
+              std::lock_guard<std::mutex> slot_lock(slot->mutex);
+              file = slot->file;
+              started = slot->started;
+          }
+          visit(slot->name, file, file.empty() ? Clock::duration::zero() : now - started,
+                file.empty() ? kIdle : slot->stage.load(std::memory_order_relaxed));
+      }
+  }
+
+ private:
+  friend class FileActivity;
+  friend class StageActivity;
+
+  struct Slot {
+      std::string name;
+      std::mutex mutex;
+      std::string file;
+      Clock::time_point started;
+      std::atomic<int> stage{kIdle};
+  };
+
+  std::mutex mutex_;
+  std::deque<std::unique_ptr<Slot>> slots_;
+
+
+  /**
+   * Slot of a thread, taken off the board when the thread exits
+   */
+  struct ThreadSlot {
+      Slot *slot = nullptr;
+
+      ~ThreadSlot() {
+          if (this->slot)
+              WorkerBoard::instance().release(this->slot);
+      }
+  };
+
+  static Slot *&threadSlot() {
+      thread_local ThreadSlot holder;
+      return holder.slot;
+  }
+
+  void release(Slot *slot) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      for (auto it = this->slots_.begin(); it != this->slots_.end(); ++it)
+          if (it->get() == slot) {
+              this->slots_.erase(it);
+              return;
+          }
+  }
+};
+
+
+/**
+ * Shows its scope's file on the calling thread's slot
+ */
+class FileActivity {
+ public:
+  explicit FileActivity(const std::string &file) : slot_(WorkerBoard::threadSlot()) {
+      if (!this->slot_)
+          return;
+      std::lock_guard<std::mutex> lock(this->slot_->mutex);
+      this->slot_->file = file;
+      this->slot_->started = WorkerBoard::Clock::now();
+  }
+
+  ~FileActivity() {
+      if (!this->slot_)
+          return;
+      std::lock_guard<std::mutex> lock(this->slot_->mutex);
+      this->slot_->file.clear();
+  }
+
+  FileActivity(const FileActivity &) = delete;
+  FileActivity &operator=(const FileActivity &) = delete;
+
+ private:
+  WorkerBoard::Slot *slot_;
+};
+
+
+/**
+ * Shows its scope's stage on the calling thread's slot
+ */
+class StageActivity {
+ public:
+  explicit StageActivity(int stage) : slot_(WorkerBoard::threadSlot()) {
+      if (this->slot_)
+          this->previous_ = this->slot_->stage.exchange(stage, std::memory_order_relaxed);
+  }
+
+  ~StageActivity() {
+      if (this->slot_)
+          this->slot_->stage.store(this->previous_, std::memory_order_relaxed);
+  }
+
+  StageActivity(const StageActivity &) = delete;
+  StageActivity &operator=(const StageActivity &) = delete;
+
+ private:
+  WorkerBoard::Slot *slot_;
+  int previous_ = WorkerBoard::kIdle;
+};
+
+
+/**
+ * Rate of a counter over the last minute, sampled once a second
+ */
+class RateWindow {
+ public:
+  void sample(uint64_t value) {
+      const auto now = std::chrono::steady_clock::now();
+      this->samples_[this->next_ % kSamples] = {now, value};
+      this->next_++;
+  }
+
+  /**
+   * @short Increase per second between the oldest and newest samples
+   * @param seconds set to the span the rate covers
+   */
+  [[nodiscard]] double perSecond(double &seconds) const {
+      seconds = 0;
+      if (this->next_ < 2)
+          return 0;
+      const auto &newest = this->samples_[(this->next_ - 1) % kSamples];
+      const auto &oldest = this->samples_[this->next_ > kSamples ? this->next_ % kSamples : 0];
+      seconds = std::chrono::duration<double>(newest.first - oldest.first).count();
+      return seconds > 0 ? static_cast<double>(newest.second - oldest.second) / seconds : 0;
+  }
+
+ private:
+  static constexpr size_t kSamples = 61;
+
+  std::array<std::pair<std::chrono::steady_clock::time_point, uint64_t>, kSamples> samples_{};
+  size_t next_ = 0;
+};
+
+
+/**
+ * SIGUSR1 watcher.
+ * The signal handler only raises a flag; a background thread checks it a few times a second and writes the
+ * snapshot, so the scan never stops for it. The same thread calls the tick callback once a second (to
+ * sample rates). Does nothing on systems without SIGUSR1.
+ */
+class StatusSignal {
+ public:
+  using Callback = std::function<void()>;
+
+  /**
+   * @param tick called once a second
+   * @param dump called after each SIGUSR1
+   */
+  StatusSignal(Callback tick, Callback dump) : tick_(std::move(tick)), dump_(std::move(dump)) {
+#ifdef SIGUSR1
+      std::signal(SIGUSR1, &StatusSignal::handler);
+      this->worker_ = std::thread([this] {
+          std::unique_lock<std::mutex> lock(this->mutex_);
+          auto next_tick = std::chrono::steady_clock::now();
+          while (!this->stop_) {
+              if (std::chrono::steady_clock::now() >= next_tick) {
+                  this->tick_();
+                  next_tick += std::chrono::seconds(1);
+              }
+              if (requested_) {
+                  requested_ = 0;
+                  this->dump_();
+              }
+              this->wake_.wait_for(lock, kPoll, [this] { return this->stop_; });
+          }
+      });
+#endif
+  }
+
+  ~StatusSignal() {
+      {
+          std::lock_guard<std::mutex> lock(this->mutex_);
+          this->stop_ = true;
+      }
+      this->wake_.notify_one();
+      if (this->worker_.joinable())
+          this->worker_.join();
+#ifdef SIGUSR1
+      std::signal(SIGUSR1, SIG_DFL);
+#endif
+  }
+
+ private:
+  static constexpr std::chrono::milliseconds kPoll{200};
+
+  Callback tick_;
+  Callback dump_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_ = false;
+  std::thread worker_;
+
+
+  static inline volatile std::sig_atomic_t requested_ = 0;
+
+  static void handler(int) {
+      requested_ = 1;
+  }
+};
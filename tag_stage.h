@@ -0,0 +1,248 @@
+/**
+ * @file        tag_stage.h
+ * @short       Background stage writing MQA tags while detection goes on
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+ #include <io.h>
+#else
+ #include <unistd.h>
+#endif
+
+#include "mqa_identifier.h"
+#include "status.h"
+#include "tag_writer.h"
+#include "trace.h"
+
+
+/**
+ * Tag writer stage.
+ * Identified files are queued with their identifier (which keeps the file open and its parsed metadata) and
+ * tagged by worker threads, at most per_device at a time on each device, so a slow rewrite only holds back
+ * the writes behind it on the same disk. Written files are made durable in batches: on Linux a single
+ * syncfs() covers a batch of kSyncfsBatch files or more, otherwise the files are fsync'ed back to back. A file
+ * that fails to sync completes as Failed. Completion callbacks run on the worker once a file is durable.
+ * The queue is bounded; submit() blocks while it is full, so detection never runs far ahead of the disks.
+ */
+class TagWriterStage {
+ public:
+  using Completion = std::function<void(const TagWriteResult &, MQA_identifier &)>;
+
+  /**
+   * @param rewrite_founded_tags rewrite the tags if they already exist
+   * @param padding_reserve size of the PADDING block left after a full rewrite
+   * @param per_device number of files written at the same time on one device
+   * @param max_queued number of files waiting to be written before submit() blocks
+   */
+  TagWriterStage(bool rewrite_founded_tags, uint32_t padding_reserve, unsigned per_device = 1,
+                 size_t max_queued = 64)
+      : rewrite_founded_tags_(rewrite_founded_tags), padding_reserve_(padding_reserve),
+        per_device_(per_device ? per_device : 1), max_queued_(max_queued ? max_queued : 1) {}
+
+  ~TagWriterStage() {
+      this->finish();
+  }
+
+  /**
+   * @short Queue a file to be tagged, waits while the queue is full
+   * @param device device the file lives on (see FileStamp)
+   * @param id identifier constructed writable, after detection
+   * @param done called from the writer once the file is written and synced (the identifier is closed by then)
+   */
+  void submit(uint64_t device, std::unique_ptr<MQA_identifier> id, Completion done) {
+      std::unique_lock<std::mutex> lock(this->mutex_);
+      this->space_.wait(lock, [this] { return this->queued_ < this->max_queued_; });
+
+      auto &dev = this->devices_[device];
+      dev.queue.push_back(Job{std::move(id), std::move(done)});
+      this->queued_++;
+      if (dev.workers.size() < this->per_device_ && dev.busy == dev.workers.size())
+          dev.workers.emplace_back(&TagWriterStage::work, this, std::ref(dev));
+      dev.wake.notify_one();
+  }
+
+  /**
+   * @short Number of files waiting to be written
+   */
+  [[nodiscard]] size_t queued() {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      return this->queued_;
+  }
+
+  /**
+   * @short Write all queued files and stop the workers
+   */
+  void finish() {
+      {
+          std::lock_guard<std::mutex> lock(this->mutex_);
+          this->finishing_ = true;
+          for (auto &[device, dev] : this->devices_)
+              dev.wake.notify_all();
+      }
+      for (auto &[device, dev] : this->devices_)
+          for (auto &worker : dev.workers)
+              if (worker.joinable())
+                  worker.join();
+  }
+
+ private:
+  static constexpr size_t kSyncBatch = 32;
+  static constexpr size_t kSyncfsBatch = 8;      // smaller batches are fsync'ed file by file
+  static constexpr std::chrono::seconds kSyncInterval{1};
+
+  struct Job {
+      std::unique_ptr<MQA_identifier> id;
+      Completion done;
+  };
+
+  struct Written {
+      Job job;
+      TagWriteResult result;
+      std::FILE *file = nullptr;      // reopened rewritten file
+  };
+
+  struct Device {
+      std::deque<Job> queue;
+      std::vector<std::thread> workers;
+      size_t busy = 0;
+      std::condition_variable wake;
+  };
+
+  const bool rewrite_founded_tags_;
+  const uint32_t padding_reserve_;
+  const unsigned per_device_;
+  const size_t max_queued_;
+
+  std::mutex mutex_;
+  std::condition_variable space_;
+  std::map<uint64_t, Device> devices_;    // a map, workers keep references to their device
+  size_t queued_ = 0;
+  bool finishing_ = false;
+
+
+  void work(Device &dev) {
+      if (auto *trace = Trace::active())
+          trace->nameThread("tag writer");
+      WorkerBoard::instance().registerThread("tag writer");
+      std::vector<Written> batch;
+      auto batch_started = std::chrono::steady_clock::now();
+
+      for (;;) {
+          std::unique_lock<std::mutex> lock(this->mutex_);
+          // an idle worker syncs what it wrote instead of waiting for more
+          if (dev.queue.empty() && !batch.empty()) {
+              lock.unlock();
+              sync(batch);
+              continue;
+          }
+          dev.wake.wait(lock, [&] { return !dev.queue.empty() || this->finishing_; });
+          if (dev.queue.empty())
+              return;
+
+          Job job = std::move(dev.queue.front());
+          dev.queue.pop_front();
+          this->queued_--;
+          dev.busy++;
+          this->space_.notify_one();
+          lock.unlock();
+
+          TagWriteResult result;
+          {
+              const auto file = job.id->filename();
+              TraceSpan span(nullptr, "file", file);
+              FileActivity activity(file);
+              result = writeMQATags(*job.id, this->rewrite_founded_tags_, this->padding_reserve_);
+          }
+          if (result.status == TagWriteStatus::InPlace || result.status == TagWriteStatus::Rewritten) {
+              if (batch.empty())
+                  batch_started = std::chrono::steady_clock::now();
+              batch.push_back(Written{std::move(job), result});
+          } else {
+              job.id->close();
+              job.done(result, *job.id);
+          }
+
+          if (batch.size() >= kSyncBatch
+              || (!batch.empty() && std::chrono::steady_clock::now() - batch_started >= kSyncInterval))
+              sync(batch);
+
+          lock.lock();
+          dev.busy--;
+      }
+  }
+
+  /**
+   * @short Make a batch of written files durable, then complete them
+   */
+  static void sync(std::vector<Written> &batch) {
+      TraceSpan span("sync");
+      // rewritten files were replaced by libFLAC, they are reopened to be synced
+      for (auto &w : batch)
+          if (!w.job.id->handle())
+              w.file = std::fopen(w.job.id->filename().c_str(), "rb");
+
+      const auto fd = [](const Written &w) {
+          std::FILE *handle = w.job.id->handle() ? w.job.id->handle() : w.file;
+#ifdef _WIN32
+          return handle ? _fileno(handle) : -1;
+#else
+          return handle ? fileno(handle) : -1;
+#endif
+      };
+
+      // a file that can't be made durable fails, so it isn't recorded as tagged
+      const auto failed = [](Written &w, const char *error) {
+          w.result.status = TagWriteStatus::Failed;
+          w.result.error = std::string("couldn't sync the file: ") + error;
+      };
+
+#if defined(__linux__) && !defined(__ANDROID__)
+      // syncfs flushes the whole filesystem, other writers' data included: only worth it for a large batch,
+      // where one call replaces many fsync (all files of a worker are on one device)
+      bool synced = false;
+      if (batch.size() >= kSyncfsBatch)
+          for (const auto &w : batch)
+              if (!synced && fd(w) >= 0)
+                  synced = syncfs(fd(w)) == 0;
+      if (!synced)
+#endif
+      for (auto &w : batch) {
+          if (fd(w) < 0) {
+              failed(w, "it can't be reopened");
+              continue;
+          }
+#ifdef _WIN32
+          if (_commit(fd(w)) != 0)
+#else
+          if (fsync(fd(w)) != 0)
+#endif
+              failed(w, std::strerror(errno));
+      }
+
+      for (auto &w : batch) {
+          if (w.file)
+              std::fclose(w.file);
+          w.job.id->close();
+          w.job.done(w.result, *w.job.id);
+      }
+      batch.clear();
+  }
+};
@@ -0,0 +1,356 @@
+/**
+ * @file        tag_writer.h
+ * @short       Writes MQA tags through the handle used for detection
+ */
+
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <FLAC++/metadata.h>
+
+#include "mqa_identifier.h"
+#include "result_cache.h"
+
+
+/**
+ * Position of a metadata block in a flac file
+ */
+struct MetadataBlock {
+    unsigned type = 0;
+    bool is_last = false;
+    uint64_t offset = 0;    // offset of the block header
+    uint32_t length = 0;    // length of the block data, without header
+};
+
+
+/**
+ * Outcome of a tag update
+ */
+enum class TagWriteStatus {
+    Unchanged,      // all tags already present
+    InPlace,        // metadata rewritten in place
+    Rewritten,      // the whole file had to be rewritten
+    Failed
+};
+
+
+/**
+ * @short Read the layout of the metadata blocks (only the block headers are read)
+ * @param handle open file
+ * @param blocks blocks found, in file order
+ * @return false if the file isn't a valid native flac file
+ */
+inline bool readMetadataLayout(std::FILE *handle, std::vector<MetadataBlock> &blocks) {
+    blocks.clear();
+    unsigned char h[10];
+
+    if (std::fseek(handle, 0, SEEK_SET) != 0 || std::fread(h, 1, 4, handle) != 4)
+        return false;
+
+    // skip an ID3v2 tag in front of the stream
+    uint64_t offset = 0;
+    if (std::memcmp(h, "ID3", 3) == 0) {
+        if (std::fread(h + 4, 1, 6, handle) != 6)
+            return false;
+        offset = 10 + ((h[6] & 0x7fu) << 21u | (h[7] & 0x7fu) << 14u | (h[8] & 0x7fu) << 7u | (h[9] & 0x7fu));
+        if (h[5] & 0x10u) offset += 10;     // footer present
+
+        if (std::fseek(handle, static_cast<long>(offset), SEEK_SET) != 0 || std::fread(h, 1, 4, handle) != 4)
+            return false;
+    }
+    if (std::memcmp(h, "fLaC", 4) != 0)
+        return false;
+    offset += 4;
+
+    for (bool last = false; !last;) {
+        if (std::fread(h, 1, 4, handle) != 4)
+            return false;
+
+        MetadataBlock block;
+        block.type = h[0] & 0x7fu;
+        block.is_last = last = (h[0] & 0x80u) != 0;
+        block.offset = offset;
+        block.length = static_cast<uint32_t>(h[1]) << 16u | static_cast<uint32_t>(h[2]) << 8u | h[3];
+        blocks.push_back(block);
+
+        offset += 4 + block.length;
+        if (!last && std::fseek(handle, static_cast<long>(block.length), SEEK_CUR) != 0)
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * @short Serialize a VORBIS_COMMENT block (header included)
+ * @param is_last value of the last-metadata-block flag
+ */
+inline std::vector<uint8_t> serializeVorbisComment(const FLAC::Metadata::VorbisComment &vc, bool is_last) {
+    const ::FLAC__StreamMetadata *raw = vc;
+    const auto &data = raw->data.vorbis_comment;
+
+    std::vector<uint8_t> out(4);
+    const auto put32 = [&out](uint32_t v) {
+        for (int i = 0; i < 4; i++) out.push_back(static_cast<uint8_t>(v >> (8 * i)));
+    };
+    const auto putEntry = [&](const ::FLAC__StreamMetadata_VorbisComment_Entry &e) {
+        put32(e.length);
+        if (e.length) out.insert(out.end(), e.entry, e.entry + e.length);
+    };
+
+    putEntry(data.vendor_string);
+    put32(data.num_comments);
+    for (FLAC__uint32 i = 0; i < data.num_comments; i++)
+        putEntry(data.comments[i]);
+
+    const auto length = out.size() - 4;
+    out[0] = static_cast<uint8_t>((is_last ? 0x80u : 0u) | FLAC__METADATA_TYPE_VORBIS_COMMENT);
+    out[1] = static_cast<uint8_t>(length >> 16u);
+    out[2] = static_cast<uint8_t>(length >> 8u);
+    out[3] = static_cast<uint8_t>(length);
+    return out;
+}
+
+
+/**
+ * Positions of the MQA tags in a VORBIS_COMMENT block, found in a single pass over its comments
+ */
+struct MQATagIndex {
+    enum Tag { Encoder, MQAEncoder, OriginalSampleRate, Count };
+    static constexpr const char *kNames[Count] = {"ENCODER", "MQAENCODER", "ORIGINALSAMPLERATE"};
+
+    int position[Count] = {-1, -1, -1};     // last comment holding each tag, -1 if there is none
+
+    explicit MQATagIndex(const FLAC::Metadata::VorbisComment &vc) {
+        const ::FLAC__StreamMetadata *raw = vc;
+        const auto &data = raw->data.vorbis_comment;
+        for (FLAC__uint32 i = 0; i < data.num_comments; i++)
+            for (int tag = 0; tag < Count; tag++)
+                if (isField(data.comments[i], kNames[tag]))
+                    this->position[tag] = static_cast<int>(i);
+    }
+
+    /**
+     * @short Whether a comment is "name=..." (field names are case insensitive)
+     */
+    static bool isField(const ::FLAC__StreamMetadata_VorbisComment_Entry &entry, const char *name) {
+        const auto length = std::strlen(name);
+        if (entry.length <= length || entry.entry[length] != '=')
+            return false;
+        for (size_t i = 0; i < length; i++)
+            if (std::toupper(entry.entry[i]) != name[i])
+                return false;
+        return true;
+    }
+};
+
+
+/**
+ * @short Add ENCODER, MQAENCODER and ORIGINALSAMPLERATE tags to a VORBIS_COMMENT block
+ * The tags are looked up once, existing ones are replaced where they are (with -rw) and missing ones appended.
+ * @param vcBlock block to update
+ * @param originalSampleRate original sample rate to write
+ * @param rewrite_founded_tags rewrite the tags if they already exist
+ * @return true if the block changed
+ */
+inline bool applyMQATags(FLAC::Metadata::VorbisComment &vcBlock, uint32_t originalSampleRate, bool rewrite_founded_tags) {
+    static const char *kEncoder =
+        "MQAEncode v1.1, 2.3.3+800 (a505918), F8EC1703-7616-45E5-B81E-D60821434062, Dec 01 2017 22:19:30";
+    const std::string OrigSamp = std::to_string(originalSampleRate);
+    const char *values[MQATagIndex::Count] = {kEncoder, kEncoder, OrigSamp.c_str()};
+
+    const MQATagIndex index(vcBlock);
+    const ::FLAC__StreamMetadata *raw = vcBlock;
+
+    bool changed = false;
+    for (int tag = 0; tag < MQATagIndex::Count; tag++) {
+        const int at = index.position[tag];
+        const FLAC::Metadata::VorbisComment::Entry entry(MQATagIndex::kNames[tag], values[tag]);
+
+        if (at < 0)
+            changed |= vcBlock.append_comment(entry);
+        else if (rewrite_founded_tags) {
+            // a tag that already holds the value is left alone
+            const auto &current = raw->data.vorbis_comment.comments[at];
+            if (current.length == entry.get_field_length()
+                && std::memcmp(current.entry, entry.get_field(), current.length) == 0)
+                continue;
+            changed |= vcBlock.set_comment(static_cast<unsigned>(at), entry);
+        }
+    }
+    return changed;
+}
+
+
+/**
+ * Outcome and cost of a tag update
+ */
+struct TagWriteResult {
+    TagWriteStatus status = TagWriteStatus::Unchanged;
+    uint64_t bytes_written = 0;     // metadata bytes written in place, or size of the rewritten file
+    std::string error;              // why the tags couldn't be written, when Failed
+};
+
+
+/**
+ * @short Write a VORBIS_COMMENT block over the metadata of a file, using its PADDING
+ * The block replaces the current VORBIS_COMMENT (or the first PADDING when there is none) and takes space from
+ * the PADDING blocks after it; blocks found in between are moved up and what is left of the padding becomes a
+ * single PADDING block. The smallest region that fits is rewritten, so in the common case of a comment followed
+ * by padding only these two blocks are written.
+ * @param handle file opened for update
+ * @param blocks metadata layout of the file
+ * @param vc block to write
+ * @param bytes_written number of bytes written
+ * @return false if the block doesn't fit (nothing is written then)
+ */
+inline bool writeVorbisCommentInPlace(std::FILE *handle, const std::vector<MetadataBlock> &blocks,
+                                      const FLAC::Metadata::VorbisComment &vc, uint64_t &bytes_written) {
+    size_t first = blocks.size();
+    for (size_t i = 0; i < blocks.size() && first == blocks.size(); i++)
+        if (blocks[i].type == FLAC__METADATA_TYPE_VORBIS_COMMENT)
+            first = i;
+    for (size_t i = 0; i < blocks.size() && first == blocks.size(); i++)
+        if (blocks[i].type == FLAC__METADATA_TYPE_PADDING)
+            first = i;
+    if (first == blocks.size())
+        return false;
+
+    auto bytes = serializeVorbisComment(vc, false);
+    if (bytes.size() - 4 > 0xffffffu)
+        return false;
+
+    // Grow the region block by block until the new comment, the blocks to move and a padding fit in it
+    size_t last = first;
+    uint64_t region = 0, moved = 0;
+    for (; last < blocks.size(); last++) {
+        region = blocks[last].offset + 4 + blocks[last].length - blocks[first].offset;
+        if (last != first && blocks[last].type != FLAC__METADATA_TYPE_PADDING)
+            moved += 4 + blocks[last].length;
+        const uint64_t needed = bytes.size() + moved;
+        if (needed == region || needed + 4 <= region)
+            break;
+    }
+    if (last == blocks.size())
+        return false;
+
+    for (size_t i = first + 1; i <= last; i++) {
+        if (blocks[i].type == FLAC__METADATA_TYPE_PADDING)
+            continue;
+        const auto at = bytes.size();
+        bytes.resize(at + 4 + blocks[i].length);
+        if (std::fseek(handle, static_cast<long>(blocks[i].offset), SEEK_SET) != 0
+            || std::fread(bytes.data() + at, 1, 4 + blocks[i].length, handle) != 4 + blocks[i].length)
+            return false;
+        bytes[at] &= 0x7fu;
+    }
+
+    // what is left of the region becomes the new PADDING, the last block keeps the region's last flag
+    const bool region_is_last = blocks[last].is_last;
+    const uint64_t padding = region - bytes.size();
+    if (padding == 0) {
+        size_t tail = 0;
+        for (size_t at = 0; at < bytes.size(); at += 4 + (bytes[at + 1] << 16u | bytes[at + 2] << 8u | bytes[at + 3]))
+            tail = at;
+        bytes[tail] |= region_is_last ? 0x80u : 0u;
+    } else {
+        const auto length = padding - 4;
+        bytes.push_back(static_cast<uint8_t>((region_is_last ? 0x80u : 0u) | FLAC__METADATA_TYPE_PADDING));
+        bytes.push_back(static_cast<uint8_t>(length >> 16u));
+        bytes.push_back(static_cast<uint8_t>(length >> 8u));
+        bytes.push_back(static_cast<uint8_t>(length));
+        bytes.resize(bytes.size() + length, 0);
+    }
+
+    if (std::fseek(handle, static_cast<long>(blocks[first].offset), SEEK_SET) != 0
+        || std::fwrite(bytes.data(), 1, bytes.size(), handle) != bytes.size() || std::fflush(handle) != 0)
+        return false;
+    bytes_written = bytes.size();
+    return true;
+}
+
+
+/**
+ * @short Add the MQA tags to an identified file
+ * The VORBIS_COMMENT block captured while decoding is updated and written back through the same file, reopened
+ * for update, when it fits in the space of the current block and the padding of the file; only otherwise the
+ * file is re-read and rewritten by libFLAC, with padding_reserve bytes of padding so the next edits can be done
+ * in place.
+ * @param id identifier constructed writable, after detection
+ * @param rewrite_founded_tags rewrite the tags if they already exist
+ * @param padding_reserve size of the PADDING block left after a full rewrite
+ */
+inline TagWriteResult writeMQATags(MQA_identifier &id, bool rewrite_founded_tags, uint32_t padding_reserve) {
+    MQAID_TIME_STAGE(id.stageTimes(), Stage::TagWrite);
+    TagWriteResult result;
+    FLAC::Metadata::VorbisComment vc;
+    if (id.vorbisComment())
+        vc = *id.vorbisComment();
+
+    if (!applyMQATags(vc, id.originalSampleRate(), rewrite_founded_tags))
+        return result;
+
+    std::vector<MetadataBlock> blocks;
+    if (id.makeWritable() && readMetadataLayout(id.handle(), blocks)
+        && writeVorbisCommentInPlace(id.handle(), blocks, vc, result.bytes_written)) {
+        result.status = TagWriteStatus::InPlace;
+        return result;
+    }
+
+    // Doesn't fit, libFLAC has to rewrite the file
+    id.close();
+    result.status = TagWriteStatus::Failed;
+
+    FLAC::Metadata::Chain chain;
+    if (!chain.read(id.filename().c_str())) {
+        result.error = std::string("reading metadata: ") + chain.status().as_cstring();
+        return result;
+    }
+
+    FLAC::Metadata::Iterator iterator;
+    iterator.init(chain);
+    auto block = std::make_unique<FLAC::Metadata::VorbisComment>(vc);
+    bool found = false;
+    do {
+        found = iterator.get_block_type() == FLAC__METADATA_TYPE_VORBIS_COMMENT;
+    } while (!found && iterator.next());
+
+    // on success the chain takes ownership of the block
+    if (found ? iterator.set_block(block.get()) : iterator.insert_block_after(block.get()))
+        (void) block.release();
+    else {
+        result.error = "updating metadata";
+        return result;
+    }
+
+    // All padding ends up merged in the last block, which is resized to the reserve
+    chain.sort_padding();
+    iterator.init(chain);
+    while (iterator.next()) {}
+    auto padding = std::make_unique<FLAC::Metadata::Padding>();
+    padding->set_length(padding_reserve);
+    bool placed = true;
+    if (iterator.get_block_type() == FLAC__METADATA_TYPE_PADDING)
+        placed = padding_reserve > 0 ? iterator.set_block(padding.get()) : iterator.delete_block(false);
+    else if (padding_reserve > 0)
+        placed = iterator.insert_block_after(padding.get());
+    if (placed && padding_reserve > 0)
+        (void) padding.release();
+
+    if (!chain.write()) {
+        result.error = std::string("writing tags: ") + chain.status().as_cstring();
+        return result;
+    }
+
+    FileStamp stamp;
+    result.status = TagWriteStatus::Rewritten;
+    result.bytes_written = statFile(id.filename(), stamp) ? stamp.size : 0;
+    return result;
+}
@@ -0,0 +1,209 @@
+/**
+ * @file        buffer_scanner_test.cc
+ * @short       BufferScanner results, and the allocations of repeated scans
+ *
+ * An MQA and a plain stream are encoded with the metadata of a tagged file (VORBIS_COMMENT, SEEKTABLE, PADDING)
+ * and scanned from memory and through a read callback. Once the scanner has seen both streams, further scans
+ * must not allocate: malloc and friends are counted over them (glibc only, where the real allocator can be
+ * reached through __libc_malloc).
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <FLAC++/encoder.h>
+#include <FLAC++/metadata.h>
+
+#include "../buffer_scanner.h"
+
+
+#ifdef __GLIBC__
+namespace {
+size_t allocations = 0;
+}
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    allocations++;
+    return __libc_realloc(pointer, size);
+}
+}
+#endif
+
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT(condition)                                                                   \
+    do {                                                                                    \
+        if (!(condition)) {                                                                 \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": expected " #condition "\n";      \
+            failures++;                                                                     \
+        }                                                                                   \
+    } while (false)
+
+
+constexpr unsigned kBits = 24;
+constexpr unsigned kRate = 48000;
+constexpr unsigned kSamples = 2 * kRate;
+constexpr size_t kSyncAt = 1000;
+constexpr uint64_t kSyncWord = 0xbe0498c88;     // 36 bits, followed by 34 bits of stream info
+const char *const kEncoder = "MQAEncode v1.1, 2.3.3+800 (a505918), F8EC1703-7616-45E5-B81E-D60821434062";
+
+
+bool encode(const std::string &path, bool mqa) {
+    FLAC::Metadata::VorbisComment comment;
+    (void) comment.append_comment(FLAC::Metadata::VorbisComment::Entry("TITLE", "buffer scanner test"));
+    if (mqa)
+        (void) comment.append_comment(FLAC::Metadata::VorbisComment::Entry("MQAENCODER", kEncoder));
+    FLAC::Metadata::SeekTable seek_table;
+    (void) seek_table.template_append_spaced_points(20, kSamples);
+    FLAC::Metadata::Padding padding;
+    padding.set_length(4096);
+    FLAC::Metadata::Prototype *blocks[] = {&seek_table, &comment, &padding};
+
+    FLAC::Encoder::File encoder;
+    (void) encoder.set_channels(2);
+    (void) encoder.set_bits_per_sample(kBits);
+    (void) encoder.set_sample_rate(kRate);
+    (void) encoder.set_total_samples_estimate(kSamples);
+    (void) encoder.set_metadata(blocks, 3);
+    if (encoder.init(path.c_str()) != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+        return false;
+
+    // noise, with the MQA sync word and stream info carried by the xor of the channels at bit 9
+    std::vector<FLAC__int32> samples(2 * kSamples);
+    uint32_t seed = 12345;
+    for (auto &sample : samples) {
+        seed = seed * 1664525 + 1013904223;
+        sample = static_cast<FLAC__int32>(seed) >> (32 - kBits);
+    }
+    if (mqa) {
+        const uint64_t info = 0x2aaaaaaaa;
+        for (size_t bit = 0; bit < 36 + 34; bit++) {
+            const uint32_t want = bit < 36 ? (kSyncWord >> (35 - bit)) & 1 : (info >> (bit - 36)) & 1;
+            auto &left = samples[2 * (kSyncAt + bit)], &right = samples[2 * (kSyncAt + bit) + 1];
+            if ((((uint32_t(left) ^ uint32_t(right)) >> (kBits - 15)) & 1) != want)
+                right ^= 1 << (kBits - 15);
+        }
+    }
+    return encoder.process_interleaved(samples.data(), kSamples) && encoder.finish();
+}
+
+
+std::vector<uint8_t> contents(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+}
+
+
+/**
+ * Stream handed to BufferScanner in small pieces
+ */
+struct Reader {
+    const std::vector<uint8_t> &stream;
+    size_t position = 0;
+
+    size_t operator()(uint8_t *buffer, size_t bytes) {
+        bytes = std::min<size_t>({bytes, this->stream.size() - this->position, 1000});
+        std::copy_n(this->stream.data() + this->position, bytes, buffer);
+        this->position += bytes;
+        return bytes;
+    }
+};
+
+
+bool scan(BufferScanner &scanner, const std::vector<uint8_t> &stream, bool callback) {
+    if (!callback)
+        return scanner.scan(stream.data(), stream.size());
+    Reader reader{stream};
+    return scanner.scan(reader);
+}
+
+
+void results(const std::vector<uint8_t> &mqa, const std::vector<uint8_t> &plain, bool callback) {
+    BufferScanner scanner;
+    EXPECT(scan(scanner, mqa, callback));
+    EXPECT(scanner.identified());
+    EXPECT(scanner.error().empty());
+    EXPECT(scanner.getMQA_encoder() == kEncoder);
+    EXPECT(scanner.bytesRead() < mqa.size());           // decoding stopped at the sync word
+
+    EXPECT(!scan(scanner, plain, callback));
+    EXPECT(scanner.identified());
+    EXPECT(scanner.error().empty());
+    EXPECT(scanner.getMQA_encoder().empty());
+    EXPECT(scanner.bytesRead() == plain.size());
+
+    const std::vector<uint8_t> truncated(mqa.begin(), mqa.begin() + 100);
+    EXPECT(!scan(scanner, truncated, callback));
+    EXPECT(!scanner.identified());
+    EXPECT(scanner.error() == "truncated metadata");
+
+    const std::vector<uint8_t> garbage(4096, 0x55);
+    EXPECT(!scan(scanner, garbage, callback));
+    EXPECT(!scanner.identified());
+    EXPECT(scanner.error() == "not a flac stream");
+}
+
+
+void noAllocations(const std::vector<uint8_t> &mqa, const std::vector<uint8_t> &plain, bool callback) {
+    BufferScanner scanner;
+    (void) scan(scanner, mqa, callback);
+    (void) scan(scanner, plain, callback);
+#ifdef __GLIBC__
+    const auto before = allocations;
+    for (int i = 0; i < 10; i++) {
+        EXPECT(scan(scanner, mqa, callback));
+        EXPECT(!scan(scanner, plain, callback));
+    }
+    const auto allocated = allocations - before;
+    EXPECT(allocated == 0);
+    if (allocated)
+        std::cerr << allocated << " allocations over 20 scans" << (callback ? " through a callback\n" : "\n");
+#endif
+}
+
+}
+
+
+int main(int argc, char *argv[]) {
+    const std::string path = argc > 1 ? argv[1] : "buffer_scanner_test.flac";
+
+    EXPECT(encode(path, true));
+    const auto mqa = contents(path);
+    EXPECT(encode(path, false));
+    const auto plain = contents(path);
+    std::remove(path.c_str());
+
+    for (const bool callback : {false, true}) {
+        results(mqa, plain, callback);
+        noAllocations(mqa, plain, callback);
+    }
+
+    if (failures)
+        std::cerr << failures << " checks failed\n";
+    return failures ? 1 : 0;
+}
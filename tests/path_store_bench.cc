@@ -0,0 +1,127 @@
+/**
+ * @file        path_store_bench.cc
+ * @short       Peak memory of a large synthetic file list, kept in a PathStore or as full path strings
+ *
+ * Generates the paths of a music library laid out as artist/album/track (5 million files by default) in the
+ * order a directory walk finds them, and stores them the way the tool does: "tree" adds directory nodes and
+ * leaf names as recursiveScan() does, "list" adds full paths as --files-from does, and "strings" keeps a
+ * std::vector<std::string> of full paths as the tool did before PathStore. Run each mode in its own process,
+ * the peak RSS it reports covers that mode alone:
+ *
+ *     path_store_bench tree|list|strings [files]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+ #include <sys/resource.h>
+#endif
+
+#include "../path_store.h"
+
+
+namespace {
+
+constexpr size_t kAlbumsPerArtist = 10;
+constexpr size_t kTracksPerAlbum = 20;
+const char *const kRoot = "/srv/media/music/library";
+
+
+/**
+ * @short Peak resident set size of the process in KiB, 0 where unknown
+ */
+long peakRss() {
+#ifndef _WIN32
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+
+std::string artist(size_t a) {
+    return "Artist With A Fairly Usual Name " + std::to_string(a);
+}
+
+std::string album(size_t a, size_t b) {
+    return std::to_string(1970 + (a + b) % 50) + " - Album Title Number " + std::to_string(b) + " [FLAC 24-96]";
+}
+
+std::string track(size_t t) {
+    char name[64];
+    std::snprintf(name, sizeof(name), "%02zu - Track Title Of Average Length %zu.flac", t + 1, t + 1);
+    return name;
+}
+
+
+/**
+ * @short Walk the synthetic library: directory callbacks as they are entered, then their files
+ */
+template <class OnArtist, class OnAlbum, class OnTrack>
+void walk(size_t files, OnArtist onArtist, OnAlbum onAlbum, OnTrack onTrack) {
+    const size_t artists = (files + kAlbumsPerArtist * kTracksPerAlbum - 1) / (kAlbumsPerArtist * kTracksPerAlbum);
+    size_t count = 0;
+    for (size_t a = 0; a < artists && count < files; a++) {
+        onArtist(a);
+        for (size_t b = 0; b < kAlbumsPerArtist && count < files; b++) {
+            onAlbum(a, b);
+            for (size_t t = 0; t < kTracksPerAlbum && count < files; t++, count++)
+                onTrack(t);
+        }
+    }
+}
+
+}
+
+
+int main(int argc, char *argv[]) {
+    const std::string mode = argc > 1 ? argv[1] : "";
+    const size_t files = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 5000000;
+    if (mode != "tree" && mode != "list" && mode != "strings") {
+        std::fprintf(stderr, "usage: %s tree|list|strings [files]\n", argv[0]);
+        return 2;
+    }
+
+    const long rssBefore = peakRss();
+    const auto start = std::chrono::steady_clock::now();
+    PathStore store;
+    std::vector<std::string> strings;
+    std::string artistPath, albumPath;
+
+    if (mode == "tree") {
+        const auto root = store.addDirectory(PathStore::kNoParent, kRoot);
+        PathStore::DirId artistDir = root, albumDir = root;
+        walk(files,
+             [&](size_t a) { artistDir = store.addDirectory(root, artist(a)); },
+             [&](size_t a, size_t b) { albumDir = store.addDirectory(artistDir, album(a, b)); },
+             [&](size_t t) { store.addFile(albumDir, track(t)); });
+    } else {
+        walk(files,
+             [&](size_t a) { artistPath = std::string(kRoot) + '/' + artist(a) + '/'; },
+             [&](size_t a, size_t b) { albumPath = artistPath + album(a, b) + '/'; },
+             [&](size_t t) {
+                 if (mode == "list")
+                     store.addFile(albumPath + track(t));
+                 else
+                     strings.push_back(albumPath + track(t));
+             });
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // touch the stored paths, so they can't be optimised away
+    const size_t stored = mode == "strings" ? strings.size() : store.size();
+    size_t checksum = 0;
+    for (size_t i = 0; i < stored; i += 4099)
+        checksum += mode == "strings" ? strings[i].size() : store.path(i).size();
+
+    std::printf("mode=%s files=%zu peak_rss_kib=%ld startup_rss_kib=%ld store_bytes=%zu seconds=%.2f check=%zu\n",
+                mode.c_str(), stored, peakRss(), rssBefore, mode == "strings" ? 0 : store.memoryUsage(), seconds,
+                checksum);
+    return 0;
+}
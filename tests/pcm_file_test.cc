@@ -0,0 +1,361 @@
+/**
+ * @file        pcm_file_test.cc
+ * @short       Container parsing and detection of uncompressed files, on files generated by the test
+ *
+ * Each case writes a short stereo file (WAV, WAVE_FORMAT_EXTENSIBLE, RF64/BW64, Wave64, AIFF, AIFF-C) around
+ * noise samples, with or without an MQA sync word carried by the xor of the channels. The layout found by
+ * parsePcmLayout() is checked, and PcmFile has to agree with an MQADetector fed the same samples directly.
+ * Broken and unsupported files have to fail with their error.
+ */
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../pcm_file.h"
+
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT(condition)                                                                   \
+    do {                                                                                    \
+        if (!(condition)) {                                                                 \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": expected " #condition "\n";      \
+            failures++;                                                                     \
+        }                                                                                   \
+    } while (false)
+
+
+constexpr uint32_t kRate = 96000;
+constexpr size_t kFrames = 50000;
+constexpr size_t kSyncAt = 20000;
+constexpr uint64_t kSyncWord = 0xbe0498c88;     // 36 bits, followed by 34 bits of stream info
+
+using Frames = std::vector<std::array<int32_t, 2>>;
+using Bytes = std::vector<uint8_t>;
+
+
+/**
+ * @short Noise of the given width, with the sync word and stream info in the 16th bit from the top when mqa
+ */
+Frames noise(unsigned bits, bool mqa) {
+    Frames frames(kFrames);
+    uint32_t seed = bits * 7919 + mqa;
+    for (auto &frame : frames)
+        for (auto &sample : frame) {
+            seed = seed * 1664525 + 1013904223;
+            sample = static_cast<int32_t>(seed) >> (32 - bits);
+        }
+    if (mqa) {
+        const uint64_t info = 0x2aaaaaaaa;
+        const unsigned shift = bits - 15;
+        for (size_t bit = 0; bit < 36 + 34; bit++) {
+            const uint32_t want = bit < 36 ? (kSyncWord >> (35 - bit)) & 1 : (info >> (bit - 36)) & 1;
+            auto &frame = frames[kSyncAt + bit];
+            if ((((uint32_t(frame[0]) ^ uint32_t(frame[1])) >> shift) & 1) != want)
+                frame[1] ^= 1 << shift;
+        }
+    }
+    return frames;
+}
+
+
+MQAStream reference(const Frames &frames, unsigned bits) {
+    MQADetector detector(bits, uint64_t(kRate) * 3);
+    detector.addFrames(frames.size(), [&](size_t i) { return uint32_t(frames[i][0]) ^ uint32_t(frames[i][1]); });
+    detector.finish();
+    return detector.stream();
+}
+
+
+void put(Bytes &out, uint64_t value, unsigned bytes, bool big_endian = false) {
+    for (unsigned i = 0; i < bytes; i++)
+        out.push_back(static_cast<uint8_t>(value >> (8 * (big_endian ? bytes - 1 - i : i))));
+}
+
+void put(Bytes &out, const char *text) {
+    while (*text)
+        out.push_back(static_cast<uint8_t>(*text++));
+}
+
+void put(Bytes &out, const Bytes &bytes) {
+    out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+
+/**
+ * @short Samples of the frames, each shifted left by shift (valid bits left-justified in a wider container)
+ */
+Bytes samples(const Frames &frames, unsigned bytes, bool big_endian, unsigned shift = 0) {
+    Bytes out;
+    for (const auto &frame : frames)
+        for (const auto sample : frame)
+            put(out, uint32_t(sample) << shift, bytes, big_endian);
+    return out;
+}
+
+
+/**
+ * @short WAVEFORMATEX (16 bytes) or WAVEFORMATEXTENSIBLE (40 bytes) body
+ */
+Bytes waveFormat(unsigned channels, unsigned bits, unsigned container, bool extensible, unsigned tag = 1) {
+    Bytes fmt;
+    const unsigned align = channels * container / 8;
+    put(fmt, extensible ? 0xFFFE : tag, 2);
+    put(fmt, channels, 2);
+    put(fmt, kRate, 4);
+    put(fmt, kRate * align, 4);
+    put(fmt, align, 2);
+    put(fmt, extensible ? container : bits, 2);
+    if (extensible) {
+        put(fmt, 22, 2);
+        put(fmt, bits, 2);          // valid bits
+        put(fmt, 3, 4);             // channel mask
+        put(fmt, tag, 4);           // subformat GUID, starting with the format tag
+        put(fmt, 0x00100000, 4);
+        put(fmt, 0xaa000080, 4);
+        put(fmt, 0x719b3800, 4);
+    }
+    return fmt;
+}
+
+
+Bytes riff(const char *magic, const Bytes &chunks) {
+    Bytes out;
+    put(out, magic);
+    put(out, std::string(magic) == "RIFF" ? chunks.size() + 4 : 0xFFFFFFFF, 4);
+    put(out, "WAVE");
+    put(out, chunks);
+    return out;
+}
+
+void chunk(Bytes &out, const char *id, const Bytes &body, uint64_t length = UINT64_MAX) {
+    put(out, id);
+    put(out, length == UINT64_MAX ? body.size() : length, 4);
+    put(out, body);
+    if (body.size() & 1u)
+        out.push_back(0);
+}
+
+
+const uint8_t kW64Riff[16] = {'r', 'i', 'f', 'f', 0x2E, 0x91, 0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0, 0};
+
+void w64Guid(Bytes &out, const char *fourcc) {
+    put(out, fourcc);
+    out.insert(out.end(), pcm_file::kW64GuidTail, pcm_file::kW64GuidTail + sizeof pcm_file::kW64GuidTail);
+}
+
+
+/**
+ * @short AIFF or AIFF-C file, compression is "NONE", "sowt" (little endian) or another AIFF-C type
+ */
+Bytes aiff(const Frames &frames, unsigned bits, const char *compression) {
+    const bool little = compression && std::string(compression) == "sowt";
+    const auto data = samples(frames, (bits + 7) / 8, !little);
+    Bytes out;
+    put(out, "FORM");
+    put(out, 0, 4, true);
+    put(out, compression ? "AIFC" : "AIFF");
+    put(out, "COMM");
+    put(out, compression ? 22 : 18, 4, true);
+    put(out, 2, 2, true);
+    put(out, frames.size(), 4, true);
+    put(out, bits, 2, true);
+    put(out, 0x400F, 2, true);                      // 96000 as an 80 bit extended
+    put(out, 0xBB80000000000000ull, 8, true);
+    if (compression)
+        put(out, compression);
+    put(out, "SSND");
+    put(out, data.size() + 8, 4, true);
+    put(out, 0, 8, true);                           // offset and block size
+    put(out, data);
+    return out;
+}
+
+
+bool save(const std::string &path, const Bytes &contents) {
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    const bool written = std::fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+    return std::fclose(file) == 0 && written;
+}
+
+
+/**
+ * @short Write a file and check what is found in it
+ * @param expected what detection finds in the samples of the file
+ */
+void expectLayout(const std::string &path, const Bytes &contents, const Frames &frames, const MQAStream &expected,
+                  unsigned valid_bits, unsigned container_bits, bool big_endian) {
+    EXPECT(save(path, contents));
+    MappedFile mapping(path);
+    PcmLayout layout;
+    EXPECT(parsePcmLayout(mapping, layout).empty());
+    EXPECT(layout.sample_rate == kRate);
+    EXPECT(layout.channels == 2);
+    EXPECT(layout.valid_bits == valid_bits);
+    EXPECT(layout.container_bits == container_bits);
+    EXPECT(layout.block_align == container_bits / 4);
+    EXPECT(layout.big_endian == big_endian);
+    EXPECT(layout.data_size == frames.size() * layout.block_align);
+
+    PcmFile pcm(path);
+    EXPECT(pcm.detect() == expected.isMQA);
+    EXPECT(pcm.identified());
+    EXPECT(pcm.error().empty());
+    EXPECT(pcm.originalSampleRate() == expected.originalSampleRate);
+    EXPECT(pcm.isMQAStudio() == expected.isMQAStudio);
+    EXPECT(pcm.bitsPerSample() == valid_bits);
+}
+
+
+void expectError(const std::string &path, const Bytes &contents, const std::string &error) {
+    EXPECT(save(path, contents));
+    PcmFile pcm(path);
+    EXPECT(!pcm.detect());
+    EXPECT(!pcm.identified());
+    if (pcm.error() != error)
+        std::cerr << "  got \"" << pcm.error() << "\", expected \"" << error << "\"\n";
+    EXPECT(pcm.error() == error);
+}
+
+
+void wave(const std::string &path, unsigned bits, bool mqa) {
+    const auto frames = noise(bits, mqa);
+    const auto expected = reference(frames, bits);
+    EXPECT(expected.isMQA == mqa);
+    const auto data = samples(frames, bits / 8, false);
+
+    // an odd sized chunk before the samples is padded to an even length
+    Bytes chunks;
+    chunk(chunks, "fmt ", waveFormat(2, bits, bits, false));
+    chunk(chunks, "LIST", {'a', 'b', 'c'});
+    chunk(chunks, "data", data);
+    expectLayout(path, riff("RIFF", chunks), frames, expected, bits, bits, false);
+
+    // valid bits left-justified in a 32 bit container
+    chunks.clear();
+    chunk(chunks, "fmt ", waveFormat(2, bits, 32, true));
+    chunk(chunks, "data", samples(frames, 4, false, 32 - bits));
+    expectLayout(path, riff("RIFF", chunks), frames, expected, bits, 32, false);
+
+    // RF64 and BW64: the data size is in ds64
+    for (const char *magic : {"RF64", "BW64"}) {
+        Bytes ds64;
+        put(ds64, 0, 8);
+        put(ds64, data.size(), 8);
+        put(ds64, frames.size(), 8);
+        put(ds64, 0, 4);
+        chunks.clear();
+        chunk(chunks, "ds64", ds64);
+        chunk(chunks, "fmt ", waveFormat(2, bits, bits, true));
+        chunk(chunks, "data", data, 0xFFFFFFFF);
+        expectLayout(path, riff(magic, chunks), frames, expected, bits, bits, false);
+    }
+
+    // Wave64: GUID chunk ids, 64 bit sizes counting the header, 8 byte alignment
+    Bytes w64(kW64Riff, kW64Riff + sizeof kW64Riff);
+    put(w64, 0, 8);
+    w64Guid(w64, "wave");
+    w64Guid(w64, "fmt ");
+    put(w64, 24 + 16, 8);
+    put(w64, waveFormat(2, bits, bits, false));
+    w64Guid(w64, "data");
+    put(w64, 24 + data.size(), 8);
+    put(w64, data);
+    expectLayout(path, w64, frames, expected, bits, bits, false);
+
+    expectLayout(path, aiff(frames, bits, nullptr), frames, expected, bits, bits, true);
+    expectLayout(path, aiff(frames, bits, "NONE"), frames, expected, bits, bits, true);
+    expectLayout(path, aiff(frames, bits, "sowt"), frames, expected, bits, bits, false);
+}
+
+
+/**
+ * @short 20 bit samples in 3 bytes, with wBitsPerSample 20 and a block align of 6
+ */
+void wave20(const std::string &path) {
+    const auto frames = noise(24, true);
+    const auto expected = reference(frames, 24);
+    EXPECT(expected.isMQA);
+    Bytes fmt = waveFormat(2, 24, 24, false);
+    fmt[14] = 20;
+    Bytes chunks;
+    chunk(chunks, "fmt ", fmt);
+    chunk(chunks, "data", samples(frames, 3, false));
+    expectLayout(path, riff("RIFF", chunks), frames, expected, 20, 24, false);
+}
+
+
+void broken(const std::string &path) {
+    const auto frames = noise(16, false);
+    const auto data = samples(frames, 2, false);
+
+    expectError(path, {'R', 'I', 'F', 'F', 0, 0}, "unknown container");
+    expectError(path, riff("RIFF", {}), "no data chunk");
+
+    Bytes chunks;
+    chunk(chunks, "data", data);
+    chunk(chunks, "fmt ", waveFormat(2, 16, 16, false));
+    expectError(path, riff("RIFF", chunks), "data chunk before fmt chunk");
+
+    chunks.clear();
+    chunk(chunks, "fmt ", waveFormat(2, 32, 32, false, 3));
+    chunk(chunks, "data", data);
+    expectError(path, riff("RIFF", chunks), "not integer PCM");
+
+    chunks.clear();
+    chunk(chunks, "fmt ", waveFormat(2, 32, 32, true, 3));
+    chunk(chunks, "data", data);
+    expectError(path, riff("RIFF", chunks), "not integer PCM");
+
+    Bytes fmt = waveFormat(2, 16, 16, false);
+    fmt[12] = 3;        // block align not a multiple of the channels
+    chunks.clear();
+    chunk(chunks, "fmt ", fmt);
+    chunk(chunks, "data", data);
+    expectError(path, riff("RIFF", chunks), "inconsistent fmt chunk (block align)");
+
+    fmt = waveFormat(2, 16, 16, false);
+    fmt[14] = 24;       // wider than the block align says
+    chunks.clear();
+    chunk(chunks, "fmt ", fmt);
+    chunk(chunks, "data", data);
+    expectError(path, riff("RIFF", chunks), "inconsistent fmt chunk (bits per sample)");
+
+    chunks.clear();
+    chunk(chunks, "fmt ", waveFormat(1, 16, 16, false));
+    chunk(chunks, "data", data);
+    expectError(path, riff("RIFF", chunks), "unsupported stream (only 16 to 32 bit stereo)");
+
+    expectError(path, aiff(frames, 16, "ima4"), "compressed AIFF-C");
+
+    std::remove(path.c_str());
+    PcmFile missing(path);
+    EXPECT(!missing.detect());
+    EXPECT(missing.error() == "couldn't open the file");
+}
+
+}
+
+
+int main(int argc, char *argv[]) {
+    const std::string path = argc > 1 ? argv[1] : "pcm_file_test.wav";
+
+    for (const unsigned bits : {16u, 24u})
+        for (const bool mqa : {false, true})
+            wave(path, bits, mqa);
+    wave20(path);
+    broken(path);
+
+    std::remove(path.c_str());
+    if (failures)
+        std::cerr << failures << " checks failed\n";
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,343 @@
+/**
+ * @file        tag_writer_test.cc
+ * @short       Round trip of the in-place VORBIS_COMMENT writes, checked with libFLAC's metadata reader
+ *
+ * Each case encodes a short stereo file with a given metadata layout, writes the MQA tags over it with
+ * writeVorbisCommentInPlace() and reads the result back with FLAC::Metadata::Chain: block order, last-block
+ * flags, padding sizes, moved blocks and tags are checked, and the audio is decoded with its MD5 verified.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <FLAC++/decoder.h>
+#include <FLAC++/encoder.h>
+#include <FLAC++/metadata.h>
+
+#include "../tag_writer.h"
+
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT(condition)                                                                   \
+    do {                                                                                    \
+        if (!(condition)) {                                                                 \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": expected " #condition "\n";      \
+            failures++;                                                                     \
+        }                                                                                   \
+    } while (false)
+
+
+constexpr uint32_t kOriginalRate = 96000;
+constexpr unsigned kSamples = 3 * 4096 + 100;
+const FLAC__byte kApplicationId[4] = {'t', 'e', 's', 't'};
+const std::vector<FLAC__byte> kApplicationData = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17};
+
+
+/**
+ * Metadata layout of a test file, after STREAMINFO
+ */
+struct Layout {
+    bool comment = true;
+    bool application = false;       // between the comment and the padding
+    int64_t padding = -1;           // length of the PADDING block, -1 for none
+};
+
+
+struct Block {
+    FLAC__MetadataType type;
+    bool is_last;
+    unsigned length;
+};
+
+
+/**
+ * Metadata of a file as read by libFLAC
+ */
+struct Metadata {
+    std::vector<Block> blocks;
+    std::unique_ptr<FLAC::Metadata::VorbisComment> comment;
+    std::vector<FLAC__byte> application;
+};
+
+
+bool encode(const std::string &path, const Layout &layout) {
+    FLAC::Metadata::VorbisComment comment;
+    (void) comment.append_comment(FLAC::Metadata::VorbisComment::Entry("TITLE", "tag writer test"));
+    FLAC::Metadata::Application application;
+    application.set_id(kApplicationId);
+    (void) application.set_data(kApplicationData.data(), static_cast<unsigned>(kApplicationData.size()));
+    FLAC::Metadata::Padding padding;
+    padding.set_length(layout.padding > 0 ? static_cast<unsigned>(layout.padding) : 0);
+
+    std::vector<FLAC::Metadata::Prototype *> blocks;
+    if (layout.comment) blocks.push_back(&comment);
+    if (layout.application) blocks.push_back(&application);
+    if (layout.padding >= 0) blocks.push_back(&padding);
+
+    FLAC::Encoder::File encoder;
+    (void) encoder.set_channels(2);
+    (void) encoder.set_bits_per_sample(16);
+    (void) encoder.set_sample_rate(44100);
+    (void) encoder.set_total_samples_estimate(kSamples);
+    (void) encoder.set_metadata(blocks.data(), static_cast<unsigned>(blocks.size()));
+    if (encoder.init(path.c_str()) != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+        return false;
+
+    std::vector<FLAC__int32> samples(2 * kSamples);
+    for (size_t i = 0; i < kSamples; i++) {
+        samples[2 * i] = static_cast<FLAC__int32>((i * 37) % 20000) - 10000;
+        samples[2 * i + 1] = static_cast<FLAC__int32>((i * 53) % 16000) - 8000;
+    }
+    return encoder.process_interleaved(samples.data(), kSamples) && encoder.finish();
+}
+
+
+bool readMetadata(const std::string &path, Metadata &metadata) {
+    FLAC::Metadata::Chain chain;
+    if (!chain.read(path.c_str()))
+        return false;
+
+    FLAC::Metadata::Iterator iterator;
+    iterator.init(chain);
+    do {
+        std::unique_ptr<FLAC::Metadata::Prototype> block(iterator.get_block());
+        if (!block)
+            return false;
+        metadata.blocks.push_back(Block{block->get_type(), block->get_is_last(), block->get_length()});
+        if (const auto *comment = dynamic_cast<FLAC::Metadata::VorbisComment *>(block.get()))
+            metadata.comment = std::make_unique<FLAC::Metadata::VorbisComment>(*comment);
+        else if (const auto *application = dynamic_cast<FLAC::Metadata::Application *>(block.get()))
+            metadata.application.assign(application->get_data(), application->get_data() + block->get_length() - 4);
+    } while (iterator.next());
+    return true;
+}
+
+
+/**
+ * @short Decode the whole file, its MD5 signature checked
+ */
+bool audioIntact(const std::string &path) {
+    class Decoder : public FLAC::Decoder::File {
+     public:
+      uint64_t samples = 0;
+      bool errors = false;
+
+     protected:
+      ::FLAC__StreamDecoderWriteStatus write_callback(const ::FLAC__Frame *frame, const FLAC__int32 *const[]) override {
+          this->samples += frame->header.blocksize;
+          return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+      }
+      void error_callback(::FLAC__StreamDecoderErrorStatus) override { this->errors = true; }
+    } decoder;
+
+    (void) decoder.set_md5_checking(true);
+    if (decoder.init(path.c_str()) != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+        return false;
+    const bool decoded = decoder.process_until_end_of_stream();
+    return decoded && decoder.finish() && !decoder.errors && decoder.samples == kSamples;
+}
+
+
+std::vector<char> contents(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+}
+
+
+bool hasComment(const FLAC::Metadata::VorbisComment &comment, const std::string &field) {
+    for (unsigned i = 0; i < comment.get_num_comments(); i++) {
+        const auto entry = comment.get_comment(i);
+        if (std::string(entry.get_field(), entry.get_field_length()) == field)
+            return true;
+    }
+    return false;
+}
+
+
+/**
+ * The file's comment with the MQA tags added, and how many bytes it grew by (header included)
+ */
+struct Update {
+    FLAC::Metadata::VorbisComment comment;
+    uint64_t growth = 0;
+};
+
+
+Update tagsFor(const std::string &path) {
+    Update update;
+    Metadata metadata;
+    if (readMetadata(path, metadata) && metadata.comment)
+        update.comment = *metadata.comment;
+    const uint64_t before = metadata.comment ? serializeVorbisComment(*metadata.comment, false).size() : 0;
+    (void) applyMQATags(update.comment, kOriginalRate, false);
+    update.growth = serializeVorbisComment(update.comment, false).size() - before;
+    return update;
+}
+
+
+/**
+ * @short Write the tags of an update over a file
+ * @return whether writeVorbisCommentInPlace() wrote them
+ */
+bool writeInPlace(const std::string &path, const Update &update, uint64_t &bytes_written) {
+    std::FILE *handle = std::fopen(path.c_str(), "r+b");
+    if (!handle)
+        return false;
+    std::vector<MetadataBlock> blocks;
+    const bool written = readMetadataLayout(handle, blocks)
+                         && writeVorbisCommentInPlace(handle, blocks, update.comment, bytes_written);
+    std::fclose(handle);
+    return written;
+}
+
+
+void expectTags(const Metadata &metadata, bool title) {
+    EXPECT(metadata.comment != nullptr);
+    if (!metadata.comment)
+        return;
+    EXPECT(hasComment(*metadata.comment, "ORIGINALSAMPLERATE=" + std::to_string(kOriginalRate)));
+    EXPECT(hasComment(*metadata.comment, "TITLE=tag writer test") == title);
+    bool encoder = false;
+    for (unsigned i = 0; i < metadata.comment->get_num_comments(); i++)
+        encoder |= std::string(metadata.comment->get_comment(i).get_field_name()) == "MQAENCODER";
+    EXPECT(encoder);
+}
+
+
+/**
+ * @short Only the last block carries the last-metadata-block flag
+ */
+void expectLastFlags(const Metadata &metadata) {
+    for (size_t i = 0; i < metadata.blocks.size(); i++)
+        EXPECT(metadata.blocks[i].is_last == (i + 1 == metadata.blocks.size()));
+}
+
+
+void commentThenPadding(const std::string &path) {
+    EXPECT(encode(path, Layout{true, false, 4096}));
+    const auto update = tagsFor(path);
+    uint64_t written = 0;
+    EXPECT(writeInPlace(path, update, written));
+
+    Metadata metadata;
+    EXPECT(readMetadata(path, metadata));
+    EXPECT(metadata.blocks.size() == 3);
+    if (metadata.blocks.size() == 3) {
+        EXPECT(metadata.blocks[1].type == FLAC__METADATA_TYPE_VORBIS_COMMENT);
+        EXPECT(metadata.blocks[2].type == FLAC__METADATA_TYPE_PADDING);
+        EXPECT(metadata.blocks[2].length == 4096 - update.growth);
+        // only the comment and the padding header were written, not the rest of the padding
+        EXPECT(written == 4 + metadata.blocks[1].length + 4 + metadata.blocks[2].length);
+    }
+    expectLastFlags(metadata);
+    expectTags(metadata, true);
+    EXPECT(audioIntact(path));
+}
+
+
+void blockMovedUp(const std::string &path) {
+    EXPECT(encode(path, Layout{true, true, 1024}));
+    const auto update = tagsFor(path);
+    uint64_t written = 0;
+    EXPECT(writeInPlace(path, update, written));
+
+    Metadata metadata;
+    EXPECT(readMetadata(path, metadata));
+    EXPECT(metadata.blocks.size() == 4);
+    if (metadata.blocks.size() == 4) {
+        EXPECT(metadata.blocks[1].type == FLAC__METADATA_TYPE_VORBIS_COMMENT);
+        EXPECT(metadata.blocks[2].type == FLAC__METADATA_TYPE_APPLICATION);
+        EXPECT(metadata.blocks[3].type == FLAC__METADATA_TYPE_PADDING);
+        EXPECT(metadata.blocks[3].length == 1024 - update.growth);
+    }
+    EXPECT(metadata.application == kApplicationData);
+    expectLastFlags(metadata);
+    expectTags(metadata, true);
+    EXPECT(audioIntact(path));
+}
+
+
+void exactFit(const std::string &path) {
+    // a first encode tells how much the comment grows, the padding is then sized to that exactly
+    EXPECT(encode(path, Layout{true, true, 0}));
+    const auto growth = tagsFor(path).growth;
+    EXPECT(growth >= 4);
+    EXPECT(encode(path, Layout{true, true, static_cast<int64_t>(growth) - 4}));
+    const auto update = tagsFor(path);
+    uint64_t written = 0;
+    EXPECT(writeInPlace(path, update, written));
+
+    // no padding left: the moved block becomes the last one
+    Metadata metadata;
+    EXPECT(readMetadata(path, metadata));
+    EXPECT(metadata.blocks.size() == 3);
+    if (metadata.blocks.size() == 3) {
+        EXPECT(metadata.blocks[1].type == FLAC__METADATA_TYPE_VORBIS_COMMENT);
+        EXPECT(metadata.blocks[2].type == FLAC__METADATA_TYPE_APPLICATION);
+    }
+    EXPECT(metadata.application == kApplicationData);
+    expectLastFlags(metadata);
+    expectTags(metadata, true);
+    EXPECT(audioIntact(path));
+}
+
+
+void paddingWithoutComment(const std::string &path) {
+    EXPECT(encode(path, Layout{false, false, 2048}));
+    const auto update = tagsFor(path);
+    uint64_t written = 0;
+    EXPECT(writeInPlace(path, update, written));
+
+    Metadata metadata;
+    EXPECT(readMetadata(path, metadata));
+    EXPECT(metadata.blocks.size() == 3);
+    if (metadata.blocks.size() == 3) {
+        EXPECT(metadata.blocks[1].type == FLAC__METADATA_TYPE_VORBIS_COMMENT);
+        EXPECT(metadata.blocks[2].type == FLAC__METADATA_TYPE_PADDING);
+        EXPECT(metadata.blocks[2].length == 2048 - update.growth);
+    }
+    expectLastFlags(metadata);
+    expectTags(metadata, false);
+    EXPECT(audioIntact(path));
+}
+
+
+void noFit(const std::string &path, int64_t spare) {
+    EXPECT(encode(path, Layout{true, false, 0}));
+    const auto growth = static_cast<int64_t>(tagsFor(path).growth);
+    // padding one byte short, or a few bytes over but too few for a PADDING header
+    EXPECT(encode(path, Layout{true, false, growth - 4 + spare}));
+    const auto before = contents(path);
+    uint64_t written = 0;
+    EXPECT(!writeInPlace(path, tagsFor(path), written));
+    EXPECT(contents(path) == before);
+    EXPECT(audioIntact(path));
+}
+
+}
+
+
+int main(int argc, char *argv[]) {
+    const std::string path = argc > 1 ? argv[1] : "tag_writer_test.flac";
+
+    commentThenPadding(path);
+    blockMovedUp(path);
+    exactFit(path);
+    paddingWithoutComment(path);
+    noFit(path, -1);
+    noFit(path, 2);
+
+    std::remove(path.c_str());
+    if (failures)
+        std::cerr << failures << " checks failed\n";
+    return failures ? 1 : 0;
+}
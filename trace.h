@@ -0,0 +1,226 @@
+/**
+ * @file        trace.h
+ * @short       Timeline of a scan in Chrome trace-event format (chrome://tracing, Perfetto)
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "record_writer.h"
+
+
+/**
+ * Trace recorder.
+ * Spans are buffered per thread and appended to the trace file in chunks, so recording takes no lock and
+ * memory stays bounded on long runs. Only one trace is recorded at a time; while none is active, spans cost
+ * a single atomic load.
+ */
+class Trace {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  /**
+   * @short Active trace, nullptr when not tracing
+   */
+  static Trace *active() noexcept {
+      return current_().load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @short Start tracing to a file
+   * @return nullptr if the file can't be created
+   */
+  static std::unique_ptr<Trace> start(const std::string &file) {
+      std::FILE *out = std::fopen(file.c_str(), "wb");
+      if (!out)
+          return nullptr;
+      std::unique_ptr<Trace> trace(new Trace(out));
+      current_().store(trace.get());
+      return trace;
+  }
+
+  ~Trace() {
+      this->finish();
+  }
+
+  /**
+   * @short Name the calling thread in the trace
+   */
+  void nameThread(std::string_view name) {
+      auto &buffer = this->buffer();
+      buffer.name = name;
+  }
+
+  /**
+   * @short Record a complete span of the calling thread
+   * @param name span name (must outlive the trace, e.g. a literal), nullptr to name it after the file
+   * @param category span category (must outlive the trace)
+   * @param file file the span belongs to (empty for none)
+   */
+  void span(const char *name, const char *category, Clock::time_point begin, Clock::time_point end,
+            std::string_view file = {}) {
+      auto &buffer = this->buffer();
+      buffer.events.push_back(Event{name, category, begin, end, std::string(file)});
+      if (buffer.events.size() >= kChunk)
+          this->flush(buffer);
+  }
+
+  /**
+   * @short Stop tracing and complete the trace file (threads must be done recording)
+   */
+  void finish() {
+      if (!this->out_)
+          return;
+      Trace *self = this;
+      current_().compare_exchange_strong(self, nullptr);
+
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      for (auto &buffer : this->buffers_) {
+          this->write(*buffer);
+          if (!buffer->name.empty()) {
+              std::string meta = this->separator() + "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+                                 + std::to_string(buffer->tid) + ",\"args\":{\"name\":";
+              appendJSONString(meta, buffer->name);
+              meta += "}}";
+              std::fwrite(meta.data(), 1, meta.size(), this->out_);
+          }
+      }
+      std::fputs("\n]}\n", this->out_);
+      std::fclose(this->out_);
+      this->out_ = nullptr;
+  }
+
+ private:
+  static constexpr size_t kChunk = 4096;
+
+  struct Event {
+      const char *name;
+      const char *category;
+      Clock::time_point begin;
+      Clock::time_point end;
+      std::string file;
+  };
+
+  struct Buffer {
+      uint32_t tid = 0;
+      std::string name;
+      std::vector<Event> events;
+  };
+
+  std::FILE *out_;
+  Clock::time_point origin_ = Clock::now();
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Buffer>> buffers_;
+  bool first_ = true;
+
+
+  explicit Trace(std::FILE *out) : out_(out) {
+      std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out);
+  }
+
+  static std::atomic<Trace *> &current_() {
+      static std::atomic<Trace *> current{nullptr};
+      return current;
+  }
+
+  /**
+   * @short Buffer of the calling thread, created on its first span
+   */
+  Buffer &buffer() {
+      thread_local Trace *owner = nullptr;
+      thread_local Buffer *buffer = nullptr;
+      if (owner != this) {
+          std::lock_guard<std::mutex> lock(this->mutex_);
+          this->buffers_.push_back(std::make_unique<Buffer>());
+          buffer = this->buffers_.back().get();
+          buffer->tid = static_cast<uint32_t>(this->buffers_.size());
+          buffer->events.reserve(kChunk);
+          owner = this;
+      }
+      return *buffer;
+  }
+
+  void flush(Buffer &buffer) {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      this->write(buffer);
+  }
+
+  std::string separator() {
+      const bool first = this->first_;
+      this->first_ = false;
+      return first ? "\n" : ",\n";
+  }
+
+  void write(Buffer &buffer) {
+      std::string chunk;
+      char times[64];
+      for (const auto &e : buffer.events) {
+          const auto ts = std::chrono::duration<double, std::micro>(e.begin - this->origin_).count();
+          const auto dur = std::chrono::duration<double, std::micro>(e.end - e.begin).count();
+          std::snprintf(times, sizeof times, "\"ts\":%.3f,\"dur\":%.3f", ts, dur);
+
+          chunk += this->separator() + "{\"name\":";
+          if (e.name)
+              appendJSONString(chunk, e.name);
+          else
+              appendJSONString(chunk, std::string_view(e.file).substr(e.file.find_last_of("/\\") + 1));
+          chunk += ",\"cat\":\"";
+          chunk += e.category;
+          chunk += "\",\"ph\":\"X\",";
+          chunk += times;
+          chunk += ",\"pid\":1,\"tid\":" + std::to_string(buffer.tid);
+          if (!e.file.empty()) {
+              chunk += ",\"args\":{\"file\":";
+              appendJSONString(chunk, e.file);
+              chunk += '}';
+          }
+          chunk += '}';
+      }
+      std::fwrite(chunk.data(), 1, chunk.size(), this->out_);
+      buffer.events.clear();
+  }
+};
+
+
+/**
+ * Records its scope as a span of the active trace
+ */
+class TraceSpan {
+ public:
+  /**
+   * @param name span name (a literal), nullptr to name it after the file
+   * @param category span category (a literal)
+   * @param file file the span belongs to, copied only when tracing
+   */
+  explicit TraceSpan(const char *name, const char *category = "stage", std::string_view file = {})
+      : trace_(Trace::active()), name_(name), category_(category) {
+      if (this->trace_) {
+          this->file_ = file;
+          this->begin_ = Trace::Clock::now();
+      }
+  }
+
+  ~TraceSpan() {
+      if (this->trace_)
+          this->trace_->span(this->name_, this->category_, this->begin_, Trace::Clock::now(), this->file_);
+  }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+ private:
+  Trace *trace_;
+  const char *name_;
+  const char *category_;
+  std::string_view file_;
+  Trace::Clock::time_point begin_;
+};
@@ -0,0 +1,113 @@
+/**
+ * @file        xattr_store.h
+ * @short       Detection results kept in extended attributes of the scanned files
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#if defined(__linux__) || defined(__APPLE__)
+ #include <sys/xattr.h>
+#endif
+
+#include "result_cache.h"
+
+#ifndef MQA_IDENTIFIER_VERSION
+ #define MQA_IDENTIFIER_VERSION "1.5.0"
+#endif
+
+
+/**
+ * Extended attributes store.
+ * The result of a file is written in user.mqa.* attributes of the file itself, next to the mtime the file had
+ * when it was decoded and the version of the tool. Attributes don't touch the audio data nor the file's mtime,
+ * so checksums and backups of the file stay valid. A later scan trusts them while the file's mtime and the
+ * tool version still match; the mtime is written last, so an interrupted update is never trusted.
+ */
+namespace xattr_store {
+
+#if defined(__linux__) || defined(__APPLE__)
+constexpr bool kSupported = true;
+#else
+constexpr bool kSupported = false;
+#endif
+
+constexpr const char *kStatus = "user.mqa.status";
+constexpr const char *kStudio = "user.mqa.studio";
+constexpr const char *kRate = "user.mqa.rate";
+constexpr const char *kVersion = "user.mqa.version";
+constexpr const char *kMtime = "user.mqa.mtime";
+
+
+inline bool get(const std::string &path, const char *name, std::string &value) {
+    char buffer[64];
+#if defined(__APPLE__)
+    const auto length = getxattr(path.c_str(), name, buffer, sizeof buffer, 0, 0);
+#elif defined(__linux__)
+    const auto length = getxattr(path.c_str(), name, buffer, sizeof buffer);
+#else
+    const int length = -1;
+    (void) path; (void) name;
+#endif
+    if (length < 0)
+        return false;
+    value.assign(buffer, static_cast<size_t>(length));
+    return true;
+}
+
+
+inline bool set(const std::string &path, const char *name, const std::string &value) {
+#if defined(__APPLE__)
+    return setxattr(path.c_str(), name, value.data(), value.size(), 0, 0) == 0;
+#elif defined(__linux__)
+    return setxattr(path.c_str(), name, value.data(), value.size(), 0) == 0;
+#else
+    (void) path; (void) name; (void) value;
+    return false;
+#endif
+}
+
+
+/**
+ * @short Read the result stored on a file
+ * @param path path of the file
+ * @param mtime_ns current mtime of the file
+ * @param result filled with the stored result
+ * @return true if there is a result written by this version for the current content of the file
+ */
+inline bool load(const std::string &path, int64_t mtime_ns, FileResult &result) {
+    std::string mtime, version, status, studio, rate;
+    if (!get(path, kMtime, mtime) || std::strtoll(mtime.c_str(), nullptr, 10) != mtime_ns
+        || !get(path, kVersion, version) || version != MQA_IDENTIFIER_VERSION
+        || !get(path, kStatus, status) || !get(path, kStudio, studio) || !get(path, kRate, rate))
+        return false;
+
+    result = FileResult{};
+    result.status = status == "MQA" ? ScanStatus::MQA : ScanStatus::NotMQA;
+    result.isMQAStudio = studio == "1";
+    result.originalSampleRate = static_cast<uint32_t>(std::strtoul(rate.c_str(), nullptr, 10));
+    return true;
+}
+
+
+/**
+ * @short Store the result of a file
+ * @param path path of the file
+ * @param mtime_ns mtime of the file before it was decoded
+ * @param result detection result (files that couldn't be identified get no attributes)
+ * @return false if the file system doesn't support user attributes (or the file isn't writable)
+ */
+inline bool store(const std::string &path, int64_t mtime_ns, const FileResult &result) {
+    if (result.status == ScanStatus::Error)     // nothing to trust, the next run tries the file again
+        return true;
+    return set(path, kStatus, result.isMQA() ? "MQA" : "NOT MQA")
+           && set(path, kStudio, result.isMQAStudio ? "1" : "0")
+           && set(path, kRate, std::to_string(result.originalSampleRate))
+           && set(path, kVersion, MQA_IDENTIFIER_VERSION)
+           && set(path, kMtime, std::to_string(mtime_ns));
+}
+
+}  // namespace xattr_store